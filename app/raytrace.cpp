@@ -1,190 +1,442 @@
 // Raytracing concepts and procedure are studied from https://raytracing.github.io/books/RayTracingInOneWeekend.html
 
-#include "vec3.hpp"
-#include "color.hpp"
-#include "ray.hpp"
-#include "sphere.hpp"
-#include "hittable_list.hpp"
-#include "material.hpp"
+#include "scene.hpp"
+#include "binary_scene.hpp"
+#include "mapped_file.hpp"
+#include "memory_usage.hpp"
+#include "renderer.hpp"
+#include "incremental.hpp"
+#include "out_of_core.hpp"
+#include "framebuffer.hpp"
+#include "image_io.hpp"
+#include "render_server.hpp"
+#include "render_coordinator.hpp"
+#include <fstream>
 #include <iostream>
-#include <limits>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
 #include <string>
-#include <sstream>
-#include <cmath>
 
-#define MAX_DEPTH 50
-// #define SAMPLES_PER_PIXEL 50 // Increase this to get better quality, but requires more time
-
-// A simple ray tracer
-// For each pixel, the ray tracer will send (samples_p_pixel) number of rays and figure out the color met by those rays.
-// 1. Shoot multiple ray from the camera. (Rays are slightly altered directions but still towards that pixel)
-// 2. Determine which objects the ray intersects.
-// 3. Stops when it either hits a light source, it scattered too many times, or it was absorbed by metal object.
-color ray_color(const ray &r, const hittable_list &world, int depth, const color background_color_top, const color background_color_bottom)
+int main(int argc, char *argv[])
 {
-    hit_record rec;
-
-    // If we reflect/scatter way to many times, light is all absorbed.
-    if (depth > MAX_DEPTH)
+    // Command line options
+    // --threads N overrides the THREADS setting of the input file
+    int threads_flag = 0;
+    // --heatmap FILE writes the number of samples each pixel got when ADAPTIVE is used
+    std::string heatmap_flag;
+    // --format NAME overrides the FORMAT setting of the input file
+    std::string format_flag;
+    // --checkpoint FILE saves progressive passes to FILE, and resumes from it if it exists
+    std::string checkpoint_flag;
+    // --preview FILE writes the image so far after every progressive pass
+    std::string preview_flag;
+    // --server SOCKET keeps running, rendering scenes sent to SOCKET (--workers N jobs at a time, up to --queue N waiting)
+    server_settings server;
+    // --connect SOCKET has the server render the input file instead, with --width, --samples and --seed overriding the file
+    // --stats and --shutdown instead print the server's counters or stop it
+    std::string connect_flag;
+    std::string command_flag;
+    render_request request;
+    // --convert FILE writes the input file to FILE in the other form (text to binary, or binary to text) instead of rendering it
+    std::string convert_flag;
+    // --render-stats prints what the render did (rays, intersection tests, path lengths and times),
+    // --trace FILE writes a timeline of the render's phases and tiles that chrome://tracing can show. Both need RAYTRACE_STATS.
+    bool render_stats_flag = false;
+    std::string trace_flag;
+    // --frames PATTERN renders every frame of the CAMERA_PATH into its own file, PATTERN with its # replaced by the frame number
+    std::string frames_flag;
+    // --distribute SOCKET,SOCKET... has the render servers at the sockets render the tiles of the image,
+    // --local-workers N starts N render servers on this machine to do it (see render_coordinator.hpp)
+    std::vector<std::string> distribute_flag;
+    int local_workers_flag = 0;
+    // --denoise removes the noise from the image like DENOISE ON, --aov PREFIX writes the first-hit buffers the denoiser uses
+    // to PREFIX_albedo.pfm, PREFIX_normal.pfm and PREFIX_depth.pfm
+    bool denoise_flag = false;
+    std::string aov_flag;
+    // --incremental FILE re-traces only the pixels that the edits since the render saved in FILE can have changed, then saves this render there
+    std::string incremental_flag;
+    // --out-of-core FILE renders into a framebuffer kept in FILE rather than in memory, writing the image out as its rows are finished,
+    // and carries on from the tiles FILE already holds
+    std::string out_of_core_flag;
+    for (int a = 1; a < argc; a++)
     {
-        return color(0, 0, 0);
+        std::string arg = argv[a];
+        if (arg == "--threads" && a + 1 < argc)
+        {
+            threads_flag = std::stoi(argv[++a]);
+        }
+        else if (arg == "--heatmap" && a + 1 < argc)
+        {
+            heatmap_flag = argv[++a];
+        }
+        else if (arg == "--format" && a + 1 < argc)
+        {
+            format_flag = argv[++a];
+        }
+        else if (arg == "--checkpoint" && a + 1 < argc)
+        {
+            checkpoint_flag = argv[++a];
+        }
+        else if (arg == "--preview" && a + 1 < argc)
+        {
+            preview_flag = argv[++a];
+        }
+        else if (arg == "--server" && a + 1 < argc)
+        {
+            server.socket_path = argv[++a];
+        }
+        else if (arg == "--workers" && a + 1 < argc)
+        {
+            server.workers = std::max(1, std::stoi(argv[++a]));
+        }
+        else if (arg == "--queue" && a + 1 < argc)
+        {
+            server.queue_capacity = std::max(1, std::stoi(argv[++a]));
+        }
+        else if (arg == "--max-scene-mb" && a + 1 < argc)
+        {
+            server.max_scene_bytes = (uint64_t)std::max(1, std::stoi(argv[++a])) << 20;
+        }
+        else if (arg == "--connect" && a + 1 < argc)
+        {
+            connect_flag = argv[++a];
+        }
+        else if (arg == "--width" && a + 1 < argc)
+        {
+            request.width = std::stoi(argv[++a]);
+        }
+        else if (arg == "--samples" && a + 1 < argc)
+        {
+            request.samples = std::stoi(argv[++a]);
+        }
+        else if (arg == "--seed" && a + 1 < argc)
+        {
+            request.seed = std::stoull(argv[++a]);
+            request.has_seed = true;
+        }
+        else if (arg == "--convert" && a + 1 < argc)
+        {
+            convert_flag = argv[++a];
+        }
+        else if (arg == "--render-stats")
+        {
+            render_stats_flag = true;
+        }
+        else if (arg == "--trace" && a + 1 < argc)
+        {
+            trace_flag = argv[++a];
+        }
+        else if (arg == "--frames" && a + 1 < argc)
+        {
+            frames_flag = argv[++a];
+        }
+        else if (arg == "--distribute" && a + 1 < argc)
+        {
+            std::string sockets = argv[++a];
+            size_t begin = 0;
+            while (begin <= sockets.size())
+            {
+                size_t end = std::min(sockets.find(',', begin), sockets.size());
+                if (end > begin)
+                    distribute_flag.push_back(sockets.substr(begin, end - begin));
+                begin = end + 1;
+            }
+        }
+        else if (arg == "--local-workers" && a + 1 < argc)
+        {
+            local_workers_flag = std::max(1, std::stoi(argv[++a]));
+        }
+        else if (arg == "--denoise")
+        {
+            denoise_flag = true;
+        }
+        else if (arg == "--aov" && a + 1 < argc)
+        {
+            aov_flag = argv[++a];
+        }
+        else if (arg == "--incremental" && a + 1 < argc)
+        {
+            incremental_flag = argv[++a];
+        }
+        else if (arg == "--out-of-core" && a + 1 < argc)
+        {
+            out_of_core_flag = argv[++a];
+        }
+        else if (arg == "--stats")
+        {
+            command_flag = "STATS";
+        }
+        else if (arg == "--shutdown")
+        {
+            command_flag = "SHUTDOWN";
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--heatmap FILE] [--format ppm|ppm_ascii|pfm|png] [--checkpoint FILE] [--preview FILE] [--denoise] [--aov PREFIX] [--incremental FILE] [--out-of-core FILE] [--render-stats] [--trace FILE] < input.txt > output.ppm\n"
+                      << "       " << argv[0] << " --frames frame_####.ppm [--threads N] [--format NAME] [--denoise] [--aov PREFIX_####] [--render-stats] [--trace FILE] < input.txt\n"
+                      << "       " << argv[0] << " --distribute SOCKET,SOCKET...|--local-workers N [--threads N] [--format NAME] < input.txt > output.ppm\n"
+                      << "       " << argv[0] << " --convert FILE < input.txt\n"
+                      << "       " << argv[0] << " --server SOCKET [--threads N] [--workers N] [--queue N] [--max-scene-mb N]\n"
+                      << "       " << argv[0] << " --connect SOCKET [--width W] [--samples N] [--seed S] [--format NAME] < input.txt > output.ppm\n"
+                      << "       " << argv[0] << " --connect SOCKET --stats|--shutdown" << std::endl;
+            return 1;
+        }
     }
 
-    // Find the closest hittable and render that hittable's color
-    // We set t_min as 0.001 because sometimes the root is calculated to be very small value that is just intersecting with the object that the ray just scattered off.
-    if (world.hit_all(r, (double)0.001, std::numeric_limits<double>::infinity(), rec))
+    if (!server.socket_path.empty())
     {
-        ray scattered_ray;
-        color attenuation;
-        color emitted = rec.mat->emitted();
-        // If ray is reflected
-        if (rec.mat->scatter(r, rec, attenuation, scattered_ray))
+        server.threads_per_job = threads_flag;
+        try
         {
-            // Attenuation is the color of the material, and will cause bias to color (alter the color of further objects being hit by ray)
-            return attenuation * ray_color(scattered_ray, world, depth + 1, background_color_top, background_color_bottom);
+            render_server(server).run();
         }
-
-        // If no scatter, means ray either hit a light or ray is absorbed by metal
-        return emitted;
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
     }
 
-    // If ray hits nothing, we return background color
+    if (!connect_flag.empty())
+    {
+        try
+        {
+            std::vector<unsigned char> reply;
+            if (!command_flag.empty())
+            {
+                reply = send_request(connect_flag, command_flag + "\n");
+            }
+            else
+            {
+                if (!format_flag.empty())
+                {
+                    if (!parse_image_format(format_flag, request.format))
+                    {
+                        throw std::runtime_error("Invalid image format " + format_flag);
+                    }
+                    request.has_format = true;
+                }
+                std::string text((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+                reply = request_render(connect_flag, text, request);
+            }
+            std::cout.write(reinterpret_cast<const char *>(reply.data()), reply.size());
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    // Create a simple gradient depending on pixel position
-    // Depending on height of ray, go from white to full red
-    // unit_direction.y() goes -1 to 1, therefore add 1 to not have negative and divide by 0.5 to stay within 0 and 1
-    // If y closer to 1, t will be closer to 1
-    // If y is close to -1, t will be closer to 0
-    vec3 unit_direction = normalize(r.direction());
-    auto t = 0.5 * (unit_direction.y() + 1.0);
-    return (background_color_bottom * (1 - t) + background_color_top * (t));
-}
+    // Each frame would overwrite the other frames' checkpoint, preview and heatmap
+    if (!frames_flag.empty() && (!checkpoint_flag.empty() || !preview_flag.empty() || !heatmap_flag.empty()))
+    {
+        std::cerr << "Error: --checkpoint, --preview and --heatmap can not be used with --frames" << std::endl;
+        return 1;
+    }
+    const bool distributed = !distribute_flag.empty() || local_workers_flag > 0;
+    if (!incremental_flag.empty() && (distributed || !frames_flag.empty() || !checkpoint_flag.empty() || !preview_flag.empty() || !heatmap_flag.empty()))
+    {
+        std::cerr << "Error: --incremental can not be used with --frames, --checkpoint, --preview, --heatmap or a distributed render" << std::endl;
+        return 1;
+    }
+    if (!out_of_core_flag.empty() && (distributed || !frames_flag.empty() || !checkpoint_flag.empty() || !preview_flag.empty() || !heatmap_flag.empty() ||
+                                      !incremental_flag.empty() || denoise_flag || !aov_flag.empty()))
+    {
+        std::cerr << "Error: --out-of-core can not be used with --frames, --checkpoint, --preview, --heatmap, --incremental, --denoise, --aov or a distributed render" << std::endl;
+        return 1;
+    }
+    if (distributed && (!frames_flag.empty() || !checkpoint_flag.empty() || !preview_flag.empty() || !heatmap_flag.empty() || denoise_flag || !aov_flag.empty()))
+    {
+        std::cerr << "Error: --frames, --checkpoint, --preview, --heatmap, --denoise and --aov can not be used with a distributed render" << std::endl;
+        return 1;
+    }
 
-int main()
-{
-    // Input file parser
-    std::vector<std::vector<std::string>> lines;
-    std::string line;
+#ifndef RAYTRACE_STATS
+    if (render_stats_flag || !trace_flag.empty())
+    {
+        std::cerr << "Error: --render-stats and --trace need a build configured with -DRAYTRACE_STATS=ON" << std::endl;
+        return 1;
+    }
+#endif
 
-    int line_number = 0;
-    while (std::getline(std::cin, line))
+    scene s;
+    render_settings &settings = s.settings;
+    // The input file as it was read, sent to the workers of a distributed render
+    std::string scene_text;
+    try
     {
-        std::vector<std::string> args;
-        std::string word;
-        std::istringstream iss(line);
-        while (iss >> word)
+        STATS_PHASE_BEGIN(parse);
+        // An input file redirected to stdin is mapped and parsed in place, otherwise (such as a pipe) it is read first
+        std::shared_ptr<mapped_file> input = std::make_shared<mapped_file>(0);
+        std::shared_ptr<const void> storage = input;
+        const char *data = input->data();
+        size_t size = input->size();
+        if (!input->mapped())
+        {
+            std::shared_ptr<std::string> text = std::make_shared<std::string>(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+            storage = text;
+            data = text->data();
+            size = text->size();
+        }
+        bool binary_input = is_binary_scene(data, size);
+        s.record_sphere_lines = !incremental_flag.empty();
+        load_scene(data, size, storage, s);
+        STATS_PHASE_END(parse);
+        if (distributed)
+            scene_text.assign(data, size);
+
+        if (!convert_flag.empty())
         {
-            args.push_back(word);
+            std::ofstream out(convert_flag, std::ios::binary | std::ios::trunc);
+            if (binary_input)
+                write_text_scene(out, s);
+            else
+                write_binary_scene(out, s);
+            out.flush();
+            if (!out)
+            {
+                throw std::runtime_error("Could not write " + convert_flag);
+            }
+            return 0;
         }
-        lines.push_back(args);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
     }
 
-    const int samples_p_pixel = std::stoi(lines[0][1]);
-    const int image_width = std::stoi(lines[0][2]);
+    if (threads_flag > 0)
+    {
+        settings.num_threads = threads_flag;
+    }
+    settings.heatmap_file = heatmap_flag;
+    if (denoise_flag)
+    {
+        settings.denoise = true;
+    }
+    settings.aov_prefix = aov_flag;
+    if (!format_flag.empty() && !parse_image_format(format_flag, settings.format))
+    {
+        std::cerr << "Error: Invalid image format " << format_flag << std::endl;
+        return 1;
+    }
+    // Checkpoints and previews are made between progressive passes, so either turns progressive rendering on
+    if (!checkpoint_flag.empty() || !preview_flag.empty())
+    {
+        settings.progressive.enabled = true;
+    }
+    settings.progressive.checkpoint_file = checkpoint_flag;
+    settings.progressive.preview_file = preview_flag;
+    if (settings.num_threads < 1)
+    {
+        settings.num_threads = 1;
+    }
 
-    const color background_colour_top = color(std::stod(lines[1][1]), std::stod(lines[1][2]), std::stod(lines[1][3]));
-    const color background_colour_bottom = color(std::stod(lines[1][4]), std::stod(lines[1][5]), std::stod(lines[1][6]));
-    hittable_list world;
+    // Create Image
+    std::cerr << "Creating Image..." << std::endl;
+    std::cerr << "Scene has " << s.object_count() << (s.groups.empty() ? " spheres, " : " spheres and instances, ") << s.materials.all().size() << " distinct materials, "
+              << (s.arena.bytes_used() + 1023) / 1024 << " KiB in the scene arena, " << resident_memory() / (1024 * 1024) << " MiB resident" << std::endl;
+    if (!s.groups.empty())
+    {
+        std::cerr << "The spheres and instances stand for " << s.expanded_count() << " spheres" << std::endl;
+    }
 
-    // Number of objects
-    size_t num_objects = lines.size() - 2;
-    std::vector<material> material_objs;
-    std::vector<hittable> hittable_objs;
-    for (int i = 0; i < num_objects; i++)
+    if (distributed)
     {
-        // if line is empty, skip
-        if (lines[i + 2].empty())
+        framebuffer image(settings.image_width, settings.image_height);
+        try
         {
-            continue;
+            // Nothing is rendered in this process, --threads is the threads of each local worker
+            std::unique_ptr<local_workers> workers;
+            std::vector<std::string> sockets = distribute_flag;
+            if (local_workers_flag > 0)
+            {
+                workers.reset(new local_workers(local_workers_flag, threads_flag));
+                sockets.insert(sockets.end(), workers->socket_paths().begin(), workers->socket_paths().end());
+            }
+            render_coordinator coordinator(sockets);
+            STATS_PHASE_BEGIN(render);
+            coordinator.render(scene_text, s, image);
+            STATS_PHASE_END(render);
+            std::cerr << std::endl;
+            coordinator.write_report(std::cerr);
         }
-        std::vector<std::string> args = lines[i + 2];
-        if (args[5] == "LAMBERTIAN")
+        catch (const std::exception &e)
         {
-            // New required here because its in a for loop and will get overriden if dynamic allocation is not done.
-            material *material_obj = new lambertian(color(std::stod(args[6]), std::stod(args[7]), std::stod(args[8])));
-            sphere *sphere_obj = new sphere(vec3(std::stod(args[1]), std::stod(args[2]), std::stod(args[3])), std::stod(args[4]), material_obj);
-            world.add(sphere_obj);
+            std::cerr << "\nError: " << e.what() << std::endl;
+            return 1;
         }
-        else if (args[5] == "LIGHT")
+
+        STATS_PHASE_BEGIN(encode);
+        write_image(std::cout, image, settings.format);
+        STATS_PHASE_END(encode);
+    }
+    else if (!frames_flag.empty())
+    {
+        try
         {
-            // New required here because its in a for loop and will get overriden if dynamic allocation is not done.
-            material *material_obj = new diffuse_light(color(std::stod(args[6]), std::stod(args[7]), std::stod(args[8])));
-            sphere *sphere_obj = new sphere(vec3(std::stod(args[1]), std::stod(args[2]), std::stod(args[3])), std::stod(args[4]), material_obj);
-            world.add(sphere_obj);
+            std::cerr << "Rendering frames " << s.first_frame() << " to " << s.last_frame() << std::endl;
+            render_animation(s, frames_flag);
         }
-        else if (args[5] == "METAL")
+        catch (const std::exception &e)
         {
-            // New required here because its in a for loop and will get overriden if dynamic allocation is not done.
-            material *material_obj = new metal(color(std::stod(args[6]), std::stod(args[7]), std::stod(args[8])), std::stod(args[9]));
-            sphere *sphere_obj = new sphere(vec3(std::stod(args[1]), std::stod(args[2]), std::stod(args[3])), std::stod(args[4]), material_obj);
-            world.add(sphere_obj);
+            std::cerr << "\nError: " << e.what() << std::endl;
+            return 1;
         }
-        else
+    }
+    else if (!out_of_core_flag.empty())
+    {
+        try
+        {
+            // The image is encoded and written as it is rendered
+            render_out_of_core(s, out_of_core_flag, std::cout);
+        }
+        catch (const std::exception &e)
         {
-            std::cerr << "Error: Invalid material type " << args[5] << std::endl;
+            std::cerr << "\nError: " << e.what() << std::endl;
             return 1;
         }
     }
-
-    // Image Properties
-    const double asp_ratio = 16.0 / 9.0;
-    const int image_height = (int)(image_width / asp_ratio);
-
-    // Camera Properties
-    const double viewport_height = 2.0;
-    const double viewport_width = viewport_height * asp_ratio; // 3.56
-    
-    // Distance between the projection point(camera) and the projection plane
-    // Larger means more zoomed in
-    // Smaller means more zoomed out
-    const double focal_length = 1.0;
-
-    const point3 origin = point3(0, 0, 0);
-    const vec3 horizontal = vec3(viewport_width, 0, 0);
-    const vec3 vertical = vec3(0, viewport_height, 0);
-    const point3 lower_left_corner = origin - horizontal / 2 - vertical / 2 - vec3(0, 0, focal_length);
-
-    // Create PPM Image
-    std::cerr << "Creating PPM Image..." << std::endl;
-
-    std::cout << "P3\n"
-              << image_width << ' ' << image_height << "\n255\n";
-
-    for (int j = 0; j < image_height; j++)
+    else
     {
-        std::cerr << "\rRaytracing horizontal line " << j + 1 << " out of " << image_height << std::flush;
-        for (int i = 0; i < image_width; ++i)
+        framebuffer image(settings.image_width, settings.image_height);
+        try
         {
-            color pixel_color(0, 0, 0);
-
-            // Shoot multiple samples for anti-aliasing
-            for (int sample = 0; sample < samples_p_pixel; sample++)
-            {
-                // Add a random value between 0 and 1 for multiple samples
-                auto u = (double(i) + rand() / (RAND_MAX + 1.0)) / (image_width - 1);
-                auto v = (double(j) + rand() / (RAND_MAX + 1.0)) / (image_height - 1);
-
-                // Ray with origin at camera, direction going towards the pixel, remember u is the pixel at horizontal (width), v is pixel at vertical (height)
-                // u ranges from 0 to 1 representing width, v ranges from 0 to 1 representing height, therefore multiply with horizontal and vertical.
-                // lower_left_corner represents the bottom left pixel point3.
-                // So basically, lower_left_corner + u*horizontal + (1 - v)*vertical gives the pixel position (viewport coordinates), then minus origin position to get the ray direction.
-                // 1 - v becase v goes from 0 to 1, but we are writing our PPM image from top to bottom, so we need to shoot rays from 1 to 0.
-                ray r(origin, lower_left_corner + u * horizontal + (1 - v) * vertical - origin);
-
-                // Summation of the samples
-                pixel_color += ray_color(r, world, 0, background_colour_top, background_colour_bottom);
-            }
-            // Get average of the samples for each pixel
-            pixel_color /= samples_p_pixel;
+            if (!incremental_flag.empty())
+                render_incremental(s, incremental_flag, image);
+            else
+                render_scene(s, image);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "\nError: " << e.what() << std::endl;
+            return 1;
+        }
 
-            // Gamma-correct for gamma=2.0.
-            pixel_color = color(std::sqrt(pixel_color.r()), std::sqrt(pixel_color.g()), std::sqrt(pixel_color.b()));
+        STATS_PHASE_BEGIN(encode);
+        write_image(std::cout, image, settings.format);
+        STATS_PHASE_END(encode);
+    }
 
-            // r, g, b are in the range [0,1]
-            write_color(std::cout, pixel_color);
+    std::cerr << "\nImage Created" << std::endl;
+    if (render_stats_flag)
+    {
+        render_stats::global().write_summary(std::cerr);
+    }
+    if (!trace_flag.empty())
+    {
+        std::ofstream trace(trace_flag, std::ios::trunc);
+        render_stats::global().write_trace(trace);
+        if (!trace)
+        {
+            std::cerr << "Error: Could not write " << trace_flag << std::endl;
+            return 1;
         }
     }
-
-    std::cerr << "\nPPM Image Created" << std::endl;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,1249 @@
+// Benchmarks for the ray tracer, micro-benchmarks of the pieces of a render and end-to-end renders of fixed scenes
+// Run with ./raytrace_bench [options] [scene file], results are printed as rays/sec, samples/sec or ns/pixel.
+//     --json FILE       Also write the results to FILE as JSON
+//     --baseline FILE   Compare the results with those of an earlier --json run, exits with 1 if any got worse by more than the threshold
+//     --threshold PCT   How much worse than the baseline a result may get before it counts as a regression (default 10)
+//     --filter TEXT     Only run the benchmarks whose name contains TEXT
+//     --save-images DIR     Write the image of each end-to-end render to DIR as a PFM file
+//     --compare-images DIR  Compare the image of each end-to-end render with the one saved in DIR, such as by a build of the other precision
+// With a scene file (such as input.txt), also prints how the error of the image drops over render time with and without light sampling.
+
+#include "vec3.hpp"
+#include "rng.hpp"
+#include "sphere.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include "bvh.hpp"
+#include "sphere_soa.hpp"
+#include "scene.hpp"
+#include "renderer.hpp"
+#include "incremental.hpp"
+#include "out_of_core.hpp"
+#include "ray_counter.hpp"
+#include "memory_usage.hpp"
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Results of the benchmarks are stored here so that the compiler can not optimize the work away
+volatile double benchmark_sink;
+
+// Scenes that come with the source, such as input.txt, are found here
+#ifndef RAYTRACE_SOURCE_DIR
+#define RAYTRACE_SOURCE_DIR "."
+#endif
+
+// Result of one benchmark, a value for each of its units (such as rays/sec)
+struct benchmark_result
+{
+    std::string name;
+    std::vector<std::pair<std::string, double>> values;
+};
+
+// Results so far, to be written with --json and compared with --baseline
+std::vector<benchmark_result> benchmark_results;
+
+// Only benchmarks whose name contains this are run (--filter)
+std::string benchmark_filter;
+
+bool selected(const std::string &name)
+{
+    return name.find(benchmark_filter) != std::string::npos;
+}
+
+void record_result(const std::string &name, const std::string &unit, double value)
+{
+    std::cout << name << ": " << value << " " << unit << std::endl;
+    if (benchmark_results.empty() || benchmark_results.back().name != name)
+    {
+        benchmark_results.push_back(benchmark_result());
+        benchmark_results.back().name = name;
+    }
+    benchmark_results.back().values.push_back(std::make_pair(unit, value));
+}
+
+// JSON key of a unit, such as rays_per_sec for rays/sec
+std::string unit_key(std::string unit)
+{
+    size_t slash = unit.find('/');
+    if (slash != std::string::npos)
+        unit.replace(slash, 1, "_per_");
+    return unit;
+}
+
+std::string json_string(const std::string &text)
+{
+    std::string quoted = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Write the results as {"benchmarks": [{"name": ..., "rays_per_sec": ...}, ...]}, one benchmark per line
+void write_results_json(std::ostream &out)
+{
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t k = 0; k < benchmark_results.size(); k++)
+    {
+        const benchmark_result &result = benchmark_results[k];
+        out << "    {\"name\": " << json_string(result.name);
+        for (const auto &value : result.values)
+        {
+            char number[32];
+            std::snprintf(number, sizeof(number), "%.6g", value.second);
+            out << ", " << json_string(unit_key(value.first)) << ": " << number;
+        }
+        out << (k + 1 < benchmark_results.size() ? "},\n" : "}\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// Read the results written by write_results_json, as name -> (key -> value).
+// Only reads that layout (one benchmark per line), not any JSON.
+std::map<std::string, std::map<std::string, double>> read_results_json(std::istream &in)
+{
+    std::map<std::string, std::map<std::string, double>> results;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        // Pairs of "key": value on the line, strings are quoted and numbers are not
+        std::string name;
+        std::map<std::string, double> values;
+        size_t pos = 0;
+        while ((pos = line.find('"', pos)) != std::string::npos)
+        {
+            size_t end = line.find('"', pos + 1);
+            size_t colon = line.find(':', end);
+            if (end == std::string::npos || colon == std::string::npos)
+                break;
+            std::string key = line.substr(pos + 1, end - pos - 1);
+            size_t value_start = line.find_first_not_of(' ', colon + 1);
+            if (value_start != std::string::npos && line[value_start] == '"')
+            {
+                size_t value_end = line.find('"', value_start + 1);
+                if (key == "name")
+                    name = line.substr(value_start + 1, value_end - value_start - 1);
+                pos = value_end + 1;
+            }
+            else
+            {
+                values[key] = std::strtod(line.c_str() + value_start, nullptr);
+                pos = colon + 1;
+            }
+        }
+        if (!name.empty())
+            results[name] = values;
+    }
+    return results;
+}
+
+// Print how each result changed from the baseline, returns the number of results that got worse by more than threshold percent.
+// Units per second are better when higher, times (such as ns/pixel) when lower.
+int compare_with_baseline(const std::map<std::string, std::map<std::string, double>> &baseline, double threshold)
+{
+    int regressions = 0;
+    std::cout << "\nCompared with the baseline:" << std::endl;
+    for (const benchmark_result &result : benchmark_results)
+    {
+        auto found = baseline.find(result.name);
+        for (const auto &value : result.values)
+        {
+            std::string key = unit_key(value.first);
+            if (found == baseline.end() || found->second.count(key) == 0)
+            {
+                std::cout << result.name << " " << value.first << ": not in the baseline" << std::endl;
+                continue;
+            }
+            double before = found->second.at(key);
+            double change = before != 0 ? (value.second - before) / before * 100 : 0;
+            bool higher_is_better = value.first.find("/sec") != std::string::npos;
+            double worse = higher_is_better ? -change : change;
+            char line[64];
+            std::snprintf(line, sizeof(line), "%+.1f%%", change);
+            std::cout << result.name << " " << value.first << ": " << before << " -> " << value.second << " (" << line << ")";
+            if (worse > threshold)
+            {
+                std::cout << " REGRESSION";
+                regressions++;
+            }
+            std::cout << std::endl;
+        }
+    }
+    return regressions;
+}
+
+// Time fn(iterations) on num_threads threads and print the throughput in unit (such as samples/sec), or the time of each iteration for ns/ units
+// fn(iterations, thread_index) must return a value depending on its work.
+template <typename F>
+void run_benchmark(std::string name, const std::string &unit, long iterations, int num_threads, const F &fn)
+{
+    if (num_threads > 1)
+    {
+        name += " on " + std::to_string(num_threads) + " threads";
+    }
+    if (!selected(name))
+        return;
+
+    std::vector<double> sinks(num_threads);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++)
+    {
+        threads.push_back(std::thread([&, t]() { sinks[t] = fn(iterations, t); }));
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    for (auto s : sinks)
+    {
+        benchmark_sink = benchmark_sink + s;
+    }
+
+    double count = (double)iterations * num_threads;
+    if (unit.compare(0, 3, "ns/") == 0)
+        record_result(name, unit, elapsed.count() * 1e9 / count);
+    else
+        record_result(name, unit, count / elapsed.count());
+}
+
+// The random_in_unit_sphere used before the rng subsystem, kept here for comparison
+vec3 rand_in_unit_sphere()
+{
+    while (true)
+    {
+        auto x = -1 + 2 * (rand() / double(RAND_MAX + 1.0));
+        auto y = -1 + 2 * (rand() / double(RAND_MAX + 1.0));
+        auto z = -1 + 2 * (rand() / double(RAND_MAX + 1.0));
+        vec3 p(x, y, z);
+        if (p.length() * p.length() >= 1)
+            continue;
+        return p;
+    }
+}
+
+// Fill world with n small lambertian spheres scattered in front of the camera
+void random_spheres(hittable_list &world, int n, rng &gen)
+{
+    for (int k = 0; k < n; k++)
+    {
+        point3 center(gen.next_double(-20, 20), gen.next_double(-2, 5), gen.next_double(-40, -1));
+        world.add(new sphere(center, gen.next_double(0.05, 0.2), new lambertian(color(0.5, 0.5, 0.5))));
+    }
+}
+
+// Rays from the camera in random directions towards the spheres of random_spheres
+std::vector<ray> random_rays(int n, rng &gen)
+{
+    std::vector<ray> rays;
+    for (int k = 0; k < n; k++)
+    {
+        rays.push_back(ray(point3(0, 0, 0), vec3(gen.next_double(-1, 1), gen.next_double(-0.2, 0.5), -1)));
+    }
+    return rays;
+}
+
+// Throughput of a single sphere's hit test
+void benchmark_sphere_hit(const std::vector<ray> &rays, long iterations)
+{
+    lambertian mat(color(0.5, 0.5, 0.5));
+    sphere ball(point3(0, 0.5, -10), 4, &mat);
+    run_benchmark("sphere::hit", "rays/sec", iterations, 1, [&](long n, int) {
+        double sum = 0;
+        hit_record rec;
+        for (long k = 0; k < n; k++)
+        {
+            if (ball.hit(rays[k % rays.size()], 0.001, std::numeric_limits<real>::infinity(), rec))
+                sum += rec.t;
+        }
+        return sum;
+    });
+}
+
+// Closest-hit throughput of one world type over the rays
+template <typename World>
+void benchmark_hit_all(const std::string &name, const World &world, const std::vector<ray> &rays, long iterations)
+{
+    run_benchmark(name, "rays/sec", iterations, 1, [&](long n, int) {
+        double sum = 0;
+        hit_record rec;
+        for (long k = 0; k < n; k++)
+        {
+            if (world.hit_all(rays[k % rays.size()], 0.001, std::numeric_limits<real>::infinity(), rec))
+                sum += rec.t;
+        }
+        return sum;
+    });
+}
+
+// Shadow-ray throughput of one world type: whether anything blocks each ray before t_max, asked with occluded and,
+// for comparison, with hit_all (finding the closest blocker when any one would do), plus the share of the rays that are blocked
+template <typename World>
+void benchmark_occluded(const std::string &name, const std::string &suffix, const World &world, const std::vector<ray> &rays, real t_max, long iterations)
+{
+    run_benchmark(name + "::hit_all as a shadow test" + suffix, "rays/sec", iterations, 1, [&](long n, int) {
+        double sum = 0;
+        hit_record rec;
+        for (long k = 0; k < n; k++)
+        {
+            if (world.hit_all(rays[k % rays.size()], 0.001, t_max, rec))
+                sum += 1;
+        }
+        return sum;
+    });
+
+    double blocked = 0;
+    run_benchmark(name + "::occluded" + suffix, "rays/sec", iterations, 1, [&](long n, int) {
+        double sum = 0;
+        for (long k = 0; k < n; k++)
+        {
+            if (world.occluded(rays[k % rays.size()], 0.001, t_max))
+                sum += 1;
+        }
+        blocked = sum / n;
+        return sum;
+    });
+    if (selected(name + "::occluded" + suffix))
+        record_result(name + "::occluded" + suffix, "% blocked", 100 * blocked);
+}
+
+// Scatter and emission of a mix of materials, called through Dispatch (virtual_dispatch or tagged_dispatch)
+template <typename Dispatch>
+void benchmark_material_dispatch(const std::string &name, const std::vector<material *> &materials, const std::vector<ray> &rays, long iterations)
+{
+    run_benchmark(name, "scatters/sec", iterations, 1, [&](long n, int) {
+        sampler gen(sampler_type::independent, 1, 0, 0, 1, rng(1));
+        double sum = 0;
+        hit_record rec;
+        rec.p = point3(0, 0, 0);
+        rec.t = 1;
+        for (long k = 0; k < n; k++)
+        {
+            const ray &r = rays[k % rays.size()];
+            rec.normal = normalize(-r.direction());
+            rec.mat = materials[k % materials.size()];
+            color attenuation;
+            ray scattered;
+            if (Dispatch::scatter(rec.mat, r, rec, attenuation, scattered, gen))
+                sum += attenuation.r() + scattered.direction().x();
+            else
+                sum += Dispatch::emitted(rec.mat).g();
+        }
+        return sum;
+    });
+}
+
+// Root mean square difference between two images, of the colors after gamma correction and clamping (as they are written)
+double image_rmse(const framebuffer &a, const framebuffer &b)
+{
+    double sum = 0;
+    for (int j = 0; j < a.height(); j++)
+    {
+        for (int i = 0; i < a.width(); i++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                double d = std::min(1.0, std::sqrt((double)a.at(i, j)[c])) - std::min(1.0, std::sqrt((double)b.at(i, j)[c]));
+                sum += d * d;
+            }
+        }
+    }
+    return std::sqrt(sum / (3.0 * a.width() * a.height()));
+}
+
+// Render the scene at increasing samples per pixel, with and without light sampling,
+// printing the render time and the error against a reference rendered with many samples.
+void benchmark_convergence(const std::string &scene_file)
+{
+    std::ifstream in(scene_file);
+    if (!in)
+    {
+        std::cerr << "Can not open " << scene_file << std::endl;
+        return;
+    }
+    scene s;
+    parse_scene(in, s);
+
+    // Small image, so that the reference does not take too long
+    s.settings.show_progress = false;
+    s.settings.adaptive.enabled = false;
+    s.settings.image_width = 160;
+    s.settings.image_height = 90;
+    framebuffer image(s.settings.image_width, s.settings.image_height);
+
+    s.settings.samples_p_pixel = 2048;
+    s.settings.integrator.light_sampling = true;
+    s.settings.seed = 12345;
+    framebuffer reference(s.settings.image_width, s.settings.image_height);
+    render_scene(s, reference);
+    s.settings.seed = 1;
+
+    std::cout << "RMSE against a " << s.settings.samples_p_pixel << " samples/pixel reference (" << scene_file << ")" << std::endl;
+    for (bool light_sampling : {false, true})
+    {
+        s.settings.integrator.light_sampling = light_sampling;
+        for (int spp : {4, 16, 64, 256})
+        {
+            s.settings.samples_p_pixel = spp;
+            auto start = std::chrono::steady_clock::now();
+            render_scene(s, image);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "light sampling " << (light_sampling ? "on " : "off") << " " << spp << " samples/pixel: "
+                      << elapsed.count() << " s, RMSE " << image_rmse(image, reference) << std::endl;
+        }
+    }
+
+    // The denoiser is meant to reach the quality of tens of samples per pixel from a few
+    s.settings.denoise = true;
+    for (int spp : {4, 8})
+    {
+        s.settings.samples_p_pixel = spp;
+        auto start = std::chrono::steady_clock::now();
+        render_scene(s, image);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "light sampling on  " << spp << " samples/pixel denoised: " << elapsed.count() << " s, RMSE "
+                  << image_rmse(image, reference) << std::endl;
+    }
+}
+
+// Render the scene with each sampler at 1 to 64 samples per pixel, printing the error against a reference rendered with many samples
+// and the slope of log(RMSE) against log(samples per pixel): -0.5 for independent samples, steeper when the samples are better spread.
+void benchmark_sampler_convergence(const std::string &scene_file)
+{
+    std::ifstream in(scene_file);
+    if (!in)
+    {
+        std::cerr << "Can not open " << scene_file << std::endl;
+        return;
+    }
+    scene s;
+    parse_scene(in, s);
+
+    s.settings.show_progress = false;
+    s.settings.adaptive.enabled = false;
+    s.settings.image_width = 160;
+    s.settings.image_height = 90;
+    framebuffer image(s.settings.image_width, s.settings.image_height);
+
+    s.settings.samples_p_pixel = 2048;
+    s.settings.sampling = sampler_type::sobol;
+    s.settings.seed = 12345;
+    framebuffer reference(s.settings.image_width, s.settings.image_height);
+    render_scene(s, reference);
+    s.settings.seed = 1;
+
+    std::cout << "RMSE of each sampler against a " << s.settings.samples_p_pixel << " samples/pixel reference (" << scene_file << ")" << std::endl;
+    for (sampler_type type : {sampler_type::independent, sampler_type::stratified, sampler_type::sobol, sampler_type::blue_noise})
+    {
+        s.settings.sampling = type;
+        std::string name = "sampler " + sampler_name(type);
+        // Least squares fit of log(RMSE) = a + slope * log(spp)
+        double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+        int points = 0;
+        for (int spp = 1; spp <= 64; spp *= 2)
+        {
+            s.settings.samples_p_pixel = spp;
+            render_scene(s, image);
+            double rmse = image_rmse(image, reference);
+            if (spp == 4 || spp == 16 || spp == 64)
+                record_result(name, "rmse at " + std::to_string(spp) + " samples/pixel", rmse);
+            double x = std::log((double)spp), y = std::log(rmse);
+            sum_x += x;
+            sum_y += y;
+            sum_xx += x * x;
+            sum_xy += x * y;
+            points++;
+        }
+        double slope = (points * sum_xy - sum_x * sum_y) / (points * sum_xx - sum_x * sum_x);
+        std::cout << name << ": convergence slope " << slope << std::endl;
+    }
+}
+
+// Text of a scene with n random spheres, whose colors come from a palette of 16 (so many spheres share a material)
+std::string random_scene_text(int n, rng &gen)
+{
+    std::ostringstream text;
+    text << "SETTINGS 4 160\nBACKGROUND 0.5 0.7 1.0 1.0 1.0 1.0\nACCELERATION BVH\n";
+    for (int k = 0; k < n; k++)
+    {
+        int shade = (int)(gen.next_double() * 16);
+        text << "SPHERE " << gen.next_double(-20, 20) << ' ' << gen.next_double(-2, 5) << ' ' << gen.next_double(-40, -1) << ' '
+             << gen.next_double(0.05, 0.2) << " LAMBERTIAN " << shade / 16.0 << " 0.5 " << 1 - shade / 16.0 << "\n";
+    }
+    return text.str();
+}
+
+// How the scene was loaded before the scene arena: every SPHERE line tokenized into strings, then a new material and a new sphere.
+// Kept here for comparison. The materials are returned so that they can be deleted (they used to leak).
+void load_scene_heap(const std::string &text, hittable_list &world, std::vector<lambertian *> &materials)
+{
+    std::istringstream in(text);
+    std::vector<std::vector<std::string>> lines;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::vector<std::string> args;
+        std::string word;
+        std::istringstream iss(line);
+        while (iss >> word)
+        {
+            args.push_back(word);
+        }
+        lines.push_back(args);
+    }
+    for (auto &args : lines)
+    {
+        if (!args.empty() && args[0] == "SPHERE")
+        {
+            lambertian *material_obj = new lambertian(color(std::stod(args[6]), std::stod(args[7]), std::stod(args[8])));
+            world.add(new sphere(vec3(std::stod(args[1]), std::stod(args[2]), std::stod(args[3])), std::stod(args[4]), material_obj));
+            materials.push_back(material_obj);
+        }
+    }
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Give freed memory back to the system, so the next resident memory reading starts from the same place
+void release_free_memory()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+void print_scene_memory(const std::string &name, double load_s, size_t resident, double build_s, double render_s, double free_s)
+{
+    std::cout << name << ": load " << load_s * 1000 << " ms, resident " << resident / (1024 * 1024) << " MiB, BVH build "
+              << build_s * 1000 << " ms, render " << render_s * 1000 << " ms, free " << free_s * 1000 << " ms" << std::endl;
+}
+
+// Load, render and free a large scene with one heap allocation per object, then with the scene arena
+void benchmark_scene_memory(int num_spheres)
+{
+    rng gen(1);
+    std::string text = random_scene_text(num_spheres, gen);
+    std::cout << "Large scene (" << num_spheres << " spheres)" << std::endl;
+
+    scene settings_scene;
+    parse_scene(text.data(), text.data() + text.find("SPHERE"), settings_scene);
+    render_settings settings = settings_scene.settings;
+    settings.show_progress = false;
+    settings.integrator.light_sampling = false;
+    framebuffer image(settings.image_width, settings.image_height);
+
+    {
+        release_free_memory();
+        size_t before = resident_memory();
+        auto start = std::chrono::steady_clock::now();
+        hittable_list *world = new hittable_list();
+        // Kept as their own type, material has no virtual destructor to delete them through
+        std::vector<lambertian *> materials;
+        load_scene_heap(text, *world, materials);
+        double load_s = seconds_since(start);
+        size_t resident = resident_memory() - before;
+
+        start = std::chrono::steady_clock::now();
+        bvh_world bvh(*world, settings.num_threads);
+        double build_s = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        render(bvh, settings_scene.cam, settings, image);
+        double render_s = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        delete world;
+        for (auto mat : materials)
+        {
+            delete mat;
+        }
+        double free_s = seconds_since(start);
+        print_scene_memory("new per object", load_s, resident, build_s, render_s, free_s);
+    }
+
+    {
+        release_free_memory();
+        size_t before = resident_memory();
+        auto start = std::chrono::steady_clock::now();
+        scene *s = new scene();
+        parse_scene(text.data(), text.data() + text.size(), *s);
+        double load_s = seconds_since(start);
+        size_t resident = resident_memory() - before;
+
+        start = std::chrono::steady_clock::now();
+        bvh_world bvh(s->world, settings.num_threads);
+        double build_s = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        render(bvh, s->cam, settings, image);
+        double render_s = seconds_since(start);
+
+        std::cout << "scene arena holds " << s->arena.bytes_used() / (1024 * 1024) << " MiB, " << s->materials.all().size()
+                  << " distinct materials for " << s->materials.requests() << " spheres" << std::endl;
+        start = std::chrono::steady_clock::now();
+        delete s;
+        double free_s = seconds_since(start);
+        print_scene_memory("scene arena", load_s, resident, build_s, render_s, free_s);
+    }
+}
+
+// Text of a scene made of copies of one cluster of cluster_size random spheres (like a molecule): a block of block_size clusters in a grid,
+// and blocks copies of the block in a grid below the camera. With expanded every copy is written out as SPHERE lines, otherwise
+// the cluster and the block are GROUPs placed by INSTANCE lines.
+std::string cluster_scene_text(int cluster_size, int block_size, int blocks, bool expanded)
+{
+    rng gen(4);
+    std::vector<std::string> cluster;
+    for (int k = 0; k < cluster_size; k++)
+    {
+        std::ostringstream sphere;
+        int shade = (int)(gen.next_double() * 16);
+        sphere << gen.next_double() << ' ' << gen.next_double() << ' ' << gen.next_double() << ' ' << gen.next_double(0.02, 0.05)
+               << " LAMBERTIAN " << shade / 16.0 << " 0.5 " << 1 - shade / 16.0;
+        cluster.push_back(sphere.str());
+    }
+    auto block_offset = [](int k) { return vec3(k % 10 * 1.2, 0, -(k / 10) * 1.2); };
+    const int width = (int)std::ceil(std::sqrt((double)blocks));
+    auto top_offset = [width](int b) { return vec3((b % width - width / 2) * 13.0, -3, -5 - b / width * 13.0); };
+
+    std::ostringstream text;
+    text << "SETTINGS 4 160\nBACKGROUND 0.5 0.7 1.0 1.0 1.0 1.0\nACCELERATION BVH\n";
+    if (!expanded)
+    {
+        text << "GROUP cluster\n";
+        for (const std::string &sphere : cluster)
+            text << "SPHERE " << sphere << "\n";
+        text << "END_GROUP\nGROUP block\n";
+        for (int k = 0; k < block_size; k++)
+            text << "INSTANCE cluster " << block_offset(k).x() << " 0 " << block_offset(k).z() << " 1\n";
+        text << "END_GROUP\n";
+        for (int b = 0; b < blocks; b++)
+            text << "INSTANCE block " << top_offset(b).x() << ' ' << top_offset(b).y() << ' ' << top_offset(b).z() << " 1\n";
+        return text.str();
+    }
+    for (int b = 0; b < blocks; b++)
+    {
+        for (int k = 0; k < block_size; k++)
+        {
+            vec3 offset = top_offset(b) + block_offset(k);
+            for (const std::string &sphere : cluster)
+            {
+                std::istringstream words(sphere);
+                double x, y, z;
+                words >> x >> y >> z;
+                text << "SPHERE " << x + offset.x() << ' ' << y + offset.y() << ' ' << z + offset.z() << words.rdbuf() << "\n";
+            }
+        }
+    }
+    return text.str();
+}
+
+// Load, build and render a scene of cluster_scene_text, printing the time of each and the memory it took.
+// Returns the resident bytes of the scene and its BVHs.
+size_t benchmark_cluster_scene(const std::string &name, int cluster_size, int block_size, int blocks, bool expanded)
+{
+    std::string text = cluster_scene_text(cluster_size, block_size, blocks, expanded);
+    release_free_memory();
+    size_t before = resident_memory();
+    auto start = std::chrono::steady_clock::now();
+    scene *s = new scene();
+    parse_scene(text.data(), text.data() + text.size(), *s);
+    double load_s = seconds_since(start);
+    text = std::string();
+    s->settings.show_progress = false;
+    start = std::chrono::steady_clock::now();
+    std::unique_ptr<scene_world> world(new scene_world(*s, s->settings.num_threads, false));
+    double build_s = seconds_since(start);
+    size_t resident = resident_memory() - before;
+
+    framebuffer image(s->settings.image_width, s->settings.image_height);
+    start = std::chrono::steady_clock::now();
+    world->render(s->cam, s->settings, image);
+    double render_s = seconds_since(start);
+    double pixels = (double)s->settings.image_width * s->settings.image_height;
+
+    std::cout << name << " (" << s->expanded_count() << " spheres): load " << load_s * 1000 << " ms, resident " << resident / (1024 * 1024)
+              << " MiB, BVH build " << build_s * 1000 << " ms, render " << render_s * 1000 << " ms" << std::endl;
+    record_result(name, "MiB", resident / (1024.0 * 1024.0));
+    record_result(name, "ns/pixel", render_s * 1e9 / pixels);
+    world.reset();
+    delete s;
+    return resident;
+}
+
+// Scenes of many copies of a cluster of spheres written out sphere by sphere, and as instances of GROUPs.
+// The expanded scene of 10^8 spheres would not fit in memory, so its size is worked out from the 10^6 sphere one.
+void benchmark_instancing()
+{
+    if (!selected("instancing"))
+        return;
+    std::cout << "Instancing (clusters of 1000 spheres)" << std::endl;
+    size_t expanded = benchmark_cluster_scene("instancing 10^6 expanded", 1000, 10, 100, true);
+    benchmark_cluster_scene("instancing 10^6 instanced", 1000, 10, 100, false);
+    size_t instanced = benchmark_cluster_scene("instancing 10^8 instanced", 1000, 100, 1000, false);
+    double expanded_bytes = expanded * 100.0;
+    std::cout << "The expanded 10^8 sphere scene would take about " << expanded_bytes / (1024 * 1024 * 1024) << " GiB, "
+              << expanded_bytes / std::max((size_t)1, instanced) << " times the instanced one" << std::endl;
+}
+
+// Render the scene following each sample alone (render) and a packet of samples together (WAVEFRONT ON), printing the samples/sec of each
+void benchmark_wavefront(const std::string &name, scene &s)
+{
+    if (!selected(name + " per sample") && !selected(name + " wavefront"))
+        return;
+    s.settings.show_progress = false;
+    s.settings.adaptive.enabled = false;
+    s.settings.progressive.enabled = false;
+    s.settings.image_width = 320;
+    s.settings.image_height = 180;
+    s.settings.samples_p_pixel = 32;
+    scene_world world(s, s.settings.num_threads, false);
+    framebuffer image(s.settings.image_width, s.settings.image_height);
+
+    for (bool wavefront : {false, true})
+    {
+        s.settings.wavefront = wavefront;
+        auto start = std::chrono::steady_clock::now();
+        world.render(s.cam, s.settings, image);
+        double samples = (double)s.settings.samples_p_pixel * s.settings.image_width * s.settings.image_height;
+        record_result(name + (wavefront ? " wavefront" : " per sample"), "samples/sec", samples / seconds_since(start));
+    }
+}
+
+// The end-to-end renders write their images to this directory (--save-images) or compare them with the images in it (--compare-images)
+std::string save_images_dir;
+std::string compare_images_dir;
+
+// File of a benchmark's image in dir, named after the benchmark with anything other than letters and digits replaced by _
+std::string image_path(const std::string &dir, const std::string &name)
+{
+    std::string file = name;
+    for (char &c : file)
+    {
+        if (!std::isalnum((unsigned char)c))
+            c = '_';
+    }
+    return dir + "/" + file + ".pfm";
+}
+
+// Read a PFM file written by write_image into image, which must already have the file's size.
+// Returns false if it can not be read or is not a little endian PFM of that size.
+bool read_pfm(const std::string &path, framebuffer &image)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    in >> magic >> width >> height >> scale;
+    in.get();
+    if (!in || magic != "PF" || width != image.width() || height != image.height() || scale >= 0)
+        return false;
+
+    std::vector<unsigned char> bytes((size_t)width * height * 3 * sizeof(float));
+    in.read(reinterpret_cast<char *>(bytes.data()), bytes.size());
+    if (!in)
+        return false;
+    const unsigned char *p = bytes.data();
+    for (int j = height - 1; j >= 0; j--)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            float rgb[3];
+            for (float &value : rgb)
+            {
+                uint32_t bits = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+                std::memcpy(&value, &bits, sizeof(value));
+                p += 4;
+            }
+            image.at(i, j) = color(rgb[0], rgb[1], rgb[2]);
+        }
+    }
+    return true;
+}
+
+// Mean of the linear colors of every pixel
+double image_mean(const framebuffer &image)
+{
+    double sum = 0;
+    for (int j = 0; j < image.height(); j++)
+    {
+        for (int i = 0; i < image.width(); i++)
+        {
+            const color &pixel = image.at(i, j);
+            sum += pixel.r() + pixel.g() + pixel.b();
+        }
+    }
+    return sum / (3.0 * image.width() * image.height());
+}
+
+// Compare the image of benchmark name with its image in compare_images_dir, printing the RMSE between them and how much brighter the image is on average.
+// Renders with different random numbers differ by their noise alone, so the RMSE against another render of this build at another seed is printed too.
+// A precision problem (such as spheres being missed, or surfaces shadowing themselves) shows as an RMSE well above that and a change in brightness.
+void compare_image(const std::string &name, const scene_world &world, const camera &cam, render_settings settings, const framebuffer &image)
+{
+    framebuffer reference(image.width(), image.height());
+    if (!read_pfm(image_path(compare_images_dir, name), reference))
+    {
+        std::cerr << "No image of " << name << " in " << compare_images_dir << " to compare with" << std::endl;
+        return;
+    }
+    framebuffer other_seed(image.width(), image.height());
+    settings.seed = 2;
+    world.render(cam, settings, other_seed);
+
+    record_result(name, "rmse", image_rmse(image, reference));
+    record_result(name, "rmse at another seed", image_rmse(other_seed, image));
+    record_result(name, "% brighter", (image_mean(image) / image_mean(reference) - 1) * 100);
+}
+
+// Render a scene with the settings of its file at a fixed seed, printing rays/sec, samples/sec and ns/pixel.
+// Building the BVH (or sphere arrays) is not timed.
+void benchmark_render(const std::string &name, scene &s)
+{
+    if (!selected(name))
+        return;
+    render_settings settings = s.settings;
+    settings.show_progress = false;
+    settings.seed = 1;
+    scene_world world(s, settings.num_threads, false);
+    settings.integrator.lights = world.light_spheres();
+    framebuffer image(settings.image_width, settings.image_height);
+
+    ray_counter counter;
+    auto start = std::chrono::steady_clock::now();
+    counted_render renderer{s.cam, settings, image, counter};
+    world.with_world(renderer);
+    double elapsed = seconds_since(start);
+    double pixels = (double)settings.image_width * settings.image_height;
+
+    record_result(name, "rays/sec", counter.rays() / elapsed);
+    record_result(name, "samples/sec", pixels * settings.samples_p_pixel / elapsed);
+    record_result(name, "ns/pixel", elapsed * 1e9 / pixels);
+
+    if (!save_images_dir.empty())
+    {
+        std::ofstream out(image_path(save_images_dir, name), std::ios::binary);
+        write_image(out, image, image_format::pfm);
+        if (!out)
+            std::cerr << "Could not write the image of " << name << " to " << save_images_dir << std::endl;
+    }
+    if (!compare_images_dir.empty())
+        compare_image(name, world, s.cam, settings, image);
+}
+
+// Traces the first-hit buffers of whichever world scene_world built, pass it to scene_world::with_world
+struct aov_render
+{
+    const camera &cam;
+    const render_settings &settings;
+    aov_buffers &aovs;
+
+    template <typename World>
+    void operator()(const World &world)
+    {
+        render_aovs(world, cam, settings.image_width, settings.image_height, settings.seed, settings.num_threads, aovs);
+    }
+};
+
+// Denoise a render of an input file at 4 samples/pixel with each filter kernel this CPU supports, printing ms per megapixel.
+// The first-hit buffers are traced once and not timed.
+void benchmark_denoise(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Can not open " << path << ", skipping denoise" << std::endl;
+        return;
+    }
+    scene s;
+    parse_scene(in, s);
+    render_settings &settings = s.settings;
+    settings.show_progress = false;
+    settings.samples_p_pixel = 4;
+    scene_world world(s, settings.num_threads, false);
+    framebuffer noisy(settings.image_width, settings.image_height);
+    world.render(s.cam, settings, noisy);
+    aov_buffers aovs(settings.image_width, settings.image_height);
+    aov_render tracer{s.cam, settings, aovs};
+    world.with_world(tracer);
+
+    double megapixels = settings.image_width * settings.image_height / 1e6;
+    for (denoise_kernel kernel : {denoise_kernel::scalar, denoise_kernel::avx2})
+    {
+        std::string name = "denoise " + denoiser::kernel_name(kernel);
+        if (kernel > denoiser::best_kernel() || !selected(name))
+            continue;
+        const int repeats = 5;
+        auto start = std::chrono::steady_clock::now();
+        for (int k = 0; k < repeats; k++)
+        {
+            framebuffer image = noisy;
+            denoise(image, aovs, settings.num_threads, kernel);
+        }
+        record_result(name, "ms/megapixel", seconds_since(start) * 1000 / repeats / megapixels);
+    }
+}
+
+// Render a scene of 1000 random spheres and a bigger sphere in the middle of the view incrementally with no earlier render (every pixel traced),
+// then again after changing the color of the middle sphere, printing the time of each.
+// The render is saved to a temporary file, removed afterwards.
+void benchmark_incremental()
+{
+    if (!selected("incremental"))
+        return;
+    rng gen(3);
+    std::string text = random_scene_text(1000, gen);
+    text.replace(text.find("SETTINGS 4 160"), 14, "SETTINGS 16 320");
+    const char *names[] = {"incremental full render", "incremental material edit"};
+    const std::string texts[] = {text + "SPHERE 0 1 -6 1 LAMBERTIAN 0.8 0.3 0.3\n", text + "SPHERE 0 1 -6 1 LAMBERTIAN 0.2 0.3 0.9\n"};
+
+    const std::string cache = "raytrace_bench_incremental.tmp";
+    std::remove(cache.c_str());
+    double full_ms = 0;
+    for (int k = 0; k < 2; k++)
+    {
+        scene s;
+        s.record_sphere_lines = true;
+        parse_scene(texts[k].data(), texts[k].data() + texts[k].size(), s);
+        s.settings.show_progress = false;
+        framebuffer image(s.settings.image_width, s.settings.image_height);
+        auto start = std::chrono::steady_clock::now();
+        render_incremental(s, cache, image);
+        double ms = seconds_since(start) * 1000;
+        record_result(names[k], "ms", ms);
+        if (k == 0)
+            full_ms = ms;
+        else
+            std::cout << "The material edit took " << 100 * ms / full_ms << "% of the time of the full render" << std::endl;
+    }
+    std::remove(cache.c_str());
+}
+
+// Peak resident memory of a child process running fn, in bytes (0 if it failed).
+// Each render runs in its own process so that one render's peak does not hide the next one's.
+template <typename F>
+size_t child_peak_memory(const F &fn)
+{
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        fn();
+        _exit(0);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 0;
+    // ru_maxrss is in kilobytes on Linux
+    return (size_t)usage.ru_maxrss * 1024;
+}
+
+// Render input.txt at 1 sample/pixel at increasing sizes into a framebuffer in memory and out-of-core, writing the image to /dev/null,
+// printing the time and the peak memory of each above that of a process that renders nothing.
+// The out-of-core framebuffer file is removed afterwards.
+void benchmark_out_of_core(const std::string &path)
+{
+    if (!selected("out-of-core"))
+        return;
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Can not open " << path << ", skipping out-of-core" << std::endl;
+        return;
+    }
+    scene s;
+    parse_scene(in, s);
+    s.settings.show_progress = false;
+    s.settings.samples_p_pixel = 1;
+
+    const std::string file = "raytrace_bench_out_of_core.tmp";
+    double idle = (double)child_peak_memory([]() {});
+    for (int width : {1024, 2048, 4096, 8192})
+    {
+        s.settings.image_width = width;
+        s.settings.image_height = width * 9 / 16;
+        std::string size = std::to_string(width) + "x" + std::to_string(s.settings.image_height);
+        for (bool out_of_core : {false, true})
+        {
+            std::string name = (out_of_core ? "out-of-core " : "in-memory ") + size;
+            std::remove(file.c_str());
+            auto start = std::chrono::steady_clock::now();
+            size_t peak = child_peak_memory([&]() {
+                std::ofstream out("/dev/null", std::ios::binary);
+                if (out_of_core)
+                {
+                    render_out_of_core(s, file, out);
+                }
+                else
+                {
+                    framebuffer image(s.settings.image_width, s.settings.image_height);
+                    render_scene(s, image);
+                    write_image(out, image, s.settings.format);
+                }
+            });
+            double seconds = seconds_since(start);
+            record_result(name, "MiB", (peak - idle) / (1024.0 * 1024.0));
+            record_result(name, "ns/pixel", seconds * 1e9 / ((double)s.settings.image_width * s.settings.image_height));
+        }
+    }
+    std::remove(file.c_str());
+}
+
+// Render an input file, see benchmark_render
+void benchmark_render_file(const std::string &name, const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Can not open " << path << ", skipping " << name << std::endl;
+        return;
+    }
+    scene s;
+    parse_scene(in, s);
+    benchmark_render(name, s);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string json_file, baseline_file, scene_file;
+    double threshold = 10;
+    for (int k = 1; k < argc; k++)
+    {
+        std::string arg = argv[k];
+        if (arg == "--json" && k + 1 < argc)
+            json_file = argv[++k];
+        else if (arg == "--baseline" && k + 1 < argc)
+            baseline_file = argv[++k];
+        else if (arg == "--threshold" && k + 1 < argc)
+            threshold = std::atof(argv[++k]);
+        else if (arg == "--filter" && k + 1 < argc)
+            benchmark_filter = argv[++k];
+        else if (arg == "--save-images" && k + 1 < argc)
+            save_images_dir = argv[++k];
+        else if (arg == "--compare-images" && k + 1 < argc)
+            compare_images_dir = argv[++k];
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 2;
+        }
+        else
+            scene_file = arg;
+    }
+
+    // Read the baseline first, so a missing file is found before spending minutes benchmarking
+    std::map<std::string, std::map<std::string, double>> baseline;
+    if (!baseline_file.empty())
+    {
+        std::ifstream in(baseline_file);
+        if (!in)
+        {
+            std::cerr << "Can not open baseline " << baseline_file << std::endl;
+            return 2;
+        }
+        baseline = read_results_json(in);
+    }
+
+    std::cout << "Built for " << (sizeof(real) == sizeof(float) ? "single" : "double") << " precision" << std::endl;
+
+    const long iterations = 10000000;
+    // rand() shares one locked state between threads, so also compare with every core drawing at once
+    std::vector<int> thread_counts = {1};
+    if (std::thread::hardware_concurrency() > 1)
+    {
+        thread_counts.push_back(std::thread::hardware_concurrency());
+    }
+
+    for (int threads : thread_counts)
+    {
+        run_benchmark("random_in_unit_sphere rand()", "samples/sec", iterations, threads, [](long n, int) {
+            double sum = 0;
+            for (long k = 0; k < n; k++)
+            {
+                sum += rand_in_unit_sphere().x();
+            }
+            return sum;
+        });
+
+        run_benchmark("random_in_unit_sphere rng", "samples/sec", iterations, threads, [](long n, int t) {
+            rng gen(1, t);
+            double sum = 0;
+            for (long k = 0; k < n; k++)
+            {
+                sum += vec3::random_in_unit_sphere(gen).x();
+            }
+            return sum;
+        });
+    }
+
+    {
+        rng gen(1);
+        std::vector<ray> rays = random_rays(4096, gen);
+        benchmark_sphere_hit(rays, iterations);
+    }
+
+    run_benchmark("write_color", "ns/pixel", iterations / 4, 1, [](long n, int) {
+        std::ostringstream out;
+        double sum = 0;
+        for (long k = 0; k < n; k++)
+        {
+            double shade = (k % 1024) / 1024.0;
+            write_color(out, color(shade, 0.5, 1.2 - shade));
+            // Keep the stream small, so the benchmark measures formatting rather than growing a string
+            if (k % 4096 == 4095)
+            {
+                sum += out.tellp();
+                out.str("");
+            }
+        }
+        return sum;
+    });
+
+    // Closest-hit queries through each world type
+    for (int num_spheres : {8, 1000})
+    {
+        rng gen(1);
+        hittable_list world;
+        random_spheres(world, num_spheres, gen);
+        std::vector<ray> rays = random_rays(4096, gen);
+        const long ray_iterations = 20000000 / num_spheres;
+        std::string suffix = " (" + std::to_string(num_spheres) + " spheres)";
+
+        benchmark_hit_all("hittable_list::hit_all" + suffix, world, rays, ray_iterations);
+        benchmark_hit_all("bvh_world::hit_all" + suffix, bvh_world(world), rays, ray_iterations);
+
+        sphere_soa_world soa(world);
+        for (soa_kernel kernel : {soa_kernel::scalar, soa_kernel::avx2, soa_kernel::avx512})
+        {
+            if (kernel > sphere_soa_world::best_kernel())
+                continue; // Not supported by this CPU
+            soa.set_kernel(kernel);
+            benchmark_hit_all("sphere_soa_world::hit_all " + sphere_soa_world::kernel_name(kernel) + suffix, soa, rays, ray_iterations);
+        }
+    }
+
+    // Shadow-ray queries through each world type, from sparse worlds where most rays get through to a dense one where most are blocked
+    for (int num_spheres : {8, 1000, 10000})
+    {
+        rng gen(1);
+        hittable_list world;
+        random_spheres(world, num_spheres, gen);
+        std::vector<ray> rays = random_rays(4096, gen);
+        const long ray_iterations = 20000000 / num_spheres;
+        const real t_max = 30;
+        std::string suffix = " (" + std::to_string(num_spheres) + " spheres)";
+
+        benchmark_occluded("hittable_list", suffix, world, rays, t_max, ray_iterations);
+        benchmark_occluded("bvh_world", suffix, bvh_world(world), rays, t_max, ray_iterations);
+
+        sphere_soa_world soa(world);
+        for (soa_kernel kernel : {soa_kernel::scalar, soa_kernel::avx2, soa_kernel::avx512})
+        {
+            if (kernel > sphere_soa_world::best_kernel())
+                continue;
+            soa.set_kernel(kernel);
+            benchmark_occluded("sphere_soa_world " + sphere_soa_world::kernel_name(kernel), suffix, soa, rays, t_max, ray_iterations);
+        }
+    }
+
+    // Material calls through virtual functions against a switch on the material type (the renderer uses material_dispatch)
+    {
+        rng gen(2);
+        scene_arena arena;
+        material_pool pool(arena);
+        std::vector<material *> materials;
+        for (int k = 0; k < 61; k++)
+        {
+            color c(gen.next_double(), gen.next_double(), gen.next_double());
+            material_type type = k % 5 == 4 ? light_type : k % 5 == 3 ? metal_type : lambertian_type;
+            materials.push_back(pool.get(make_material_desc(type, c, gen.next_double())));
+        }
+        std::vector<ray> rays = random_rays(4096, gen);
+        benchmark_material_dispatch<virtual_dispatch>("material scatter virtual_dispatch", materials, rays, iterations);
+        benchmark_material_dispatch<tagged_dispatch>("material scatter tagged_dispatch", materials, rays, iterations);
+    }
+
+    // End-to-end renders of fixed scenes
+    benchmark_render_file("render input.txt", RAYTRACE_SOURCE_DIR "/input.txt");
+    benchmark_render_file("render input_black_bg.txt", RAYTRACE_SOURCE_DIR "/input_black_bg.txt");
+    for (int num_spheres : {1000, 100000})
+    {
+        std::string name = "render " + std::to_string(num_spheres) + " random spheres";
+        if (!selected(name) && !selected(name + " wavefront"))
+            continue;
+        rng gen(3);
+        std::string text = random_scene_text(num_spheres, gen);
+        scene s;
+        parse_scene(text.data(), text.data() + text.size(), s);
+        benchmark_render(name, s);
+        if (num_spheres == 100000)
+            benchmark_wavefront(name, s);
+    }
+
+    benchmark_denoise(RAYTRACE_SOURCE_DIR "/input.txt");
+    benchmark_incremental();
+    benchmark_out_of_core(RAYTRACE_SOURCE_DIR "/input.txt");
+
+    if (selected("scene memory"))
+        benchmark_scene_memory(500000);
+    benchmark_instancing();
+
+    if (!scene_file.empty())
+    {
+        std::ifstream in(scene_file);
+        if (in)
+        {
+            scene s;
+            parse_scene(in, s);
+            benchmark_wavefront("render " + scene_file, s);
+        }
+        if (selected("convergence"))
+            benchmark_convergence(scene_file);
+        if (selected("sampler"))
+            benchmark_sampler_convergence(scene_file);
+    }
+
+    if (!json_file.empty())
+    {
+        std::ofstream out(json_file);
+        write_results_json(out);
+        if (!out)
+        {
+            std::cerr << "Could not write " << json_file << std::endl;
+            return 2;
+        }
+    }
+
+    if (!baseline_file.empty() && compare_with_baseline(baseline, threshold) > 0)
+    {
+        return 1;
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+// Axis-aligned bounding boxes are studied from https://raytracing.github.io/books/RayTracingTheNextWeek.html
+
+#ifndef aabb_hpp
+#define aabb_hpp
+
+#include "vec3.hpp"
+#include <algorithm>
+#include <limits>
+
+// An axis-aligned bounding box, the region between the points minimum and maximum.
+// Used by the BVH to skip whole groups of objects that a ray can not hit.
+class aabb
+{
+public:
+    // An empty box, expanding it by anything gives that thing's box
+    aabb() : minimum(inf(), inf(), inf()), maximum(-inf(), -inf(), -inf()) {}
+    aabb(const point3 &a, const point3 &b) : minimum(a), maximum(b) {}
+
+    point3 min() const { return minimum; }
+    point3 max() const { return maximum; }
+
+    // Grow the box so that it also contains box
+    void expand(const aabb &box)
+    {
+        minimum = point3(std::min(minimum.x(), box.minimum.x()), std::min(minimum.y(), box.minimum.y()), std::min(minimum.z(), box.minimum.z()));
+        maximum = point3(std::max(maximum.x(), box.maximum.x()), std::max(maximum.y(), box.maximum.y()), std::max(maximum.z(), box.maximum.z()));
+    }
+
+    // Grow the box so that it also contains point p
+    void expand(const point3 &p)
+    {
+        expand(aabb(p, p));
+    }
+
+    point3 centroid() const { return 0.5 * (minimum + maximum); }
+
+    // Axis (0 = x, 1 = y, 2 = z) along which the box is the longest
+    int longest_axis() const
+    {
+        vec3 extent = maximum - minimum;
+        if (extent.x() > extent.y() && extent.x() > extent.z())
+            return 0;
+        return extent.y() > extent.z() ? 1 : 2;
+    }
+
+    double surface_area() const
+    {
+        vec3 extent = maximum - minimum;
+        if (extent.x() < 0)
+            return 0; // Empty box
+        return 2 * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+    }
+
+    // Slab test, returns true if the ray enters the box somewhere between t_min and t_max
+    // inv_dir is 1 / direction of the ray for each axis, computed once per ray instead of once per box
+    bool hit(const point3 &origin, const vec3 &inv_dir, real t_min, real t_max) const
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            auto t0 = (minimum[a] - origin[a]) * inv_dir[a];
+            auto t1 = (maximum[a] - origin[a]) * inv_dir[a];
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static real inf() { return std::numeric_limits<real>::infinity(); }
+
+    point3 minimum;
+    point3 maximum;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#ifndef adaptive_sampler_hpp
+#define adaptive_sampler_hpp
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "rng.hpp"
+#include "tile_scheduler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+// Settings for adaptive sampling, where pixels keep getting samples only while they are noisy
+struct adaptive_settings
+{
+    bool enabled = false;
+
+    // Every pixel gets at least this many samples, also the number of samples added to a noisy pixel at a time
+    int min_samples = 16;
+
+    // No pixel gets more than this many samples
+    int max_samples = 256;
+
+    // A pixel is done once the 95% confidence interval of its brightness is within this much of its mean
+    double target_error = 0.01;
+};
+
+// Running mean and variance of one pixel's samples (Welford's algorithm) along with the sum of its colors.
+// The variance is of the sample brightness, clamped to 1 as anything brighter shows as white anyway.
+struct pixel_estimate
+{
+    color_sum sum;
+    int count = 0;
+    double mean = 0;
+    double m2 = 0;
+
+    void add(const color &sample)
+    {
+        sum += sample;
+        count++;
+        double luminance = std::min(1.0, 0.2126 * sample.r() + 0.7152 * sample.g() + 0.0722 * sample.b());
+        double delta = luminance - mean;
+        mean += delta / count;
+        m2 += delta * (luminance - mean);
+    }
+
+    // Half width of the 95% confidence interval of the mean brightness
+    double error() const
+    {
+        if (count < 2)
+            return std::numeric_limits<double>::infinity();
+        return 1.96 * std::sqrt(m2 / (count - 1) / count);
+    }
+};
+
+// Renders an image in rounds, only adding samples to the pixels that are still noisy.
+// 1. Every pixel gets min_samples samples, or fewer if that would take more than the budget.
+// 2. Pixels whose error is above target_error get another min_samples samples, the noisiest pixels first if the budget is short.
+// 3. Repeat 2 until every pixel is within target_error, has max_samples, or the total budget of samples is used up.
+// Each pixel keeps its own random generator between rounds, so the image does not depend on the number of threads.
+class adaptive_sampler
+{
+public:
+    // budget is the most samples that may be taken over the whole image
+    adaptive_sampler(int image_width, int image_height, const adaptive_settings &settings, long long budget, uint64_t seed)
+        : width(image_width), height(image_height), settings(settings), budget(budget), estimates((size_t)image_width * image_height)
+    {
+        for (size_t k = 0; k < estimates.size(); k++)
+        {
+            generators.push_back(rng(seed, k));
+        }
+    }
+
+    // sample(i, j, index, gen) returns the color of sample index of pixel (i, j)
+    // on_round(round, active_pixels) is called before each round, to report progress
+    template <typename F, typename G>
+    void render(int num_threads, const F &sample, const G &on_round)
+    {
+        tile_scheduler scheduler(width, height);
+        const int batch = std::max(1, settings.min_samples);
+        // The first round samples every pixel, so it gets fewer samples if the budget can not cover batch for all of them
+        const int first_batch = (int)std::max(1LL, std::min((long long)batch, budget / (long long)estimates.size()));
+
+        // Pixels to sample in the current round, every pixel to start with
+        std::vector<char> active(estimates.size(), 1);
+        size_t num_active = estimates.size();
+        long long used = 0;
+
+        for (int round = 0; num_active > 0; round++)
+        {
+            on_round(round, num_active);
+            const int round_batch = round == 0 ? first_batch : batch;
+            scheduler.run(num_threads, [&](const tile &t) {
+                for (int j = t.y0; j < t.y1; j++)
+                {
+                    for (int i = t.x0; i < t.x1; i++)
+                    {
+                        size_t k = (size_t)j * width + i;
+                        if (!active[k])
+                            continue;
+                        for (int s = 0; s < round_batch; s++)
+                        {
+                            estimates[k].add(sample(i, j, (int)estimates[k].count, generators[k]));
+                        }
+                    }
+                }
+            });
+            used += (long long)num_active * round_batch;
+
+            // Pick the pixels for the next round
+            std::vector<size_t> noisy;
+            for (size_t k = 0; k < estimates.size(); k++)
+            {
+                active[k] = 0;
+                if (estimates[k].count + batch <= settings.max_samples && estimates[k].error() > settings.target_error)
+                {
+                    noisy.push_back(k);
+                }
+            }
+
+            // If the budget can not cover all of them, the noisiest pixels go first
+            size_t affordable = (size_t)std::max(0LL, (budget - used) / batch);
+            if (noisy.size() > affordable)
+            {
+                std::stable_sort(noisy.begin(), noisy.end(), [&](size_t a, size_t b) { return estimates[a].error() > estimates[b].error(); });
+                noisy.resize(affordable);
+            }
+            for (auto k : noisy)
+            {
+                active[k] = 1;
+            }
+            num_active = noisy.size();
+        }
+        samples_taken = used;
+    }
+
+    // Average of each pixel's samples
+    void resolve(framebuffer &image) const
+    {
+        for (int j = 0; j < height; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                const pixel_estimate &estimate = estimates[(size_t)j * width + i];
+                image.at(i, j) = estimate.sum.average(estimate.count);
+            }
+        }
+    }
+
+    long long total_samples() const { return samples_taken; }
+
+    double samples_per_pixel() const { return (double)samples_taken / estimates.size(); }
+
+    // Write an ASCII PPM (P3) image of how many samples each pixel got, from black (none) to white (max_samples)
+    void write_heatmap(std::ostream &os) const
+    {
+        os << "P3\n"
+           << width << ' ' << height << "\n255\n";
+        for (const auto &estimate : estimates)
+        {
+            int level = (int)(255.0 * estimate.count / settings.max_samples);
+            level = std::min(255, level);
+            os << level << ' ' << level << ' ' << level << '\n';
+        }
+    }
+
+private:
+    int width;
+    int height;
+    adaptive_settings settings;
+    long long budget;
+    long long samples_taken = 0;
+    std::vector<pixel_estimate> estimates;
+    std::vector<rng> generators;
+};
+
+#endif
\ No newline at end of file
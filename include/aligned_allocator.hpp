@@ -0,0 +1,48 @@
+#ifndef aligned_allocator_hpp
+#define aligned_allocator_hpp
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Allocator for std::vector that places the elements at an address that is a multiple of Alignment bytes.
+// Used for arrays read with SIMD loads, so that a load never straddles two cache lines.
+template <typename T, size_t Alignment = 64>
+class aligned_allocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef aligned_allocator<U, Alignment> other;
+    };
+
+    aligned_allocator() {}
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment> &) {}
+
+    T *allocate(size_t n)
+    {
+        void *p = nullptr;
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        free(p);
+    }
+};
+
+template <typename T, typename U, size_t Alignment>
+bool operator==(const aligned_allocator<T, Alignment> &, const aligned_allocator<U, Alignment> &) { return true; }
+
+template <typename T, typename U, size_t Alignment>
+bool operator!=(const aligned_allocator<T, Alignment> &, const aligned_allocator<U, Alignment> &) { return false; }
+
+#endif
\ No newline at end of file
@@ -0,0 +1,102 @@
+#ifndef aov_hpp
+#define aov_hpp
+
+#include "camera.hpp"
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "image_io.hpp"
+#include "material.hpp"
+#include "rng.hpp"
+#include "tile_scheduler.hpp"
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+// Camera rays per pixel that the first-hit buffers are averaged over
+#define AOV_SAMPLES 4
+// Mixed into SEED for the first-hit rays, so they do not follow the same random numbers as the image's samples
+#define AOV_SEED_SALT 0x9e3779b97f4a7c15ULL
+
+// Where the camera rays of every pixel first hit something (arbitrary output variables, AOVs), for the denoiser (see denoiser.hpp).
+// Each is averaged over the pixel, like the image. Pixels of the background have albedo 1, normal 0 and depth 0.
+struct aov_buffers
+{
+    aov_buffers(int width, int height) : albedo(width, height), normal(width, height), depth(width, height) {}
+
+    // Color of the material hit (for a LIGHT its emitted color, at most 1)
+    framebuffer albedo;
+    // Normal at the hit, facing the camera (shorter than 1 where the pixel covers an edge)
+    framebuffer normal;
+    // Distance from the camera to the hit, in all three channels
+    framebuffer depth;
+
+    // Write the buffers to prefix_albedo.pfm, prefix_normal.pfm and prefix_depth.pfm, throws std::runtime_error if one can not be written
+    void write(const std::string &prefix) const
+    {
+        const char *names[] = {"_albedo.pfm", "_normal.pfm", "_depth.pfm"};
+        const framebuffer *buffers[] = {&albedo, &normal, &depth};
+        for (int k = 0; k < 3; k++)
+        {
+            std::string file = prefix + names[k];
+            std::ofstream out(file, std::ios::binary | std::ios::trunc);
+            write_image(out, *buffers[k], image_format::pfm);
+            out.flush();
+            if (!out)
+            {
+                throw std::runtime_error("Could not write " + file);
+            }
+        }
+    }
+};
+
+// Color of a material for the albedo buffer, white for a material that is not registered (see MATERIAL_TYPES)
+color material_albedo(const material *mat)
+{
+    if (find_material_info(mat->type) == nullptr)
+        return color(1, 1, 1);
+    material_desc desc = describe_material(mat);
+    return color(std::min(desc.color[0], 1.0), std::min(desc.color[1], 1.0), std::min(desc.color[2], 1.0));
+}
+
+// Fill aovs by tracing AOV_SAMPLES camera rays through every pixel of an image_width x image_height image to their first hit
+template <typename World>
+void render_aovs(const World &world, const camera &cam, int image_width, int image_height, uint64_t seed, int num_threads, aov_buffers &aovs)
+{
+    tile_scheduler scheduler(image_width, image_height);
+    scheduler.run(num_threads, [&](const tile &t) {
+        hit_record rec;
+        for (int j = t.y0; j < t.y1; j++)
+        {
+            for (int i = t.x0; i < t.x1; i++)
+            {
+                rng gen(seed ^ AOV_SEED_SALT, (uint64_t)j * image_width + i);
+                color albedo(0, 0, 0);
+                vec3 normal(0, 0, 0);
+                double depth = 0;
+                for (int sample = 0; sample < AOV_SAMPLES; sample++)
+                {
+                    ray r = cam.get_sample_ray(i, j, image_width, image_height, gen);
+                    if (world.hit_all(r, (real)0.001, std::numeric_limits<real>::infinity(), rec))
+                    {
+                        albedo += material_albedo(rec.mat);
+                        // Spheres give the outward normal, which faces away from a camera inside the sphere
+                        normal += dot(rec.normal, r.direction()) > 0 ? -rec.normal : rec.normal;
+                        depth += rec.t * r.direction().length();
+                    }
+                    else
+                    {
+                        albedo += color(1, 1, 1);
+                    }
+                }
+                aovs.albedo.at(i, j) = albedo / AOV_SAMPLES;
+                aovs.normal.at(i, j) = color(normal.x(), normal.y(), normal.z()) / AOV_SAMPLES;
+                depth /= AOV_SAMPLES;
+                aovs.depth.at(i, j) = color(depth, depth, depth);
+            }
+        }
+    });
+}
+
+#endif
\ No newline at end of file
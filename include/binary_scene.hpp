@@ -0,0 +1,256 @@
+#ifndef binary_scene_hpp
+#define binary_scene_hpp
+
+#include "scene.hpp"
+#include "aligned_allocator.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Version of the binary scene layout, files of another version are not loaded
+#define BINARY_SCENE_VERSION 1
+// Every array of a binary scene starts at a multiple of this many bytes, so it can be read with aligned SIMD loads where it is mapped
+#define BINARY_SCENE_ALIGNMENT 64
+
+// A binary scene file is this header, then the settings lines as text, the material table and the sphere arrays.
+// The sphere arrays are laid out the way sphere_soa_world reads them, so a mapped file is rendered without copying or parsing them.
+// Numbers are stored in the byte order of the machine that wrote the file.
+struct binary_scene_header
+{
+    char magic[8]; // "RTSCENE\n"
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t file_size;
+
+    // The lines of the text file other than SPHERE lines
+    uint64_t settings_offset;
+    uint64_t settings_size;
+
+    uint64_t material_count;
+    uint64_t material_offset;
+
+    // Arrays of sphere_count doubles, except mat_index which holds int32 indices into the material table
+    uint64_t sphere_count;
+    uint64_t center_x_offset;
+    uint64_t center_y_offset;
+    uint64_t center_z_offset;
+    uint64_t radius_offset;
+    uint64_t radius2_offset;
+    uint64_t mat_index_offset;
+};
+
+// Calls fn(center, radius, material) for every sphere of the scene, whether it is held as objects or as arrays
+template <typename F>
+void for_each_sphere(const scene &s, const F &fn)
+{
+    if (s.spheres.count > 0)
+    {
+        const sphere_arrays &a = s.spheres;
+        for (size_t k = 0; k < a.count; k++)
+        {
+            fn(point3(a.center_x[k], a.center_y[k], a.center_z[k]), a.radius[k], a.materials[a.mat_index[k]]);
+        }
+        return;
+    }
+    for (const hittable *object : s.world.objects())
+    {
+        const sphere *sp = dynamic_cast<const sphere *>(object);
+        if (sp == nullptr)
+        {
+            throw std::runtime_error("Only spheres can be written to a scene file, not instances of a GROUP");
+        }
+        fn(sp->center, sp->radius, sp->mat);
+    }
+}
+
+// Write the scene in the binary format
+void write_binary_scene(std::ostream &out, const scene &s)
+{
+    std::map<const material *, int32_t> material_index;
+    std::vector<material_desc> materials;
+    std::vector<double> center_x, center_y, center_z, radius, radius2;
+    std::vector<int32_t> mat_index;
+    for_each_sphere(s, [&](const point3 &center, double r, const material *mat) {
+        // Spheres sharing a material share its table entry
+        auto found = material_index.find(mat);
+        if (found == material_index.end())
+        {
+            found = material_index.insert(std::make_pair(mat, (int32_t)materials.size())).first;
+            materials.push_back(describe_material(mat));
+        }
+        center_x.push_back(center.x());
+        center_y.push_back(center.y());
+        center_z.push_back(center.z());
+        radius.push_back(r);
+        radius2.push_back(r * r);
+        mat_index.push_back(found->second);
+    });
+
+    // Work out where each part goes
+    binary_scene_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "RTSCENE\n", 8);
+    header.version = BINARY_SCENE_VERSION;
+    header.header_size = sizeof(header);
+    uint64_t offset = sizeof(header);
+    auto place = [&](uint64_t bytes) {
+        offset = (offset + BINARY_SCENE_ALIGNMENT - 1) / BINARY_SCENE_ALIGNMENT * BINARY_SCENE_ALIGNMENT;
+        uint64_t start = offset;
+        offset += bytes;
+        return start;
+    };
+    header.settings_size = s.settings_text.size();
+    header.settings_offset = place(header.settings_size);
+    header.material_count = materials.size();
+    header.material_offset = place(materials.size() * sizeof(material_desc));
+    header.sphere_count = center_x.size();
+    header.center_x_offset = place(center_x.size() * sizeof(double));
+    header.center_y_offset = place(center_y.size() * sizeof(double));
+    header.center_z_offset = place(center_z.size() * sizeof(double));
+    header.radius_offset = place(radius.size() * sizeof(double));
+    header.radius2_offset = place(radius2.size() * sizeof(double));
+    header.mat_index_offset = place(mat_index.size() * sizeof(int32_t));
+    header.file_size = offset;
+
+    std::vector<char> file(header.file_size, 0);
+    auto put = [&](uint64_t at, const void *data, size_t bytes) {
+        if (bytes > 0)
+            std::memcpy(&file[at], data, bytes);
+    };
+    put(0, &header, sizeof(header));
+    put(header.settings_offset, s.settings_text.data(), s.settings_text.size());
+    put(header.material_offset, materials.data(), materials.size() * sizeof(material_desc));
+    put(header.center_x_offset, center_x.data(), center_x.size() * sizeof(double));
+    put(header.center_y_offset, center_y.data(), center_y.size() * sizeof(double));
+    put(header.center_z_offset, center_z.data(), center_z.size() * sizeof(double));
+    put(header.radius_offset, radius.data(), radius.size() * sizeof(double));
+    put(header.radius2_offset, radius2.data(), radius2.size() * sizeof(double));
+    put(header.mat_index_offset, mat_index.data(), mat_index.size() * sizeof(int32_t));
+    out.write(file.data(), file.size());
+}
+
+// Shortest of 15 to 17 significant digits that reads back as exactly value, so 0.1 stays 0.1
+std::string format_number(double value)
+{
+    char buffer[32];
+    for (int digits = 15; digits <= 17; digits++)
+    {
+        std::snprintf(buffer, sizeof(buffer), "%.*g", digits, value);
+        if (std::strtod(buffer, nullptr) == value)
+            break;
+    }
+    return buffer;
+}
+
+// Write the scene as a text input file
+void write_text_scene(std::ostream &out, const scene &s)
+{
+    out << s.settings_text;
+    for_each_sphere(s, [&](const point3 &center, double r, const material *mat) {
+        material_desc entry = describe_material(mat);
+        const material_info *info = find_material_info(entry.type);
+        out << "SPHERE " << format_number(center.x()) << ' ' << format_number(center.y()) << ' ' << format_number(center.z()) << ' '
+            << format_number(r) << ' ' << info->keyword << ' '
+            << format_number(entry.color[0]) << ' ' << format_number(entry.color[1]) << ' ' << format_number(entry.color[2]);
+        if (info->parameters > 3)
+            out << ' ' << format_number(entry.fuzz);
+        out << '\n';
+    });
+}
+
+bool is_binary_scene(const char *data, size_t size)
+{
+    return size >= 8 && std::memcmp(data, "RTSCENE\n", 8) == 0;
+}
+
+// Load a binary scene held in data (such as a mapped file) into s. The sphere arrays are used where they are,
+// storage must keep data alive and is kept by the scene. If data is not aligned (such as a received buffer), it is copied first.
+// Throws std::runtime_error if the file is not a valid binary scene.
+void load_binary_scene(const char *data, size_t size, std::shared_ptr<const void> storage, scene &s)
+{
+    if ((uintptr_t)data % BINARY_SCENE_ALIGNMENT != 0)
+    {
+        auto copy = std::make_shared<std::vector<char, aligned_allocator<char, BINARY_SCENE_ALIGNMENT>>>(data, data + size);
+        data = copy->data();
+        storage = copy;
+    }
+
+    binary_scene_header header;
+    if (!is_binary_scene(data, size) || size < sizeof(header))
+    {
+        throw std::runtime_error("Invalid binary scene file");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (header.version != BINARY_SCENE_VERSION)
+    {
+        throw std::runtime_error("Binary scene file is version " + std::to_string(header.version) + ", expected " + std::to_string(BINARY_SCENE_VERSION));
+    }
+    if (header.header_size != sizeof(header) || header.file_size > size)
+    {
+        throw std::runtime_error("Binary scene file is truncated");
+    }
+
+    // Check every part lies in the file (written so that a huge count can not overflow) and the arrays are aligned
+    auto check = [&](uint64_t offset, uint64_t count, uint64_t item_size) {
+        if (offset > header.file_size || count > (header.file_size - offset) / item_size || offset % BINARY_SCENE_ALIGNMENT != 0)
+        {
+            throw std::runtime_error("Binary scene file is corrupt");
+        }
+    };
+    check(header.settings_offset, header.settings_size, 1);
+    check(header.material_offset, header.material_count, sizeof(material_desc));
+    for (uint64_t offset : {header.center_x_offset, header.center_y_offset, header.center_z_offset, header.radius_offset, header.radius2_offset})
+    {
+        check(offset, header.sphere_count, sizeof(double));
+    }
+    check(header.mat_index_offset, header.sphere_count, sizeof(int32_t));
+
+    // The settings lines go through the text parser
+    const char *settings = data + header.settings_offset;
+    parse_scene(settings, settings + header.settings_size, s);
+
+    for (uint64_t k = 0; k < header.material_count; k++)
+    {
+        material_desc entry;
+        std::memcpy(&entry, data + header.material_offset + k * sizeof(material_desc), sizeof(entry));
+        s.spheres.materials.push_back(s.materials.get(entry));
+    }
+
+    sphere_arrays &a = s.spheres;
+    a.count = header.sphere_count;
+    a.center_x = reinterpret_cast<const double *>(data + header.center_x_offset);
+    a.center_y = reinterpret_cast<const double *>(data + header.center_y_offset);
+    a.center_z = reinterpret_cast<const double *>(data + header.center_z_offset);
+    a.radius = reinterpret_cast<const double *>(data + header.radius_offset);
+    a.radius2 = reinterpret_cast<const double *>(data + header.radius2_offset);
+    a.mat_index = reinterpret_cast<const int32_t *>(data + header.mat_index_offset);
+    for (size_t k = 0; k < a.count; k++)
+    {
+        if (a.mat_index[k] < 0 || (uint64_t)a.mat_index[k] >= header.material_count)
+        {
+            throw std::runtime_error("Binary scene file has an invalid material index");
+        }
+    }
+    s.storage = storage;
+
+    // Scenes are identified by their spheres as well as their settings
+    s.hash = fnv1a(data + header.material_offset, header.file_size - header.material_offset, s.hash);
+}
+
+// Parse text or binary scene data, whichever it is
+void load_scene(const char *data, size_t size, std::shared_ptr<const void> storage, scene &s)
+{
+    if (is_binary_scene(data, size))
+        load_binary_scene(data, size, storage, s);
+    else
+        parse_scene(data, data + size, s);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,452 @@
+// Bounding volume hierarchies are studied from https://raytracing.github.io/books/RayTracingTheNextWeek.html
+// and the binned SAH build from https://pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+
+#ifndef bvh_hpp
+#define bvh_hpp
+
+#include "aabb.hpp"
+#include "hittable_list.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <vector>
+
+// Number of buckets the centroids are sorted into when looking for the best split
+#define BVH_BINS 16
+// A node with this many objects or fewer may become a leaf
+#define BVH_MAX_LEAF 4
+// Subtrees with fewer objects than this are always built on the current thread
+#define BVH_PARALLEL_THRESHOLD 4096
+// The traversal stack is fixed size, so the tree must not get deeper than this
+#define BVH_MAX_DEPTH 60
+// Most rays hit_packet takes at once
+#define BVH_PACKET_SIZE 64
+
+// Statistics about a built BVH
+struct bvh_stats
+{
+    int nodes = 0;
+    int leaves = 0;
+    int depth = 0;
+    double build_ms = 0;
+};
+
+// World made of the objects of a hittable_list, arranged in a bounding volume hierarchy.
+// It answers the same hit_all and occluded queries as hittable_list, but a ray only tests the objects whose boxes it passes through,
+// so the cost of a ray grows with log(number of objects) instead of with the number of objects.
+// The objects are still owned by the hittable_list, which must outlive the BVH.
+class bvh_world
+{
+public:
+    // Builds the tree, splitting large subtrees over up to num_threads threads
+    bvh_world(const hittable_list &list, int num_threads = 1)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        const std::vector<hittable *> &objects = list.objects();
+        std::vector<primitive> prims(objects.size());
+        for (size_t k = 0; k < objects.size(); k++)
+        {
+            prims[k].box = objects[k]->bounding_box();
+            prims[k].centroid = prims[k].box.centroid();
+            prims[k].index = (int)k;
+        }
+
+        if (!prims.empty())
+        {
+            std::unique_ptr<build_node> root(build(prims, 0, (int)prims.size(), 0, std::max(1, num_threads)));
+
+            // The leaves refer to ranges of prims, which build() has sorted into tree order
+            ordered.reserve(prims.size());
+            for (const auto &prim : prims)
+            {
+                ordered.push_back(objects[prim.index]);
+            }
+            flatten(root.get(), 0);
+        }
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        build_stats.build_ms = elapsed.count();
+        build_stats.nodes = (int)nodes.size();
+    }
+
+    const bvh_stats &stats() const { return build_stats; }
+
+    // Memory of the nodes and of the object pointers in tree order
+    size_t memory_bytes() const
+    {
+        return nodes.capacity() * sizeof(bvh_node) + ordered.capacity() * sizeof(hittable *);
+    }
+
+    // function that takes in a ray to see if the ray hits what hittables in the world, same as hittable_list::hit_all
+    bool hit_all(const ray &ray_in, real t_min, real t_max, hit_record &rec) const
+    {
+        if (nodes.empty())
+            return false;
+
+        const point3 origin = ray_in.origin();
+        const vec3 dir = ray_in.direction();
+        const vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+        const bool dir_negative[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        hit_record curr_record;
+        bool hit_something = false;
+        auto t = t_max;
+        // Counted here and added to the statistics once, they compile away without RAYTRACE_STATS
+        uint64_t node_visits = 0;
+        uint64_t sphere_tests = 0;
+
+        // Nodes still to visit
+        int stack[BVH_MAX_DEPTH + 1];
+        int stack_size = 0;
+        int current = 0;
+        while (true)
+        {
+            const bvh_node &node = nodes[current];
+            node_visits++;
+            if (node.box.hit(origin, inv_dir, t_min, t))
+            {
+                if (node.count > 0)
+                {
+                    // Leaf, test each object like hittable_list does
+                    sphere_tests += node.count;
+                    for (int k = node.offset; k < node.offset + node.count; k++)
+                    {
+                        if (ordered[k]->hit(ray_in, t_min, t, curr_record))
+                        {
+                            hit_something = true;
+                            t = curr_record.t;
+                            rec = curr_record;
+                        }
+                    }
+                }
+                else
+                {
+                    // Visit the child nearer to the ray first, as a hit there lets us skip the other one
+                    if (dir_negative[node.axis])
+                    {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+        STATS_COUNT(node_visits, node_visits);
+        STATS_COUNT(sphere_tests, sphere_tests);
+        return hit_something;
+    }
+
+    // Whether any object blocks the ray between t_min and t_max, same as hittable_list::occluded.
+    // The walk stops at the first object in the way; with no closest hit to shrink t_max, the boxes are always tested against the whole segment.
+    bool occluded(const ray &ray_in, real t_min, real t_max) const
+    {
+        if (nodes.empty())
+            return false;
+
+        const point3 origin = ray_in.origin();
+        const vec3 dir = ray_in.direction();
+        const vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+        const bool dir_negative[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        bool blocked = false;
+        uint64_t node_visits = 0;
+        uint64_t sphere_tests = 0;
+
+        int stack[BVH_MAX_DEPTH + 1];
+        int stack_size = 0;
+        int current = 0;
+        while (!blocked)
+        {
+            const bvh_node &node = nodes[current];
+            node_visits++;
+            if (node.box.hit(origin, inv_dir, t_min, t_max))
+            {
+                if (node.count > 0)
+                {
+                    for (int k = node.offset; k < node.offset + node.count && !blocked; k++)
+                    {
+                        sphere_tests++;
+                        blocked = ordered[k]->occluded(ray_in, t_min, t_max);
+                    }
+                }
+                else
+                {
+                    // The nearer child first, objects close to the start of a shadow ray are the likeliest to block it
+                    if (dir_negative[node.axis])
+                    {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+        STATS_COUNT(node_visits, node_visits);
+        STATS_COUNT(sphere_tests, sphere_tests);
+        return blocked;
+    }
+
+    // Closest hits of count (up to BVH_PACKET_SIZE) rays, like calling hit_all for each, but walking the tree once for all of them.
+    // hits[k] tells whether rays[k] hit something, and recs[k] is then its hit.
+    // The near child is picked by the direction of the first ray, so the rays should go roughly the same way (such as the camera rays of a few pixels).
+    // Each node is then fetched once for the whole packet rather than once per ray.
+    void hit_packet(const ray *rays, int count, real t_min, real t_max, hit_record *recs, bool *hits) const
+    {
+        point3 origins[BVH_PACKET_SIZE];
+        vec3 inv_dirs[BVH_PACKET_SIZE];
+        real t[BVH_PACKET_SIZE];
+        for (int r = 0; r < count; r++)
+        {
+            const vec3 dir = rays[r].direction();
+            origins[r] = rays[r].origin();
+            inv_dirs[r] = vec3(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+            t[r] = t_max;
+            hits[r] = false;
+        }
+        if (nodes.empty() || count == 0)
+            return;
+        const bool dir_negative[3] = {inv_dirs[0].x() < 0, inv_dirs[0].y() < 0, inv_dirs[0].z() < 0};
+
+        // Nodes still to visit, each with the first ray that may pass through it (the rays before it missed its parent)
+        int stack[BVH_MAX_DEPTH + 1];
+        int stack_first[BVH_MAX_DEPTH + 1];
+        int stack_size = 0;
+        int current = 0;
+        int first = 0;
+        hit_record curr_record;
+        uint64_t node_visits = 0;
+        uint64_t sphere_tests = 0;
+        while (true)
+        {
+            const bvh_node &node = nodes[current];
+            node_visits++;
+            while (first < count && !node.box.hit(origins[first], inv_dirs[first], t_min, t[first]))
+                first++;
+            if (first < count)
+            {
+                if (node.count > 0)
+                {
+                    for (int r = first; r < count; r++)
+                    {
+                        if (r > first && !node.box.hit(origins[r], inv_dirs[r], t_min, t[r]))
+                            continue;
+                        sphere_tests += node.count;
+                        for (int k = node.offset; k < node.offset + node.count; k++)
+                        {
+                            if (ordered[k]->hit(rays[r], t_min, t[r], curr_record))
+                            {
+                                hits[r] = true;
+                                t[r] = curr_record.t;
+                                recs[r] = curr_record;
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    int near_child = dir_negative[node.axis] ? node.offset : current + 1;
+                    int far_child = dir_negative[node.axis] ? current + 1 : node.offset;
+                    stack[stack_size] = far_child;
+                    stack_first[stack_size++] = first;
+                    current = near_child;
+                    continue;
+                }
+            }
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+            first = stack_first[stack_size];
+        }
+        STATS_COUNT(node_visits, node_visits);
+        STATS_COUNT(sphere_tests, sphere_tests);
+    }
+
+private:
+    struct primitive
+    {
+        aabb box;
+        point3 centroid;
+        int index;
+    };
+
+    // Tree built by build(), turned into the flat list of nodes by flatten()
+    struct build_node
+    {
+        aabb box;
+        int axis = 0;
+        int first = 0;
+        int count = 0; // 0 for interior nodes
+        std::unique_ptr<build_node> left;
+        std::unique_ptr<build_node> right;
+    };
+
+    // Node of the flattened tree, in depth first order
+    // An interior node's first child is the next node and its second child is at offset
+    // A leaf's objects are ordered[offset] to ordered[offset + count - 1]
+    struct bvh_node
+    {
+        aabb box;
+        int offset;
+        int count;
+        int axis;
+    };
+
+    // Builds the subtree for prims[begin] to prims[end - 1], reordering them so that every leaf's objects are next to each other
+    build_node *build(std::vector<primitive> &prims, int begin, int end, int depth, int num_threads)
+    {
+        build_node *node = new build_node();
+        int count = end - begin;
+
+        aabb centroid_bounds;
+        for (int k = begin; k < end; k++)
+        {
+            node->box.expand(prims[k].box);
+            centroid_bounds.expand(prims[k].centroid);
+        }
+
+        int axis = centroid_bounds.longest_axis();
+        double axis_min = centroid_bounds.min()[axis];
+        double axis_extent = centroid_bounds.max()[axis] - axis_min;
+
+        // All centroids at the same place (or a tree that is already too deep), nothing useful to split on
+        if (count <= 1 || axis_extent <= 0 || depth >= BVH_MAX_DEPTH)
+        {
+            return make_leaf(node, begin, count);
+        }
+
+        // Sort the centroids into bins along the axis
+        struct bin
+        {
+            aabb box;
+            int count = 0;
+        };
+        bin bins[BVH_BINS];
+        auto bin_of = [&](const primitive &prim) {
+            int b = (int)(BVH_BINS * (prim.centroid[axis] - axis_min) / axis_extent);
+            return std::min(b, BVH_BINS - 1);
+        };
+        for (int k = begin; k < end; k++)
+        {
+            bin &b = bins[bin_of(prims[k])];
+            b.box.expand(prims[k].box);
+            b.count++;
+        }
+
+        // Surface area heuristic: the chance of a ray hitting a child is proportional to its surface area,
+        // so pick the split between bins that minimizes area * number of objects summed over both children
+        double costs[BVH_BINS - 1];
+        aabb left_box;
+        int left_count = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++)
+        {
+            left_box.expand(bins[b].box);
+            left_count += bins[b].count;
+            costs[b] = left_box.surface_area() * left_count;
+        }
+        aabb right_box;
+        int right_count = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            right_box.expand(bins[b].box);
+            right_count += bins[b].count;
+            costs[b - 1] += right_box.surface_area() * right_count;
+        }
+
+        int best_split = 0;
+        for (int b = 1; b < BVH_BINS - 1; b++)
+        {
+            if (costs[b] < costs[best_split])
+                best_split = b;
+        }
+
+        // Traversing a node costs about as much as testing one sphere
+        double split_cost = 1 + costs[best_split] / node->box.surface_area();
+        double leaf_cost = count;
+        if (count <= BVH_MAX_LEAF && leaf_cost <= split_cost)
+        {
+            return make_leaf(node, begin, count);
+        }
+
+        primitive *mid_ptr = std::partition(&prims[begin], &prims[begin] + count, [&](const primitive &prim) { return bin_of(prim) <= best_split; });
+        int mid = (int)(mid_ptr - &prims[0]);
+        if (mid == begin || mid == end)
+        {
+            mid = begin + count / 2;
+        }
+
+        node->axis = axis;
+
+        // The two halves touch separate parts of prims, so a large one can be built on another thread
+        if (num_threads > 1 && count >= BVH_PARALLEL_THRESHOLD)
+        {
+            int right_threads = num_threads / 2;
+            std::future<build_node *> right = std::async(std::launch::async, [&]() { return build(prims, mid, end, depth + 1, right_threads); });
+            node->left.reset(build(prims, begin, mid, depth + 1, num_threads - right_threads));
+            node->right.reset(right.get());
+        }
+        else
+        {
+            node->left.reset(build(prims, begin, mid, depth + 1, 1));
+            node->right.reset(build(prims, mid, end, depth + 1, 1));
+        }
+        return node;
+    }
+
+    build_node *make_leaf(build_node *node, int begin, int count)
+    {
+        node->first = begin;
+        node->count = count;
+        return node;
+    }
+
+    // Append node and its subtree to nodes, returns the index of node
+    int flatten(const build_node *node, int depth)
+    {
+        int index = (int)nodes.size();
+        nodes.push_back(bvh_node());
+        nodes[index].box = node->box;
+        nodes[index].axis = node->axis;
+        build_stats.depth = std::max(build_stats.depth, depth);
+
+        if (node->count > 0)
+        {
+            nodes[index].offset = node->first;
+            nodes[index].count = node->count;
+            build_stats.leaves++;
+        }
+        else
+        {
+            nodes[index].count = 0;
+            flatten(node->left.get(), depth + 1);
+            // Not assigned directly, as flattening may reallocate nodes
+            int right = flatten(node->right.get(), depth + 1);
+            nodes[index].offset = right;
+        }
+        return index;
+    }
+
+    std::vector<bvh_node> nodes;
+    std::vector<hittable *> ordered;
+    bvh_stats build_stats;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,100 @@
+// Camera is studied from https://raytracing.github.io/books/RayTracingInOneWeekend.html
+
+#ifndef camera_hpp
+#define camera_hpp
+
+#include "vec3.hpp"
+#include "ray.hpp"
+#include "rng.hpp"
+#include "sampler.hpp"
+#include <cmath>
+
+// Where a camera is and where it looks, as given by a CAMERA or CAMERA_PATH line of the input file
+struct camera_view
+{
+    point3 position;
+    point3 look_at;
+    // Vertical field of view in degrees
+    double fov;
+};
+
+// By default the camera sits at the origin looking down the negative z axis at a viewport with a height of 2.
+class camera
+{
+public:
+    camera(double asp_ratio = 16.0 / 9.0)
+    {
+        const double viewport_height = 2.0;
+        const double viewport_width = viewport_height * asp_ratio; // 3.56
+
+        // Distance between the projection point(camera) and the projection plane
+        // Larger means more zoomed in
+        // Smaller means more zoomed out
+        const double focal_length = 1.0;
+
+        origin = point3(0, 0, 0);
+        horizontal = vec3(viewport_width, 0, 0);
+        vertical = vec3(0, viewport_height, 0);
+        lower_left_corner = origin - horizontal / 2 - vertical / 2 - vec3(0, 0, focal_length);
+    }
+
+    // Camera at view.position looking towards view.look_at, with y pointing up.
+    // The viewport is 1 in front of the camera, as high as view.fov covers and asp_ratio times as wide.
+    camera(const camera_view &view, double asp_ratio)
+    {
+        const double viewport_height = 2.0 * std::tan(view.fov * M_PI / 360);
+        const double viewport_width = viewport_height * asp_ratio;
+
+        // w points backwards from the camera, u to its right and v up
+        vec3 w = normalize(view.position - view.look_at);
+        vec3 up(0, 1, 0);
+        // Looking straight up or down, the image's up is taken to be along negative z instead
+        if (cross(up, w).length() < 1e-6)
+            up = vec3(0, 0, -1);
+        vec3 u = normalize(cross(up, w));
+        vec3 v = cross(w, u);
+
+        origin = view.position;
+        horizontal = viewport_width * u;
+        vertical = viewport_height * v;
+        lower_left_corner = origin - horizontal / 2 - vertical / 2 - w;
+    }
+
+    // Ray with origin at camera, direction going towards the pixel, remember u is the pixel at horizontal (width), v is pixel at vertical (height)
+    // u ranges from 0 to 1 representing width, v ranges from 0 to 1 representing height, therefore multiply with horizontal and vertical.
+    // lower_left_corner represents the bottom left pixel point3.
+    // So basically, lower_left_corner + u*horizontal + (1 - v)*vertical gives the pixel position (viewport coordinates), then minus origin position to get the ray direction.
+    // 1 - v becase v goes from 0 to 1, but we are writing our PPM image from top to bottom, so we need to shoot rays from 1 to 0.
+    ray get_ray(double u, double v) const
+    {
+        return ray(origin, lower_left_corner + u * horizontal + (1 - v) * vertical - origin);
+    }
+
+    // Ray through a random point within pixel (i, j) of an image_width x image_height image, used for anti-aliasing
+    ray get_sample_ray(int i, int j, int image_width, int image_height, rng &gen) const
+    {
+        // Add a random value between 0 and 1 for multiple samples
+        auto u = (double(i) + gen.next_double()) / (image_width - 1);
+        auto v = (double(j) + gen.next_double()) / (image_height - 1);
+        return get_ray(u, v);
+    }
+
+    // Same, with the point within the pixel taken from the first dimension of the sampler's current sample
+    ray get_sample_ray(int i, int j, int image_width, int image_height, sampler &gen) const
+    {
+        double du, dv;
+        gen.start_dimension(0);
+        gen.get_2d(du, dv);
+        auto u = (double(i) + du) / (image_width - 1);
+        auto v = (double(j) + dv) / (image_height - 1);
+        return get_ray(u, v);
+    }
+
+private:
+    point3 origin;
+    vec3 horizontal;
+    vec3 vertical;
+    point3 lower_left_corner;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+// Catmull-Rom splines are from "A Class of Local Interpolating Splines" (Catmull and Rom, 1974)
+
+#ifndef camera_path_hpp
+#define camera_path_hpp
+
+#include "camera.hpp"
+#include <vector>
+
+// A view of the camera at one frame of an animation, from a CAMERA_PATH line
+struct camera_keyframe
+{
+    int frame;
+    camera_view view;
+};
+
+// Point t (0 to 1) of the way from p1 to p2 along a Catmull-Rom spline through p0, p1, p2 and p3.
+// The curve goes through every key point and turns smoothly at each, so a few keyframes around a circle give a round path.
+point3 catmull_rom(const point3 &p0, const point3 &p1, const point3 &p2, const point3 &p3, double t)
+{
+    double t2 = t * t;
+    double t3 = t2 * t;
+    return 0.5 * ((2 * p1) + t * (p2 - p0) + t2 * (2 * p0 - 5 * p1 + 4 * p2 - p3) + t3 * (3 * p1 - p0 - 3 * p2 + p3));
+}
+
+// The camera's views of an animation, given at keyframes and interpolated between them.
+// Positions and look-at points follow Catmull-Rom splines through the keyframes, the field of view changes linearly.
+class camera_path
+{
+public:
+    // Keyframes must be added in order of their frames
+    void add(const camera_keyframe &keyframe) { keyframes.push_back(keyframe); }
+
+    bool empty() const { return keyframes.empty(); }
+    int first_frame() const { return keyframes.front().frame; }
+    int last_frame() const { return keyframes.back().frame; }
+
+    // The view at frame, which is held at the first or last keyframe's view outside of the path
+    camera_view view_at(int frame) const
+    {
+        if (frame <= first_frame())
+            return keyframes.front().view;
+        if (frame >= last_frame())
+            return keyframes.back().view;
+
+        size_t k = 1;
+        while (keyframes[k].frame < frame)
+            k++;
+        // frame is between keyframes k - 1 and k, the ends of the path are repeated for the splines' outer points
+        const camera_keyframe &a = keyframes[k - 1];
+        const camera_keyframe &b = keyframes[k];
+        const camera_view &before = keyframes[k >= 2 ? k - 2 : 0].view;
+        const camera_view &after = keyframes[k + 1 < keyframes.size() ? k + 1 : k].view;
+        double t = (double)(frame - a.frame) / (b.frame - a.frame);
+
+        camera_view view;
+        view.position = catmull_rom(before.position, a.view.position, b.view.position, after.position, t);
+        view.look_at = catmull_rom(before.look_at, a.view.look_at, b.view.look_at, after.look_at, t);
+        view.fov = a.view.fov + t * (b.view.fov - a.view.fov);
+        return view;
+    }
+
+private:
+    std::vector<camera_keyframe> keyframes;
+};
+
+#endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define color_hpp
 
 #include "color.hpp"
+#include "real.hpp"
 #include <iostream>
 
 // The color class, similar to vec3 but seperated into individual classes for error checking.
@@ -9,18 +10,18 @@ class color
 {
 public:
     color() : e{0, 0, 0} {}
-    color(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    color(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-    double r() const { return e[0]; }
-    double g() const { return e[1]; }
-    double b() const { return e[2]; }
+    real r() const { return e[0]; }
+    real g() const { return e[1]; }
+    real b() const { return e[2]; }
 
     // Negation
     color operator-() const { return color(-e[0], -e[1], -e[2]); }
 
     // Return by value
-    double operator[](int i) const { return e[i]; }
-    double &operator[](int i) { return e[i]; }
+    real operator[](int i) const { return e[i]; }
+    real &operator[](int i) { return e[i]; }
 
     // Arithmetical operators
     color &operator+=(const color &v)
@@ -39,7 +40,7 @@ public:
         return *this;
     }
 
-    color &operator*=(const double t)
+    color &operator*=(const real t)
     {
         e[0] *= t;
         e[1] *= t;
@@ -47,7 +48,7 @@ public:
         return *this;
     }
 
-    color &operator/=(const double t)
+    color &operator/=(const real t)
     {
         return *this *= 1 / t;
     }
@@ -57,13 +58,13 @@ private:
     friend color operator+(const color &u, const color &v);
     friend color operator-(const color &u, const color &v);
     friend color operator*(const color &u, const color &v);
-    friend color operator*(double t, const color &v);
-    // friend color operator*(const color &v, double t);
-    // friend color operator/(color v, double t);
-    friend double dot(const color &u, const color &v);
+    friend color operator*(real t, const color &v);
+    // friend color operator*(const color &v, real t);
+    // friend color operator/(color v, real t);
+    friend real dot(const color &u, const color &v);
     friend color cross(const color &u, const color &v);
     // friend color unit_vector(color v);
-    double e[3];
+    real e[3];
 };
 
 // Function to easily write one color color pixel to output stream
@@ -111,24 +112,55 @@ color operator*(const color &u, const color &v)
     return color(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-color operator*(double t, const color &v)
+color operator*(real t, const color &v)
 {
     return color(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-color operator*(const color &v, double t)
+color operator*(const color &v, real t)
 {
     return t * v;
 }
 
-color operator/(color v, double t)
+color operator/(color v, real t)
 {
     return (1 / t) * v;
 }
 
-double dot(const color &u, const color &v)
+real dot(const color &u, const color &v)
 {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
+// Running sum of many colors, such as the samples of a pixel.
+// Its channels are doubles whatever real is, so that in a float build the samples added late in a long sum still count in full.
+class color_sum
+{
+public:
+    color_sum() : e{0, 0, 0} {}
+    color_sum(double e0, double e1, double e2) : e{e0, e1, e2} {}
+
+    double r() const { return e[0]; }
+    double g() const { return e[1]; }
+    double b() const { return e[2]; }
+
+    color_sum &operator+=(const color &v)
+    {
+        e[0] += v.r();
+        e[1] += v.g();
+        e[2] += v.b();
+        return *this;
+    }
+
+    // Mean of the count colors added
+    color average(double count) const
+    {
+        double inverse = 1 / count;
+        return color((real)(inverse * e[0]), (real)(inverse * e[1]), (real)(inverse * e[2]));
+    }
+
+private:
+    double e[3];
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,391 @@
+// The edge-avoiding a-trous filter is from "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering"
+// (Dammertz, Sewtz, Hanika and Lensch, 2010), guided by the luminance variance as in "Spatiotemporal Variance-Guided Filtering"
+// (Schied et al., 2017) without its temporal part
+
+#ifndef denoiser_hpp
+#define denoiser_hpp
+
+#include "aligned_allocator.hpp"
+#include "aov.hpp"
+#include "framebuffer.hpp"
+#include "tile_scheduler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The SIMD kernel is written with x86 intrinsics and compiled with a GCC/Clang target attribute, like those of sphere_soa.hpp
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DENOISER_X86 1
+#include <immintrin.h>
+#endif
+
+// Number of filter passes, the taps of each pass are twice as far apart as the last (1, 2, 4 and 8 pixels)
+#define DENOISE_PASSES 4
+// A neighbour's weight is the cosine between the normals squared this many times (raised to the power 256), so the shading of
+// a sphere is not blurred across its curve
+#define DENOISE_NORMAL_SQUARINGS 8
+// How far a neighbour's depth may differ, as a fraction of the pixel's depth per pixel between them
+#define DENOISE_DEPTH_SIGMA 0.05f
+// How far a neighbour's albedo may differ
+#define DENOISE_ALBEDO_SIGMA 0.1f
+// How far a neighbour's luminance may differ, in standard deviations of the pixel's noise
+#define DENOISE_LUMINANCE_SIGMA 4.0f
+// Albedo below this is taken as this when dividing it out, so black surfaces do not divide by 0
+#define DENOISE_MIN_ALBEDO 0.01f
+
+// Which filter kernel the denoiser uses
+enum class denoise_kernel
+{
+    scalar,
+    avx2, // 8 pixels per instruction
+};
+
+// Removes the noise of an image rendered with few samples per pixel, using the first-hit buffers (see aov.hpp) to keep edges sharp.
+// The albedo is divided out of the color first, so only the light reaching the surfaces (the noisy part) is smoothed, and multiplied back in at the end.
+// Each pass averages every pixel with 5x5 neighbours, weighted by how alike their normals, depth, albedo and luminance are.
+// The luminance weight allows for the pixel's noise (its variance), which shrinks with every pass.
+// Pixels of the background are left as they are.
+// Every channel is kept in its own array of floats, so the SIMD kernel filters 8 neighbouring pixels at once.
+class denoiser
+{
+public:
+    typedef std::vector<float, aligned_allocator<float>> plane;
+
+    denoiser(const framebuffer &image, const aov_buffers &aovs) : width(image.width()), height(image.height())
+    {
+        size_t n = (size_t)width * height;
+        for (plane *p : {&r, &g, &b, &variance, &out_r, &out_g, &out_b, &out_variance, &sigma, &nx, &ny, &nz, &depth, &depth_sigma, &ar, &ag, &ab})
+            p->assign(n, 0.0f);
+
+        for (int j = 0; j < height; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                size_t k = (size_t)j * width + i;
+                const color &c = image.at(i, j);
+                const color &a = aovs.albedo.at(i, j);
+                const color &normal = aovs.normal.at(i, j);
+                ar[k] = (float)a.r();
+                ag[k] = (float)a.g();
+                ab[k] = (float)a.b();
+                r[k] = (float)c.r() / std::max(ar[k], DENOISE_MIN_ALBEDO);
+                g[k] = (float)c.g() / std::max(ag[k], DENOISE_MIN_ALBEDO);
+                b[k] = (float)c.b() / std::max(ab[k], DENOISE_MIN_ALBEDO);
+                // The averaged normal is shorter where the pixel covers an edge, which would shrink even the pixel's weight for itself to nothing
+                double length = std::sqrt(normal.r() * normal.r() + normal.g() * normal.g() + normal.b() * normal.b());
+                if (length > 0)
+                {
+                    nx[k] = (float)(normal.r() / length);
+                    ny[k] = (float)(normal.g() / length);
+                    nz[k] = (float)(normal.b() / length);
+                }
+                depth[k] = (float)aovs.depth.at(i, j).r();
+                depth_sigma[k] = 1 / (DENOISE_DEPTH_SIGMA * depth[k] + 1e-6f);
+            }
+        }
+    }
+
+    // Fastest kernel that this CPU can run
+    static denoise_kernel best_kernel()
+    {
+#ifdef DENOISER_X86
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return denoise_kernel::avx2;
+#endif
+        return denoise_kernel::scalar;
+    }
+
+    static std::string kernel_name(denoise_kernel k)
+    {
+        return k == denoise_kernel::avx2 ? "AVX2" : "scalar";
+    }
+
+    // Filter the image with DENOISE_PASSES passes on num_threads threads
+    void run(int num_threads, denoise_kernel kernel = best_kernel())
+    {
+        tile_scheduler scheduler(width, height, 64);
+        scheduler.run(num_threads, [&](const tile &t) { estimate_variance(t); });
+        for (int pass = 0; pass < DENOISE_PASSES; pass++)
+        {
+            const int step = 1 << pass;
+            scheduler.run(num_threads, [&](const tile &t) { prefilter_variance(t); });
+            scheduler.run(num_threads, [&](const tile &t) {
+                for (int j = t.y0; j < t.y1; j++)
+                {
+                    int i = t.x0;
+#ifdef DENOISER_X86
+                    // The SIMD kernel needs all the taps of its 8 pixels inside the image, the pixels near the sides are filtered one at a time
+                    if (kernel == denoise_kernel::avx2)
+                    {
+                        int simd_begin = std::max(t.x0, 2 * step);
+                        int simd_end = std::min(t.x1, width - 2 * step);
+                        for (; i < simd_begin && i < t.x1; i++)
+                            filter_scalar(i, j, step);
+                        for (; i + 8 <= simd_end; i += 8)
+                            filter_avx2(i, j, step);
+                    }
+#endif
+                    for (; i < t.x1; i++)
+                        filter_scalar(i, j, step);
+                }
+            });
+            std::swap(r, out_r);
+            std::swap(g, out_g);
+            std::swap(b, out_b);
+            std::swap(variance, out_variance);
+        }
+    }
+
+    // Write the filtered colors back into image, with the albedo multiplied back in
+    void resolve(framebuffer &image) const
+    {
+        for (int j = 0; j < height; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                size_t k = (size_t)j * width + i;
+                if (depth[k] > 0)
+                    image.at(i, j) = color(r[k] * std::max(ar[k], DENOISE_MIN_ALBEDO), g[k] * std::max(ag[k], DENOISE_MIN_ALBEDO), b[k] * std::max(ab[k], DENOISE_MIN_ALBEDO));
+            }
+        }
+    }
+
+private:
+    static float luminance(float r, float g, float b)
+    {
+        return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+
+    // Weights of the 5 taps of a B3 spline along one axis, by distance from the middle
+    static float spline_weight(int d)
+    {
+        return d == 0 ? 3.0f / 8 : (d == 1 || d == -1) ? 1.0f / 4 : 1.0f / 16;
+    }
+
+    // Weight for the normals and the depth of neighbour q of pixel p, without the luminance
+    float geometry_weight(size_t p, size_t q, float inverse_distance) const
+    {
+        float cosine = std::max(0.0f, nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q]);
+        for (int k = 0; k < DENOISE_NORMAL_SQUARINGS; k++)
+            cosine *= cosine;
+        float da = ar[p] - ar[q], dg = ag[p] - ag[q], db = ab[p] - ab[q];
+        float exponent = std::fabs(depth[p] - depth[q]) * depth_sigma[p] * inverse_distance +
+                         (da * da + dg * dg + db * db) * (1 / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA));
+        return cosine * std::exp(-exponent);
+    }
+
+    // Before the first pass, the noise of each pixel is estimated from the spread of the luminance of its 3x3 neighbours on the same surface
+    void estimate_variance(const tile &t)
+    {
+        for (int j = t.y0; j < t.y1; j++)
+        {
+            for (int i = t.x0; i < t.x1; i++)
+            {
+                size_t p = (size_t)j * width + i;
+                float sum_w = 0, sum_l = 0, sum_l2 = 0;
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    for (int dx = -1; dx <= 1; dx++)
+                    {
+                        int x = i + dx, y = j + dy;
+                        if (x < 0 || y < 0 || x >= width || y >= height)
+                            continue;
+                        size_t q = (size_t)y * width + x;
+                        float w = depth[p] > 0 ? geometry_weight(p, q, 1.0f / (std::abs(dx) + std::abs(dy) + 1e-6f)) : 1;
+                        float l = luminance(r[q], g[q], b[q]);
+                        sum_w += w;
+                        sum_l += w * l;
+                        sum_l2 += w * l * l;
+                    }
+                }
+                float mean = sum_l / std::max(sum_w, 1e-12f);
+                variance[p] = std::max(0.0f, sum_l2 / std::max(sum_w, 1e-12f) - mean * mean);
+            }
+        }
+    }
+
+    // Each pass compares luminance against the variance blurred over 3x3 pixels, which is less noisy than the pixel's own.
+    // sigma holds 1 / (DENOISE_LUMINANCE_SIGMA * standard deviation) for the pass.
+    void prefilter_variance(const tile &t)
+    {
+        for (int j = t.y0; j < t.y1; j++)
+        {
+            for (int i = t.x0; i < t.x1; i++)
+            {
+                float sum = 0, sum_w = 0;
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    for (int dx = -1; dx <= 1; dx++)
+                    {
+                        int x = i + dx, y = j + dy;
+                        if (x < 0 || y < 0 || x >= width || y >= height)
+                            continue;
+                        float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+                        sum += w * variance[(size_t)y * width + x];
+                        sum_w += w;
+                    }
+                }
+                sigma[(size_t)j * width + i] = 1 / (DENOISE_LUMINANCE_SIGMA * std::sqrt(sum / sum_w) + 1e-4f);
+            }
+        }
+    }
+
+    void filter_scalar(int i, int j, int step)
+    {
+        size_t p = (size_t)j * width + i;
+        if (depth[p] <= 0)
+        {
+            out_r[p] = r[p];
+            out_g[p] = g[p];
+            out_b[p] = b[p];
+            out_variance[p] = variance[p];
+            return;
+        }
+
+        float l_p = luminance(r[p], g[p], b[p]);
+        float sum_w = 0, sum_r = 0, sum_g = 0, sum_b = 0, sum_variance = 0;
+        for (int dy = -2; dy <= 2; dy++)
+        {
+            int y = j + dy * step;
+            if (y < 0 || y >= height)
+                continue;
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                int x = i + dx * step;
+                if (x < 0 || x >= width)
+                    continue;
+                size_t q = (size_t)y * width + x;
+                float inverse_distance = 1.0f / (step * (std::abs(dx) + std::abs(dy)) + 1e-6f);
+                float w = spline_weight(dx) * spline_weight(dy) * geometry_weight(p, q, inverse_distance) *
+                          std::exp(-std::fabs(l_p - luminance(r[q], g[q], b[q])) * sigma[p]);
+                sum_w += w;
+                sum_r += w * r[q];
+                sum_g += w * g[q];
+                sum_b += w * b[q];
+                sum_variance += w * w * variance[q];
+            }
+        }
+        if (sum_w <= 0)
+        {
+            out_r[p] = r[p];
+            out_g[p] = g[p];
+            out_b[p] = b[p];
+            out_variance[p] = variance[p];
+            return;
+        }
+        out_r[p] = sum_r / sum_w;
+        out_g[p] = sum_g / sum_w;
+        out_b[p] = sum_b / sum_w;
+        out_variance[p] = sum_variance / sum_w / sum_w;
+    }
+
+#ifdef DENOISER_X86
+    // e to the power -x for x >= 0, from 2 to the power of the integer part (put straight into the exponent bits) times a polynomial for the fraction
+    __attribute__((target("avx2,fma"))) static __m256 exp_negative_avx2(__m256 x)
+    {
+        __m256 t = _mm256_mul_ps(_mm256_min_ps(x, _mm256_set1_ps(80.0f)), _mm256_set1_ps(-1.44269504f));
+        __m256 whole = _mm256_floor_ps(t);
+        __m256 f = _mm256_sub_ps(t, whole);
+        __m256 p = _mm256_set1_ps(1.8775767e-3f);
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(8.9893397e-3f));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.5826318e-2f));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.4015361e-1f));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(6.9315308e-1f));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.9999994e-1f));
+        __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(whole), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+    }
+
+    __attribute__((target("avx2,fma"))) static __m256 luminance_avx2(__m256 r, __m256 g, __m256 b)
+    {
+        return _mm256_fmadd_ps(_mm256_set1_ps(0.2126f), r, _mm256_fmadd_ps(_mm256_set1_ps(0.7152f), g, _mm256_mul_ps(_mm256_set1_ps(0.0722f), b)));
+    }
+
+    // filter_scalar for pixels i to i + 7 of row j, whose taps must all be inside the image
+    __attribute__((target("avx2,fma"))) void filter_avx2(int i, int j, int step)
+    {
+        const size_t p = (size_t)j * width + i;
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+        const __m256 albedo_scale = _mm256_set1_ps(1 / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA));
+
+        __m256 p_r = _mm256_loadu_ps(&r[p]), p_g = _mm256_loadu_ps(&g[p]), p_b = _mm256_loadu_ps(&b[p]);
+        __m256 p_variance = _mm256_loadu_ps(&variance[p]);
+        __m256 p_nx = _mm256_loadu_ps(&nx[p]), p_ny = _mm256_loadu_ps(&ny[p]), p_nz = _mm256_loadu_ps(&nz[p]);
+        __m256 p_ar = _mm256_loadu_ps(&ar[p]), p_ag = _mm256_loadu_ps(&ag[p]), p_ab = _mm256_loadu_ps(&ab[p]);
+        __m256 p_depth = _mm256_loadu_ps(&depth[p]);
+        __m256 p_depth_sigma = _mm256_loadu_ps(&depth_sigma[p]);
+        __m256 p_sigma = _mm256_loadu_ps(&sigma[p]);
+        __m256 l_p = luminance_avx2(p_r, p_g, p_b);
+
+        __m256 sum_w = zero, sum_r = zero, sum_g = zero, sum_b = zero, sum_variance = zero;
+        for (int dy = -2; dy <= 2; dy++)
+        {
+            int y = j + dy * step;
+            if (y < 0 || y >= height)
+                continue;
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                size_t q = (size_t)y * width + i + dx * step;
+                __m256 q_r = _mm256_loadu_ps(&r[q]), q_g = _mm256_loadu_ps(&g[q]), q_b = _mm256_loadu_ps(&b[q]);
+
+                __m256 cosine = _mm256_fmadd_ps(p_nx, _mm256_loadu_ps(&nx[q]), _mm256_fmadd_ps(p_ny, _mm256_loadu_ps(&ny[q]), _mm256_mul_ps(p_nz, _mm256_loadu_ps(&nz[q]))));
+                cosine = _mm256_max_ps(cosine, zero);
+                for (int k = 0; k < DENOISE_NORMAL_SQUARINGS; k++)
+                    cosine = _mm256_mul_ps(cosine, cosine);
+
+                __m256 da = _mm256_sub_ps(p_ar, _mm256_loadu_ps(&ar[q]));
+                __m256 dg = _mm256_sub_ps(p_ag, _mm256_loadu_ps(&ag[q]));
+                __m256 db = _mm256_sub_ps(p_ab, _mm256_loadu_ps(&ab[q]));
+                __m256 albedo_distance = _mm256_fmadd_ps(da, da, _mm256_fmadd_ps(dg, dg, _mm256_mul_ps(db, db)));
+                __m256 depth_distance = _mm256_and_ps(_mm256_sub_ps(p_depth, _mm256_loadu_ps(&depth[q])), abs_mask);
+                __m256 luminance_distance = _mm256_and_ps(_mm256_sub_ps(l_p, luminance_avx2(q_r, q_g, q_b)), abs_mask);
+
+                float inverse_distance = 1.0f / (step * (std::abs(dx) + std::abs(dy)) + 1e-6f);
+                __m256 exponent = _mm256_mul_ps(_mm256_mul_ps(depth_distance, p_depth_sigma), _mm256_set1_ps(inverse_distance));
+                exponent = _mm256_fmadd_ps(albedo_distance, albedo_scale, exponent);
+                exponent = _mm256_fmadd_ps(luminance_distance, p_sigma, exponent);
+                __m256 w = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(spline_weight(dx) * spline_weight(dy)), cosine), exp_negative_avx2(exponent));
+
+                sum_w = _mm256_add_ps(sum_w, w);
+                sum_r = _mm256_fmadd_ps(w, q_r, sum_r);
+                sum_g = _mm256_fmadd_ps(w, q_g, sum_g);
+                sum_b = _mm256_fmadd_ps(w, q_b, sum_b);
+                sum_variance = _mm256_fmadd_ps(_mm256_mul_ps(w, w), _mm256_loadu_ps(&variance[q]), sum_variance);
+            }
+        }
+
+        // Pixels of the background, or with no weight at all, keep their own values
+        __m256 keep = _mm256_or_ps(_mm256_cmp_ps(p_depth, zero, _CMP_LE_OQ), _mm256_cmp_ps(sum_w, zero, _CMP_LE_OQ));
+        __m256 inverse_w = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_blendv_ps(sum_w, _mm256_set1_ps(1.0f), keep));
+        _mm256_storeu_ps(&out_r[p], _mm256_blendv_ps(_mm256_mul_ps(sum_r, inverse_w), p_r, keep));
+        _mm256_storeu_ps(&out_g[p], _mm256_blendv_ps(_mm256_mul_ps(sum_g, inverse_w), p_g, keep));
+        _mm256_storeu_ps(&out_b[p], _mm256_blendv_ps(_mm256_mul_ps(sum_b, inverse_w), p_b, keep));
+        _mm256_storeu_ps(&out_variance[p], _mm256_blendv_ps(_mm256_mul_ps(_mm256_mul_ps(sum_variance, inverse_w), inverse_w), p_variance, keep));
+    }
+#endif
+
+    int width;
+    int height;
+    // Color with the albedo divided out and its luminance variance, read by a pass
+    plane r, g, b, variance;
+    // Written by a pass, then swapped with the above for the next
+    plane out_r, out_g, out_b, out_variance;
+    // 1 / (DENOISE_LUMINANCE_SIGMA * standard deviation) of each pixel for the current pass
+    plane sigma;
+    // First-hit buffers, and 1 / (DENOISE_DEPTH_SIGMA * depth) of each pixel
+    plane nx, ny, nz, depth, depth_sigma, ar, ag, ab;
+};
+
+// Denoise image with the first-hit buffers of the same view
+void denoise(framebuffer &image, const aov_buffers &aovs, int num_threads, denoise_kernel kernel = denoiser::best_kernel())
+{
+    denoiser filter(image, aovs);
+    filter.run(num_threads, kernel);
+    filter.resolve(image);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef framebuffer_hpp
+#define framebuffer_hpp
+
+#include "color.hpp"
+#include <vector>
+
+// Holds the color of every pixel of the image while it is being rendered, so the image can be written out once at the end (see image_io.hpp).
+// Pixels are stored in scanline order from the top left, as the averaged linear color of their samples.
+// Each pixel is only ever written by the thread rendering its tile, so no locking is needed.
+class framebuffer
+{
+public:
+    framebuffer(int width, int height) : img_width(width), img_height(height), pixels((size_t)width * height) {}
+
+    // Only the width x height pixels from column x0 and row y0 of a larger image, such as a tile of a distributed render.
+    // at() still takes the position of the pixel in the whole image.
+    framebuffer(int width, int height, int x0, int y0) : img_width(width), img_height(height), origin_x(x0), origin_y(y0), pixels((size_t)width * height) {}
+
+    int width() const { return img_width; }
+    int height() const { return img_height; }
+
+    // i is the column (left to right), j is the row (top to bottom)
+    color &at(int i, int j) { return pixels[(size_t)(j - origin_y) * img_width + (i - origin_x)]; }
+    const color &at(int i, int j) const { return pixels[(size_t)(j - origin_y) * img_width + (i - origin_x)]; }
+
+    // The pixels in scanline order
+    color *data() { return pixels.data(); }
+    const color *data() const { return pixels.data(); }
+
+private:
+    int img_width;
+    int img_height;
+    int origin_x = 0;
+    int origin_y = 0;
+    std::vector<color> pixels;
+};
+
+#endif
\ No newline at end of file
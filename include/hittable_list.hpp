@@ -4,6 +4,7 @@
 #define hittable_list_hpp
 
 #include "material.hpp"
+#include "render_stats.hpp"
 #include <vector>
 
 // Class to represent the world by holding a list of all the objects that are added to the world.
@@ -11,10 +12,13 @@ class hittable_list
 {
 public:
     // Constructor
-    hittable_list(){};
+    // A list that does not own its objects (such as ones made in a scene_arena) leaves them alone when it is destroyed
+    hittable_list(bool owns_objects = true) : owns_objects(owns_objects){};
 
     // Destructor
     ~hittable_list(){
+        if (!owns_objects)
+            return;
         // Delete all hittables created with new
         for(auto &hittable : hittables){
             delete hittable;
@@ -30,9 +34,16 @@ public:
         hittables.clear();
     }
 
+    // The objects in the world
+    const std::vector<hittable*> &objects() const
+    {
+        return hittables;
+    }
+
     // function that takes in a ray to see if the ray hits what hittables in the list
-    bool hit_all(const ray &ray_in, double t_min, double t_max, hit_record &rec) const
+    bool hit_all(const ray &ray_in, real t_min, real t_max, hit_record &rec) const
     {
+        STATS_COUNT(sphere_tests, hittables.size());
         hit_record curr_record;
         bool hit_something = false;
         auto t = t_max;
@@ -55,9 +66,26 @@ public:
         return hit_something;
     }
 
+    // Whether any hittable blocks the ray between t_min and t_max, for shadow rays.
+    // Stops at the first hittable in the way rather than looking for the closest, and fills in no hit_record.
+    bool occluded(const ray &ray_in, real t_min, real t_max) const
+    {
+        for (size_t i = 0; i < hittables.size(); i++)
+        {
+            if (hittables[i]->occluded(ray_in, t_min, t_max))
+            {
+                STATS_COUNT(sphere_tests, i + 1);
+                return true;
+            }
+        }
+        STATS_COUNT(sphere_tests, hittables.size());
+        return false;
+    }
+
 private:
     // List of hittable objects
     std::vector<hittable*> hittables;
+    bool owns_objects;
 };
 
 #endif
\ No newline at end of file
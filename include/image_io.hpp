@@ -0,0 +1,482 @@
+// PPM, PFM and PNG file formats are from https://netpbm.sourceforge.net/doc/ppm.html,
+// https://www.pauldebevec.com/Research/HDR/PFM/ and https://www.w3.org/TR/png/
+
+#ifndef image_io_hpp
+#define image_io_hpp
+
+#include "framebuffer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifdef RAYTRACE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// File formats the finished image can be written in
+enum class image_format
+{
+    ppm_ascii, // P3, one line of text per pixel
+    ppm,       // P6, 3 bytes per pixel
+    pfm,       // Portable float map, 3 floats per pixel with the linear, unclamped color (lights stay brighter than 1)
+    png,
+};
+
+// Parse a format name such as "ppm" or "PNG", returns false if the name is unknown
+bool parse_image_format(std::string name, image_format &format)
+{
+    for (auto &c : name)
+    {
+        c = (char)std::tolower((unsigned char)c);
+    }
+    if (name == "ppm" || name == "p6")
+        format = image_format::ppm;
+    else if (name == "ppm_ascii" || name == "ppm-ascii" || name == "p3")
+        format = image_format::ppm_ascii;
+    else if (name == "pfm")
+        format = image_format::pfm;
+    else if (name == "png")
+        format = image_format::png;
+    else
+        return false;
+    return true;
+}
+
+// Convert one linear color channel to an 8 bit value, the same way write_color does after gamma correction.
+// Gamma-correct for gamma=2.0, and if light emissive materials result in light being > 1.0, print it as 255.
+// NaN fails every comparison, so it is clamped by the negated ones, as converting it to a byte is undefined.
+unsigned char to_byte(double linear)
+{
+    double value = std::sqrt(linear);
+    if (!(value < 1))
+    {
+        value = 0.999;
+    }
+    if (!(value > 0))
+    {
+        value = 0;
+    }
+    return (unsigned char)(256 * value);
+}
+
+// Encoders turning the whole framebuffer into the bytes of a file in one pass.
+// Each returns a single buffer so the file can then be written with one large write.
+// The rows are encoded by functions of their own, which image_stream also uses to write an image a few rows at a time.
+namespace image_encoder
+{
+    void append(std::vector<unsigned char> &out, const std::string &text)
+    {
+        out.insert(out.end(), text.begin(), text.end());
+    }
+
+    std::string ppm_ascii_header(int width, int height)
+    {
+        return "P3\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    }
+
+    // Rows j0 to j1 - 1 of image, as text
+    void append_ppm_ascii_rows(std::vector<unsigned char> &out, const framebuffer &image, int j0, int j1)
+    {
+        // At most "255 255 255\n" per pixel
+        out.reserve(out.size() + (size_t)image.width() * (j1 - j0) * 12);
+
+        char digits[4];
+        for (int j = j0; j < j1; j++)
+        {
+            for (int i = 0; i < image.width(); i++)
+            {
+                const color &pixel = image.at(i, j);
+                for (int c = 0; c < 3; c++)
+                {
+                    // Write the number without going through a stream
+                    int value = to_byte(pixel[c]);
+                    int n = 0;
+                    do
+                    {
+                        digits[n++] = (char)('0' + value % 10);
+                        value /= 10;
+                    } while (value > 0);
+                    while (n > 0)
+                    {
+                        out.push_back(digits[--n]);
+                    }
+                    out.push_back(c < 2 ? ' ' : '\n');
+                }
+            }
+        }
+    }
+
+    std::vector<unsigned char> ppm_ascii(const framebuffer &image)
+    {
+        std::vector<unsigned char> out;
+        append(out, ppm_ascii_header(image.width(), image.height()));
+        append_ppm_ascii_rows(out, image, 0, image.height());
+        return out;
+    }
+
+    std::string ppm_header(int width, int height)
+    {
+        return "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    }
+
+    // Rows j0 to j1 - 1 of image, 3 bytes per pixel
+    void append_ppm_rows(std::vector<unsigned char> &out, const framebuffer &image, int j0, int j1)
+    {
+        size_t start = out.size();
+        out.resize(start + (size_t)image.width() * (j1 - j0) * 3);
+
+        unsigned char *p = &out[start];
+        for (int j = j0; j < j1; j++)
+        {
+            for (int i = 0; i < image.width(); i++)
+            {
+                const color &pixel = image.at(i, j);
+                *p++ = to_byte(pixel.r());
+                *p++ = to_byte(pixel.g());
+                *p++ = to_byte(pixel.b());
+            }
+        }
+    }
+
+    std::vector<unsigned char> ppm(const framebuffer &image)
+    {
+        std::vector<unsigned char> out;
+        append(out, ppm_header(image.width(), image.height()));
+        append_ppm_rows(out, image, 0, image.height());
+        return out;
+    }
+
+    // The scale of -1 in the header means little endian floats
+    std::string pfm_header(int width, int height)
+    {
+        return "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n-1.0\n";
+    }
+
+    // Rows j1 - 1 down to j0 of image, as PFM rows go from the bottom of the image to the top
+    void append_pfm_rows(std::vector<unsigned char> &out, const framebuffer &image, int j0, int j1)
+    {
+        size_t start = out.size();
+        out.resize(start + (size_t)image.width() * (j1 - j0) * 3 * sizeof(float));
+
+        unsigned char *p = &out[start];
+        for (int j = j1 - 1; j >= j0; j--)
+        {
+            for (int i = 0; i < image.width(); i++)
+            {
+                const color &pixel = image.at(i, j);
+                for (int c = 0; c < 3; c++)
+                {
+                    float value = (float)pixel[c];
+                    uint32_t bits;
+                    std::memcpy(&bits, &value, sizeof(bits));
+                    *p++ = (unsigned char)(bits);
+                    *p++ = (unsigned char)(bits >> 8);
+                    *p++ = (unsigned char)(bits >> 16);
+                    *p++ = (unsigned char)(bits >> 24);
+                }
+            }
+        }
+    }
+
+    std::vector<unsigned char> pfm(const framebuffer &image)
+    {
+        std::vector<unsigned char> out;
+        append(out, pfm_header(image.width(), image.height()));
+        append_pfm_rows(out, image, 0, image.height());
+        return out;
+    }
+
+    void append_u32(std::vector<unsigned char> &out, uint32_t value)
+    {
+        // PNG numbers are big endian
+        out.push_back((unsigned char)(value >> 24));
+        out.push_back((unsigned char)(value >> 16));
+        out.push_back((unsigned char)(value >> 8));
+        out.push_back((unsigned char)(value));
+    }
+
+    std::vector<uint32_t> png_crc_table()
+    {
+        std::vector<uint32_t> table(256);
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        return table;
+    }
+
+    uint32_t png_crc(const unsigned char *data, size_t length)
+    {
+        static const std::vector<uint32_t> table = png_crc_table();
+        uint32_t crc = 0xffffffffu;
+        for (size_t k = 0; k < length; k++)
+        {
+            crc = table[(crc ^ data[k]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    // A PNG chunk is its length, type, data and the CRC of the type and data
+    void append_chunk(std::vector<unsigned char> &out, const char *type, const std::vector<unsigned char> &data)
+    {
+        append_u32(out, (uint32_t)data.size());
+        size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        append_u32(out, png_crc(&out[start], out.size() - start));
+    }
+
+    // A zlib stream made from data given a part at a time. Without zlib, the data is stored in uncompressed deflate blocks.
+    class zlib_writer
+    {
+    public:
+        zlib_writer()
+        {
+#ifdef RAYTRACE_HAVE_ZLIB
+            std::memset(&stream, 0, sizeof(stream));
+            deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+#endif
+        }
+
+        ~zlib_writer()
+        {
+#ifdef RAYTRACE_HAVE_ZLIB
+            deflateEnd(&stream);
+#endif
+        }
+
+        zlib_writer(const zlib_writer &) = delete;
+        zlib_writer &operator=(const zlib_writer &) = delete;
+
+        // The stream bytes for the next part of the data, last ends the stream
+        std::vector<unsigned char> add(const std::vector<unsigned char> &data, bool last)
+        {
+            std::vector<unsigned char> out;
+#ifdef RAYTRACE_HAVE_ZLIB
+            stream.next_in = const_cast<unsigned char *>(data.data());
+            stream.avail_in = (uInt)data.size();
+            int flush = last ? Z_FINISH : Z_NO_FLUSH;
+            int result;
+            do
+            {
+                // Room for all of it is usually enough, output held back from earlier parts takes another round
+                size_t done = out.size();
+                out.resize(done + deflateBound(&stream, stream.avail_in) + 64);
+                stream.next_out = &out[done];
+                stream.avail_out = (uInt)(out.size() - done);
+                result = deflate(&stream, flush);
+                out.resize(out.size() - stream.avail_out);
+            } while (stream.avail_in > 0 || (last && result != Z_STREAM_END));
+#else
+            if (!started)
+            {
+                out = {0x78, 0x01};
+                started = true;
+            }
+            size_t pos = 0;
+            do
+            {
+                if (data.size() == pos && !last)
+                    break;
+                size_t block = std::min<size_t>(65535, data.size() - pos);
+                bool final_block = last && pos + block == data.size();
+                out.push_back(final_block ? 1 : 0);
+                out.push_back((unsigned char)(block));
+                out.push_back((unsigned char)(block >> 8));
+                out.push_back((unsigned char)(~block));
+                out.push_back((unsigned char)(~block >> 8));
+                out.insert(out.end(), data.begin() + pos, data.begin() + pos + block);
+                pos += block;
+            } while (pos < data.size());
+
+            // Adler-32 checksum of the uncompressed data
+            for (auto byte : data)
+            {
+                adler_a = (adler_a + byte) % 65521;
+                adler_b = (adler_b + adler_a) % 65521;
+            }
+            if (last)
+                append_u32(out, (adler_b << 16) | adler_a);
+#endif
+            return out;
+        }
+
+    private:
+#ifdef RAYTRACE_HAVE_ZLIB
+        z_stream stream;
+#else
+        bool started = false;
+        uint32_t adler_a = 1, adler_b = 0;
+#endif
+    };
+
+    // Wrap data in a zlib stream
+    std::vector<unsigned char> zlib_stream(const std::vector<unsigned char> &data)
+    {
+        zlib_writer writer;
+        return writer.add(data, true);
+    }
+
+    // 8 bit RGB, no interlacing
+    std::vector<unsigned char> png_header(int width, int height)
+    {
+        const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        std::vector<unsigned char> out(signature, signature + 8);
+
+        std::vector<unsigned char> header;
+        append_u32(header, width);
+        append_u32(header, height);
+        header.insert(header.end(), {8, 2, 0, 0, 0});
+        append_chunk(out, "IHDR", header);
+        return out;
+    }
+
+    // Rows j0 to j1 - 1 of image as the PNG's uncompressed data.
+    // Each row starts with its filter type, 0 means the bytes are stored as they are.
+    void append_png_rows(std::vector<unsigned char> &rows, const framebuffer &image, int j0, int j1)
+    {
+        size_t start = rows.size();
+        rows.resize(start + (size_t)(j1 - j0) * (1 + image.width() * 3));
+        unsigned char *p = &rows[start];
+        for (int j = j0; j < j1; j++)
+        {
+            *p++ = 0;
+            for (int i = 0; i < image.width(); i++)
+            {
+                const color &pixel = image.at(i, j);
+                *p++ = to_byte(pixel.r());
+                *p++ = to_byte(pixel.g());
+                *p++ = to_byte(pixel.b());
+            }
+        }
+    }
+
+    std::vector<unsigned char> png(const framebuffer &image)
+    {
+        std::vector<unsigned char> out = png_header(image.width(), image.height());
+        std::vector<unsigned char> rows;
+        append_png_rows(rows, image, 0, image.height());
+        append_chunk(out, "IDAT", zlib_stream(rows));
+        append_chunk(out, "IEND", std::vector<unsigned char>());
+        return out;
+    }
+}
+
+std::vector<unsigned char> encode_image(const framebuffer &image, image_format format)
+{
+    switch (format)
+    {
+    case image_format::ppm_ascii:
+        return image_encoder::ppm_ascii(image);
+    case image_format::pfm:
+        return image_encoder::pfm(image);
+    case image_format::png:
+        return image_encoder::png(image);
+    default:
+        return image_encoder::ppm(image);
+    }
+}
+
+// Encode the image and write the whole file with a single write
+void write_image(std::ostream &os, const framebuffer &image, image_format format)
+{
+    std::vector<unsigned char> bytes = encode_image(image, format);
+    os.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    os.flush();
+}
+
+// Writes an image a few rows at a time as they are finished, for images too big to hold in memory (see out_of_core.hpp).
+// The rows must be given in the order the file stores them: from the top, except for PFM which goes from the bottom (bottom_up()).
+class image_stream
+{
+public:
+    image_stream(std::ostream &os, int width, int height, image_format format) : os(os), format(format)
+    {
+        switch (format)
+        {
+        case image_format::ppm_ascii:
+            write(image_encoder::ppm_ascii_header(width, height));
+            break;
+        case image_format::pfm:
+            write(image_encoder::pfm_header(width, height));
+            break;
+        case image_format::png:
+            write(image_encoder::png_header(width, height));
+            break;
+        default:
+            write(image_encoder::ppm_header(width, height));
+            break;
+        }
+    }
+
+    bool bottom_up() const { return format == image_format::pfm; }
+
+    // Encode and write rows j0 to j1 - 1 of image (which must hold at least those rows), from j1 - 1 down to j0 if bottom_up()
+    void write_rows(const framebuffer &image, int j0, int j1)
+    {
+        std::vector<unsigned char> bytes;
+        switch (format)
+        {
+        case image_format::ppm_ascii:
+            image_encoder::append_ppm_ascii_rows(bytes, image, j0, j1);
+            break;
+        case image_format::pfm:
+            image_encoder::append_pfm_rows(bytes, image, j0, j1);
+            break;
+        case image_format::png:
+        {
+            // Each write is one IDAT chunk of the zlib stream so far
+            std::vector<unsigned char> rows;
+            image_encoder::append_png_rows(rows, image, j0, j1);
+            std::vector<unsigned char> compressed = zlib.add(rows, false);
+            if (!compressed.empty())
+                image_encoder::append_chunk(bytes, "IDAT", compressed);
+            break;
+        }
+        default:
+            image_encoder::append_ppm_rows(bytes, image, j0, j1);
+            break;
+        }
+        write(bytes);
+    }
+
+    // Write the end of the file, after the last row
+    void finish()
+    {
+        if (format == image_format::png)
+        {
+            std::vector<unsigned char> bytes;
+            image_encoder::append_chunk(bytes, "IDAT", zlib.add(std::vector<unsigned char>(), true));
+            image_encoder::append_chunk(bytes, "IEND", std::vector<unsigned char>());
+            write(bytes);
+        }
+        os.flush();
+    }
+
+private:
+    void write(const std::string &text)
+    {
+        os.write(text.data(), text.size());
+    }
+
+    void write(const std::vector<unsigned char> &bytes)
+    {
+        os.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    }
+
+    std::ostream &os;
+    image_format format;
+    image_encoder::zlib_writer zlib;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,403 @@
+#ifndef incremental_hpp
+#define incremental_hpp
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "real.hpp"
+#include "renderer.hpp"
+#include "rng.hpp"
+#include "scene.hpp"
+#include "tile_scheduler.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Version of the incremental render file layout, files of another version are not used
+#define INCREMENTAL_VERSION 1
+// Bits in each pixel's record of the SPHERE lines its paths touched
+#define TOUCH_BITS 64
+// first_hit of a pixel whose first camera ray hit nothing
+#define FIRST_HIT_NONE -1
+
+// Bit of a pixel's touch record standing for the SPHERE line with index line.
+// With more than TOUCH_BITS lines several lines share a bit, so an edit can re-trace pixels it did not touch, but never keeps one it did.
+uint64_t touch_bit(uint32_t line)
+{
+    return 1ULL << (line % TOUCH_BITS);
+}
+
+// What a render leaves behind for the next render of the same scene after an edit: the SPHERE lines it rendered,
+// and for every pixel its color, the SPHERE line its first camera ray hit and which SPHERE lines any of its paths touched.
+// A path touches the spheres it hits and the lights its shadow rays reach, which are the only materials its color depends on.
+struct incremental_cache
+{
+    incremental_cache() {}
+
+    // An empty cache for the scene s (parsed with record_sphere_lines), every pixel black and touching nothing
+    explicit incremental_cache(const scene &s)
+        : layout_hash(s.layout_hash), width(s.settings.image_width), height(s.settings.image_height), seed(s.settings.seed),
+          samples(s.settings.samples_p_pixel), spheres(s.sphere_lines), pixels((size_t)width * height, color(0, 0, 0)),
+          touched(pixels.size(), 0), first_hit(pixels.size(), FIRST_HIT_NONE)
+    {
+    }
+
+    // Hash of everything but the SPHERE lines' numbers and materials (see scene::layout_hash)
+    uint64_t layout_hash = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    uint64_t seed = 0;
+    int32_t samples = 0;
+
+    // SPHERE lines in the order of the input file, the materials are not kept in the file (mat is null when loaded)
+    std::vector<sphere_line> spheres;
+
+    std::vector<color> pixels;
+    std::vector<uint64_t> touched;
+    std::vector<int32_t> first_hit;
+
+    // Write the cache to path, under a temporary name first like a checkpoint (see accumulation_buffer::save)
+    void save(const std::string &path) const
+    {
+        std::string temp_path = path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            out.write("RTIN", 4);
+            write_value(out, (uint32_t)INCREMENTAL_VERSION);
+            write_value(out, (uint32_t)sizeof(real));
+            write_value(out, layout_hash);
+            write_value(out, width);
+            write_value(out, height);
+            write_value(out, seed);
+            write_value(out, samples);
+            write_value(out, (uint64_t)spheres.size());
+            for (const sphere_line &line : spheres)
+            {
+                write_value(out, (double)line.center.x());
+                write_value(out, (double)line.center.y());
+                write_value(out, (double)line.center.z());
+                write_value(out, line.radius);
+                write_value(out, line.desc);
+            }
+            for (size_t k = 0; k < pixels.size(); k++)
+            {
+                write_value(out, (double)pixels[k].r());
+                write_value(out, (double)pixels[k].g());
+                write_value(out, (double)pixels[k].b());
+                write_value(out, touched[k]);
+                write_value(out, first_hit[k]);
+            }
+            out.flush();
+            if (!out)
+            {
+                throw std::runtime_error("Could not write incremental render file " + temp_path);
+            }
+        }
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            throw std::runtime_error("Could not replace incremental render file " + path);
+        }
+    }
+
+    // Load the cache from path, returns false if there is no such file.
+    // Throws std::runtime_error if it is not an incremental render file of this version and precision.
+    bool load(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+
+        char magic[4];
+        uint32_t version, real_size;
+        in.read(magic, 4);
+        read_value(in, version);
+        read_value(in, real_size);
+        if (!in || std::string(magic, 4) != "RTIN" || version != INCREMENTAL_VERSION)
+        {
+            throw std::runtime_error("Invalid incremental render file " + path);
+        }
+        if (real_size != sizeof(real))
+        {
+            throw std::runtime_error("Incremental render file " + path + " was made by a build of another precision");
+        }
+        uint64_t sphere_count;
+        read_value(in, layout_hash);
+        read_value(in, width);
+        read_value(in, height);
+        read_value(in, seed);
+        read_value(in, samples);
+        read_value(in, sphere_count);
+        if (!in || width < 0 || height < 0)
+        {
+            throw std::runtime_error("Invalid incremental render file " + path);
+        }
+
+        spheres.clear();
+        for (uint64_t k = 0; k < sphere_count && in; k++)
+        {
+            double x, y, z;
+            sphere_line line;
+            read_value(in, x);
+            read_value(in, y);
+            read_value(in, z);
+            read_value(in, line.radius);
+            read_value(in, line.desc);
+            line.center = point3(x, y, z);
+            line.mat = nullptr;
+            spheres.push_back(line);
+        }
+
+        size_t count = (size_t)width * height;
+        pixels.assign(count, color(0, 0, 0));
+        touched.assign(count, 0);
+        first_hit.assign(count, FIRST_HIT_NONE);
+        for (size_t k = 0; k < count && in; k++)
+        {
+            double r, g, b;
+            read_value(in, r);
+            read_value(in, g);
+            read_value(in, b);
+            read_value(in, touched[k]);
+            read_value(in, first_hit[k]);
+            pixels[k] = color(r, g, b);
+        }
+        if (!in)
+        {
+            throw std::runtime_error("Incremental render file " + path + " is truncated");
+        }
+        return true;
+    }
+
+private:
+    // Values are stored in the byte order of the machine, like checkpoints
+    template <typename T>
+    static void write_value(std::ostream &out, const T &value)
+    {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static void read_value(std::istream &in, T &value)
+    {
+        in.read(reinterpret_cast<char *>(&value), sizeof(value));
+    }
+};
+
+// Records the SPHERE lines one pixel's paths touch, passed to path_integrator::trace as its on_hit
+struct touch_recorder
+{
+    explicit touch_recorder(const std::unordered_map<const material *, uint32_t> &lines) : lines(lines) {}
+
+    void operator()(const material *mat)
+    {
+        auto found = lines.find(mat);
+        if (found == lines.end())
+            return;
+        touched |= touch_bit(found->second);
+        if (first_ray)
+        {
+            first_hit = (int32_t)found->second;
+            first_ray = false;
+        }
+    }
+
+    // The SPHERE line of each sphere's material
+    const std::unordered_map<const material *, uint32_t> &lines;
+    uint64_t touched = 0;
+    int32_t first_hit = FIRST_HIT_NONE;
+    // Set while the pixel's first camera ray has not hit anything yet
+    bool first_ray = false;
+};
+
+// Traces the pixels of an incremental render marked in redo exactly as render does, storing them and what they touched in cache.
+// Pass it to scene_world::with_world.
+struct incremental_pass
+{
+    const camera &cam;
+    const render_settings &settings;
+    const std::unordered_map<const material *, uint32_t> &lines;
+    const std::vector<char> &redo;
+    incremental_cache &cache;
+
+    template <typename World>
+    void operator()(const World &world)
+    {
+        tile_scheduler scheduler(settings.image_width, settings.image_height);
+        int tiles_done = 0;
+        std::mutex progress_lock;
+        scheduler.run(settings.num_threads, [&](const tile &t) {
+            for (int j = t.y0; j < t.y1; j++)
+            {
+                for (int i = t.x0; i < t.x1; ++i)
+                {
+                    size_t k = (size_t)j * settings.image_width + i;
+                    if (!redo[k])
+                        continue;
+
+                    touch_recorder record(lines);
+                    color_sum pixel_color;
+                    sampler gen = settings.pixel_sampler(i, j, rng(settings.seed, k));
+                    for (int sample = 0; sample < settings.samples_p_pixel; sample++)
+                    {
+                        gen.start_sample(sample);
+                        ray r = cam.get_sample_ray(i, j, settings.image_width, settings.image_height, gen);
+                        record.first_ray = sample == 0;
+                        pixel_color += settings.integrator.trace(r, world, gen, record);
+                    }
+                    cache.pixels[k] = pixel_color.average(settings.samples_p_pixel);
+                    cache.touched[k] = record.touched;
+                    cache.first_hit[k] = record.first_hit;
+                }
+            }
+
+            if (settings.show_progress)
+            {
+                std::lock_guard<std::mutex> guard(progress_lock);
+                std::cerr << "\rRaytracing tile " << ++tiles_done << " out of " << scheduler.num_tiles() << std::flush;
+            }
+        });
+    }
+};
+
+// Why every pixel of s has to be re-traced after the render cached in previous, empty if only the pixels touching
+// the SPHERE lines marked in changed do (the lines whose material changed, and nothing else).
+// A sphere that moves, grows, appears or goes can block or reflect rays anywhere in the image, which the touch records can not tell,
+// and a sphere becoming or stopping being a LIGHT changes which lights every diffuse surface samples.
+std::string full_render_reason(const incremental_cache &previous, const incremental_cache &next, std::vector<char> &changed)
+{
+    if (previous.spheres.size() != next.spheres.size())
+        return "SPHERE lines were added or removed";
+    if (previous.layout_hash != next.layout_hash || previous.width != next.width || previous.height != next.height ||
+        previous.seed != next.seed || previous.samples != next.samples)
+        return "lines other than SPHERE lines changed";
+
+    changed.assign(next.spheres.size(), 0);
+    for (size_t k = 0; k < next.spheres.size(); k++)
+    {
+        const sphere_line &before = previous.spheres[k], &after = next.spheres[k];
+        std::string line = "SPHERE line " + std::to_string(k + 1);
+        if (before.center.x() != after.center.x() || before.center.y() != after.center.y() || before.center.z() != after.center.z() ||
+            before.radius != after.radius)
+            return line + " moved or changed size";
+        if (std::memcmp(&before.desc, &after.desc, sizeof(material_desc)) == 0)
+            continue;
+        if ((before.desc.type == light_type) != (after.desc.type == light_type))
+            return line + " became or stopped being a LIGHT";
+        changed[k] = 1;
+    }
+    return "";
+}
+
+// Render the scene s (parsed with record_sphere_lines) into image, reusing the render saved in the file at path where it can,
+// then save this render there for the next one.
+// When only materials of SPHERE lines changed since that render, only the pixels whose paths touched those spheres are re-traced,
+// and the image is exactly the same as a full render. Any other edit re-traces every pixel.
+// Throws std::runtime_error for scenes that can not be rendered this way or a file that can not be read or written.
+void render_incremental(const scene &s, const std::string &path, framebuffer &image)
+{
+    render_settings settings = s.settings;
+    if (settings.adaptive.enabled || settings.progressive.enabled)
+    {
+        throw std::runtime_error("ADAPTIVE and PROGRESSIVE scenes can not be rendered incrementally");
+    }
+    if (!s.record_sphere_lines || s.spheres.count > 0)
+    {
+        throw std::runtime_error("Only input files with SPHERE lines can be rendered incrementally");
+    }
+
+    STATS_PHASE_BEGIN(build);
+    scene_world world(s, settings.num_threads, settings.show_progress);
+    STATS_PHASE_END(build);
+    settings.integrator.lights = world.light_spheres();
+
+    std::unordered_map<const material *, uint32_t> lines;
+    for (size_t k = 0; k < s.sphere_lines.size(); k++)
+    {
+        lines[s.sphere_lines[k].mat] = (uint32_t)k;
+    }
+
+    incremental_cache next(s);
+    incremental_cache previous;
+    std::vector<char> changed;
+    std::string reason = previous.load(path) ? full_render_reason(previous, next, changed) : "there is no earlier render in " + path;
+
+    std::vector<char> redo(next.pixels.size(), 1);
+    size_t redo_count = redo.size(), direct = 0;
+    if (reason.empty())
+    {
+        uint64_t changed_bits = 0;
+        size_t changed_count = 0;
+        for (size_t k = 0; k < changed.size(); k++)
+        {
+            if (changed[k])
+            {
+                changed_bits |= touch_bit((uint32_t)k);
+                changed_count++;
+            }
+        }
+
+        redo_count = 0;
+        for (size_t k = 0; k < redo.size(); k++)
+        {
+            redo[k] = (previous.touched[k] & changed_bits) != 0;
+            if (redo[k])
+            {
+                redo_count++;
+                if (previous.first_hit[k] >= 0 && (size_t)previous.first_hit[k] < changed.size() && changed[previous.first_hit[k]])
+                    direct++;
+            }
+            else
+            {
+                next.pixels[k] = previous.pixels[k];
+                next.touched[k] = previous.touched[k];
+                next.first_hit[k] = previous.first_hit[k];
+            }
+        }
+        if (settings.show_progress)
+        {
+            std::cerr << "Incremental render: the material of " << changed_count << " SPHERE lines changed, re-tracing " << redo_count << " of "
+                      << redo.size() << " pixels (" << 100.0 * redo_count / redo.size() << "%), " << direct << " of them showing a changed sphere" << std::endl;
+        }
+    }
+    else if (settings.show_progress)
+    {
+        std::cerr << "Incremental render: re-tracing every pixel, " << reason << std::endl;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    STATS_PHASE_BEGIN(render);
+    incremental_pass pass{s.cam, settings, lines, redo, next};
+    world.with_world(pass);
+    STATS_PHASE_END(render);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (settings.show_progress)
+    {
+        std::cerr << "\nRe-traced " << redo_count << " pixels in " << elapsed.count() << " ms" << std::endl;
+    }
+
+    next.save(path);
+    for (int j = 0; j < settings.image_height; j++)
+    {
+        for (int i = 0; i < settings.image_width; i++)
+        {
+            image.at(i, j) = next.pixels[(size_t)j * settings.image_width + i];
+        }
+    }
+
+    if (settings.denoise || !settings.aov_prefix.empty())
+    {
+        denoise_pass denoise{s.cam, settings, image};
+        world.with_world(denoise);
+    }
+}
+
+#endif
\ No newline at end of file
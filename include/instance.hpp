@@ -0,0 +1,122 @@
+#ifndef instance_hpp
+#define instance_hpp
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class instance;
+
+// Spheres (or smaller instances) counted as the spheres they stand for, with every instance expanded into copies of its group
+uint64_t expanded_count(const hittable_list &list);
+
+// Objects of a GROUP, defined once and placed any number of times by instances.
+// The group has its own BVH, built once for every instance of it to walk when a world is made of the scene (see scene::build_groups).
+class object_group
+{
+public:
+    explicit object_group(const std::string &name) : name(name), objects(false) {}
+
+    std::string name;
+    // The objects are made in the scene's arena
+    hittable_list objects;
+
+    // Work out the box and the sphere count of the objects, after the last one is added
+    void close()
+    {
+        box = aabb();
+        for (const hittable *object : objects.objects())
+            box.expand(object->bounding_box());
+        spheres = ::expanded_count(objects);
+    }
+
+    // Build the BVH of the objects on num_threads threads, unless it is already built
+    void build(int num_threads)
+    {
+        if (!bvh)
+            bvh.reset(new bvh_world(objects, num_threads));
+    }
+
+    bool hit_all(const ray &r, real t_min, real t_max, hit_record &rec) const
+    {
+        return bvh->hit_all(r, t_min, t_max, rec);
+    }
+
+    bool occluded(const ray &r, real t_min, real t_max) const
+    {
+        return bvh->occluded(r, t_min, t_max);
+    }
+
+    // Box around all the objects, in the group's own coordinates
+    const aabb &bounding_box() const { return box; }
+
+    // Spheres one instance of the group stands for
+    uint64_t expanded_count() const { return spheres; }
+
+    // Memory of the BVH, once built, and the object list (the objects themselves are in the scene's arena)
+    size_t memory_bytes() const
+    {
+        return (bvh ? bvh->memory_bytes() : 0) + objects.objects().capacity() * sizeof(hittable *);
+    }
+
+private:
+    std::unique_ptr<bvh_world> bvh;
+    aabb box;
+    uint64_t spheres = 0;
+};
+
+// One placement of a group, moved by offset and scaled by scale (greater than 0) about the group's origin.
+// A ray is moved into the group's coordinates rather than the group's objects into the world's, so a placement takes a few words of memory
+// however many objects the group has. Scaling the ray's direction along with its origin keeps its t the same in both.
+class instance final : public hittable
+{
+public:
+    instance(const object_group *group, const vec3 &offset, real scale) : group(group), offset(offset), scale(scale), inverse_scale(1 / scale) {}
+
+    bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override
+    {
+        ray local(inverse_scale * (r.origin() - offset), inverse_scale * r.direction());
+        if (!group->hit_all(local, t_min, t_max, rec))
+            return false;
+        // The normal points the same way in both, as the scale is the same along every axis
+        rec.p = r.at(rec.t);
+        return true;
+    }
+
+    bool occluded(const ray &r, real t_min, real t_max) const override
+    {
+        ray local(inverse_scale * (r.origin() - offset), inverse_scale * r.direction());
+        return group->occluded(local, t_min, t_max);
+    }
+
+    aabb bounding_box() const override
+    {
+        const aabb &box = group->bounding_box();
+        return aabb(scale * box.min() + offset, scale * box.max() + offset);
+    }
+
+    const object_group *placed_group() const { return group; }
+
+private:
+    const object_group *group;
+    vec3 offset;
+    real scale;
+    real inverse_scale;
+};
+
+uint64_t expanded_count(const hittable_list &list)
+{
+    uint64_t count = 0;
+    for (const hittable *object : list.objects())
+    {
+        const instance *placed = dynamic_cast<const instance *>(object);
+        count += placed ? placed->placed_group()->expanded_count() : 1;
+    }
+    return count;
+}
+
+#endif
\ No newline at end of file
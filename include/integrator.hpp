@@ -0,0 +1,330 @@
+// Raytracing concepts and procedure are studied from https://raytracing.github.io/books/RayTracingInOneWeekend.html
+// and Russian roulette from https://pbr-book.org/3ed-2018/Monte_Carlo_Integration/Russian_Roulette_and_Splitting
+// Light sampling and multiple importance sampling are from https://pbr-book.org/3ed-2018/Light_Transport_I_Surface_Reflection/Direct_Lighting
+// and sampling a sphere by its cone of directions from https://pbr-book.org/3ed-2018/Light_Transport_I_Surface_Reflection/Sampling_Light_Sources
+
+#ifndef integrator_hpp
+#define integrator_hpp
+
+#include "color.hpp"
+#include "ray.hpp"
+#include "rng.hpp"
+#include "sampler.hpp"
+#include "sphere.hpp"
+#include "material.hpp"
+#include "hittable_list.hpp"
+#include "render_stats.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Default maximum number of times a ray may scatter
+#define MAX_DEPTH 50
+// Default number of bounces after which paths may be ended by Russian roulette
+#define ROULETTE_DEPTH 5
+// Shadow rays stop this far short of the light (as a fraction of its distance), so the light itself does not count as blocking.
+// Hit distances in single precision are only good to about 1e-6 of the distance, so they stop further short.
+#ifdef RAYTRACE_FLOAT
+#define SHADOW_RAY_MARGIN 1e-4
+#else
+#define SHADOW_RAY_MARGIN 1e-6
+#endif
+
+// A sphere with a light material, that diffuse surfaces send shadow rays towards
+struct light_sphere
+{
+    point3 center;
+    double radius;
+    const material *mat;
+
+    // Seen from p, the sphere fills a cone of directions around the direction to its center.
+    // Returns false if p is inside the sphere, otherwise one minus the cosine of the cone's half angle.
+    bool cone(const point3 &p, double &one_minus_cos_max) const
+    {
+        vec3 to_center = center - p;
+        double dist2 = dot(to_center, to_center);
+        double sin2_max = radius * radius / dist2;
+        if (sin2_max >= 1)
+            return false;
+        // 1 - sqrt(1 - x) written as x / (1 + sqrt(1 - x)), so small or far away lights keep their precision
+        one_minus_cos_max = sin2_max / (1 + std::sqrt(1 - sin2_max));
+        return one_minus_cos_max > 0;
+    }
+
+    // Chance density (per solid angle) of each direction in the cone when directions are picked uniformly from it
+    double pdf(const point3 &p) const
+    {
+        double one_minus_cos_max;
+        if (!cone(p, one_minus_cos_max))
+            return 0;
+        return 1 / (2 * M_PI * one_minus_cos_max);
+    }
+
+    // Pick a direction from p towards the sphere, uniformly within its cone, r1 and r2 (in [0, 1)) picking where.
+    // Also gives the distance to the sphere along it and the pdf of the direction.
+    bool sample(const point3 &p, double r1, double r2, vec3 &direction, double &distance, double &pdf_value) const
+    {
+        double one_minus_cos_max;
+        if (!cone(p, one_minus_cos_max))
+            return false;
+
+        // Orthonormal basis around the direction to the center
+        vec3 w = normalize(center - p);
+        vec3 a = std::fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        vec3 v = normalize(cross(w, a));
+        vec3 u = cross(w, v);
+
+        double one_minus_cos = r1 * one_minus_cos_max;
+        double cos_theta = 1 - one_minus_cos;
+        double sin_theta = std::sqrt(std::max(0.0, one_minus_cos * (2 - one_minus_cos)));
+        double phi = 2 * M_PI * r2;
+        direction = u * (std::cos(phi) * sin_theta) + v * (std::sin(phi) * sin_theta) + w * cos_theta;
+
+        // Closest root of the ray-sphere quadratic with a unit direction, directions at the edge of the cone only just touch the sphere
+        vec3 a_min_c = p - center;
+        double half_b = dot(direction, a_min_c);
+        double c = dot(a_min_c, a_min_c) - radius * radius;
+        distance = -half_b - std::sqrt(std::max(0.0, half_b * half_b - c));
+
+        pdf_value = 1 / (2 * M_PI * one_minus_cos_max);
+        return true;
+    }
+};
+
+// Power heuristic of multiple importance sampling, the weight of a sample taken with pdf a when it could also have come from pdf b
+double power_heuristic(double a, double b)
+{
+    if (a <= 0)
+        return 0;
+    return (a * a) / (a * a + b * b);
+}
+
+// For path_integrator::trace, when nothing needs to know the materials a path hits
+struct ignore_hits
+{
+    void operator()(const material *) const {}
+};
+
+// Follows the path of a ray through the world and works out the color it brings back.
+// 1. Determine which object the ray intersects.
+// 2. Stops when it either hits a light source, it scattered too many times, or it was absorbed by metal object.
+// The path is followed in a loop rather than by recursion, keeping the product of the attenuations met so far (the throughput).
+//
+// With light_sampling, every diffuse surface the path hits also sends a shadow ray towards a random light sphere.
+// Light reaching a diffuse surface then comes from two samples, the shadow ray and the scattered ray hitting a light.
+// Both are weighted by multiple importance sampling, so small lights (which scattered rays rarely hit) converge much sooner.
+struct path_integrator
+{
+    // Maximum number of times a ray may scatter, after that light is all absorbed
+    int max_depth = MAX_DEPTH;
+
+    // From this many bounces on, paths are randomly ended with a chance that grows as their throughput gets darker.
+    // Surviving paths are brightened by the same chance, so the image stays the same on average while dark paths stop early.
+    int roulette_depth = ROULETTE_DEPTH;
+
+    color background_top;
+    color background_bottom;
+
+    // Sample the lights directly at diffuse surfaces
+    bool light_sampling = true;
+
+    // Light spheres of the world, filled by find_lights
+    std::vector<light_sphere> lights;
+
+    // Collect the spheres with a light material, to be sampled at diffuse surfaces
+    void find_lights(const hittable_list &world)
+    {
+        lights.clear();
+        for (const hittable *object : world.objects())
+        {
+            const sphere *s = dynamic_cast<const sphere *>(object);
+            if (s && s->mat->type == light_type)
+            {
+                lights.push_back({s->center, std::fabs(s->radius), s->mat});
+            }
+        }
+    }
+
+    // World is any type with a hit_all function like hittable_list (such as bvh_world)
+    template <typename World>
+    color trace(ray r, const World &world, sampler &gen) const
+    {
+        ignore_hits none;
+        return trace(r, world, gen, none);
+    }
+
+    // Same as trace, also calling on_hit(material) with the material of every surface the path hits and of every light a shadow ray reaches.
+    // Those are all the materials the color depends on, which incremental renders keep track of (see incremental.hpp).
+    template <typename World, typename OnHit>
+    color trace(ray r, const World &world, sampler &gen, OnHit &on_hit) const
+    {
+        color radiance(0, 0, 0);
+        color throughput(1, 1, 1);
+        hit_record rec;
+
+        const bool sample_lights = light_sampling && !lights.empty();
+        // Pdf of the last scatter direction if it left a diffuse surface (where the lights were also sampled), otherwise 0
+        double scatter_pdf = 0;
+        point3 scatter_origin;
+
+        for (int depth = 0; depth <= max_depth; depth++)
+        {
+            // Find the closest hittable and render that hittable's color
+            // We set t_min as 0.001 because sometimes the root is calculated to be very small value that is just intersecting with the object that the ray just scattered off.
+            STATS_COUNT(rays, 1);
+            if (!world.hit_all(r, (real)0.001, std::numeric_limits<real>::infinity(), rec))
+            {
+                // If ray hits nothing, we return background color
+                STATS_PATH_END(path_end::escaped, depth);
+                return radiance + throughput * background(r);
+            }
+            STATS_MATERIAL_HIT(rec.mat->type);
+            on_hit(rec.mat);
+
+            ray scattered_ray;
+            color attenuation;
+            // If no scatter, means ray either hit a light or ray is absorbed by metal
+            gen.start_dimension(bounce_dimension(depth, BOUNCE_SCATTER));
+            if (!material_dispatch::scatter(rec.mat, r, rec, attenuation, scattered_ray, gen))
+            {
+                double weight = 1;
+                if (scatter_pdf > 0)
+                {
+                    // The shadow ray from the last surface could have found this light as well
+                    weight = power_heuristic(scatter_pdf, light_pdf(scatter_origin, rec));
+                }
+                color emitted = material_dispatch::emitted(rec.mat);
+                // Materials that do not scatter either give off light or absorb it (such as metal scattering into itself)
+                STATS_PATH_END(emitted.r() > 0 || emitted.g() > 0 || emitted.b() > 0 ? path_end::emitted : path_end::absorbed, depth);
+                return radiance + throughput * emitted * weight;
+            }
+
+            scatter_pdf = 0;
+            if (sample_lights && material_dispatch::is_diffuse(rec.mat))
+            {
+                radiance += throughput * sample_light(rec, depth, world, gen, on_hit);
+                scatter_pdf = material_dispatch::pdf(rec.mat, rec, scattered_ray.direction());
+                scatter_origin = rec.p;
+            }
+
+            // Attenuation is the color of the material, and will cause bias to color (alter the color of further objects being hit by ray)
+            throughput = throughput * attenuation;
+            r = scattered_ray;
+
+            if (!survives(throughput, depth, gen))
+            {
+                return radiance;
+            }
+        }
+
+        // If we reflect/scatter way to many times, light is all absorbed.
+        STATS_PATH_END(path_end::max_depth, max_depth + 1);
+        return radiance;
+    }
+
+    // Whether a path carries on after bouncing at depth with the given throughput.
+    // A path that can no longer carry any light is finished, and past roulette_depth dark paths are randomly ended
+    // (the throughput of the survivors is brightened to make up for them).
+    bool survives(color &throughput, int depth, sampler &gen) const
+    {
+        double brightest = std::max(throughput.r(), std::max(throughput.g(), throughput.b()));
+        if (brightest <= 0)
+        {
+            STATS_PATH_END(path_end::absorbed, depth + 1);
+            return false;
+        }
+
+        if (depth + 1 >= roulette_depth)
+        {
+            double survive = std::min(1.0, brightest);
+            gen.start_dimension(bounce_dimension(depth, BOUNCE_ROULETTE));
+            if (gen.get_1d() >= survive)
+            {
+                STATS_PATH_END(path_end::roulette, depth + 1);
+                return false;
+            }
+            throughput /= survive;
+        }
+        return true;
+    }
+
+    // Light reaching the diffuse surface at rec (hit at depth) straight from one randomly picked light, divided by the chance of picking it
+    // on_hit is called with the light's material if the light is not blocked (see trace)
+    template <typename World, typename OnHit>
+    color sample_light(const hit_record &rec, int depth, const World &world, sampler &gen, OnHit &on_hit) const
+    {
+        ray shadow_ray;
+        double distance;
+        color contribution;
+        const material *light_mat;
+        if (!prepare_light_sample(rec, depth, gen, shadow_ray, distance, contribution, &light_mat))
+            return color(0, 0, 0);
+
+        // The light is blocked if anything is hit before reaching it, whatever the blocker's material, so any hit will do
+        STATS_COUNT(shadow_rays, 1);
+        if (world.occluded(shadow_ray, (real)0.001, distance))
+            return color(0, 0, 0);
+        on_hit(light_mat);
+        return contribution;
+    }
+
+    // First half of sample_light: pick a light and a direction towards it, giving the shadow ray to test up to distance
+    // and the light it brings if nothing blocks it (and the light's material, if light_mat is not null).
+    // Returns false if no light can reach rec this way.
+    bool prepare_light_sample(const hit_record &rec, int depth, sampler &gen, ray &shadow_ray, double &distance, color &contribution,
+                              const material **light_mat = nullptr) const
+    {
+        gen.start_dimension(bounce_dimension(depth, BOUNCE_LIGHT_PICK));
+        size_t index = std::min(lights.size() - 1, (size_t)(gen.get_1d() * lights.size()));
+        const light_sphere &light = lights[index];
+
+        vec3 direction;
+        double pdf_value, u, v;
+        gen.get_2d(u, v);
+        if (!light.sample(rec.p, u, v, direction, distance, pdf_value))
+            return false;
+        pdf_value /= lights.size();
+
+        color f = material_dispatch::eval(rec.mat, rec, direction);
+        if (f.r() <= 0 && f.g() <= 0 && f.b() <= 0)
+            return false;
+
+        // Stop just short of the light, so the light itself does not count as blocking
+        shadow_ray = ray(rec.p, direction);
+        distance *= 1 - SHADOW_RAY_MARGIN;
+        double weight = power_heuristic(pdf_value, material_dispatch::pdf(rec.mat, rec, direction));
+        contribution = f * material_dispatch::emitted(light.mat) * (weight / pdf_value);
+        if (light_mat != nullptr)
+            *light_mat = light.mat;
+        return true;
+    }
+
+    // Chance density that sample_light, from point p, picks the direction of the light hit at rec
+    double light_pdf(const point3 &p, const hit_record &rec) const
+    {
+        for (const light_sphere &light : lights)
+        {
+            vec3 offset = rec.p - light.center;
+            if (light.mat == rec.mat && std::fabs(offset.length() - light.radius) <= 1e-4 * light.radius)
+            {
+                return light.pdf(p) / lights.size();
+            }
+        }
+        return 0;
+    }
+
+    // Create a simple gradient depending on pixel position
+    // Depending on height of ray, go from white to full red
+    // unit_direction.y() goes -1 to 1, therefore add 1 to not have negative and divide by 0.5 to stay within 0 and 1
+    // If y closer to 1, t will be closer to 1
+    // If y is close to -1, t will be closer to 0
+    color background(const ray &r) const
+    {
+        vec3 unit_direction = normalize(r.direction());
+        auto t = 0.5 * (unit_direction.y() + 1.0);
+        return (background_bottom * (1 - t) + background_top * (t));
+    }
+};
+
+#endif
\ No newline at end of file
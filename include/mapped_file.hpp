@@ -0,0 +1,83 @@
+#ifndef mapped_file_hpp
+#define mapped_file_hpp
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A whole file mapped into memory read-only, so it can be parsed or used in place without reading it into a buffer.
+// Pages are only read from disk as they are touched, and are shared with the page cache instead of copied.
+class mapped_file
+{
+public:
+    // Map the file at path, throws std::runtime_error if it can not be opened
+    explicit mapped_file(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not open " + path);
+        }
+        bool ok = map(fd);
+        close(fd);
+        if (!ok)
+        {
+            throw std::runtime_error("Could not map " + path);
+        }
+    }
+
+    // Map an already open file (such as stdin redirected from a file), returns an empty mapping if fd is not a regular file
+    explicit mapped_file(int fd)
+    {
+        map(fd);
+    }
+
+    ~mapped_file()
+    {
+        if (bytes != nullptr && length > 0)
+        {
+            munmap(const_cast<char *>(bytes), length);
+        }
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool mapped() const { return bytes != nullptr; }
+    const char *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    bool map(int fd)
+    {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            return false;
+        }
+        length = (size_t)info.st_size;
+        if (length == 0)
+        {
+            // mmap can not map nothing, an empty file is an empty buffer
+            bytes = "";
+            return true;
+        }
+        void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            length = 0;
+            return false;
+        }
+        bytes = static_cast<const char *>(p);
+        return true;
+    }
+
+    const char *bytes = nullptr;
+    size_t length = 0;
+};
+
+#endif
\ No newline at end of file
@@ -5,10 +5,15 @@
 #define material_hpp
 
 #include "ray.hpp"
+#include "aabb.hpp"
 #include "color.hpp"
 #include "vec3.hpp"
 #include "sphere.hpp"
 #include "color.hpp"
+#include "sampler.hpp"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 
 class material;
 
@@ -17,50 +22,174 @@ struct hit_record
 {
     point3 p;
     vec3 normal;
-    double t;
+    real t;
     material *mat;
 };
 
 class hittable
 {
 public:
-    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const = 0;
+    virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const = 0;
+
+    // Whether anything blocks the ray between t_min and t_max, for shadow rays that need no hit details.
+    // Any hit will do, not only the closest one; objects with a cheaper yes or no test override it.
+    virtual bool occluded(const ray &r, real t_min, real t_max) const
+    {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Box that fully contains the object, used to build the BVH
+    virtual aabb bounding_box() const = 0;
 };
 
+// Every kind of material, the one place a new material is registered.
+// Each entry is X(type, value, class, keyword, parameters): the type tag and its value in binary scene files (never reuse one),
+// the class, the word naming it on a SPHERE line, and how many numbers follow that word (3 for a color, 4 for a color and fuzz).
+// The class must have a constructor from a material_desc and a describe() giving one back.
+#define MATERIAL_TYPES(X)                                   \
+    X(lambertian_type, 1, lambertian, "LAMBERTIAN", 3)      \
+    X(light_type, 2, diffuse_light, "LIGHT", 3)             \
+    X(metal_type, 3, metal, "METAL", 4)
+
+#define MATERIAL_ENUM_ENTRY(type, value, class_name, keyword, parameters) type = value,
+enum material_type : uint32_t
+{
+    MATERIAL_TYPES(MATERIAL_ENUM_ENTRY)
+};
+#undef MATERIAL_ENUM_ENTRY
+
+// How a kind of material is written in an input file
+struct material_info
+{
+    material_type type;
+    const char *keyword;
+    int parameters;
+};
+
+#define MATERIAL_INFO_ENTRY(type, value, class_name, keyword, parameters) {type, keyword, parameters},
+const material_info material_infos[] = {MATERIAL_TYPES(MATERIAL_INFO_ENTRY)};
+#undef MATERIAL_INFO_ENTRY
+
+// The entry of material_infos for type, nullptr if there is none
+const material_info *find_material_info(uint32_t type)
+{
+    for (const material_info &info : material_infos)
+    {
+        if (info.type == type)
+            return &info;
+    }
+    return nullptr;
+}
+
+// A material written as its type and parameters, such as one SPHERE line's material.
+// This is also the material table entry of a binary scene file, so its layout must not change.
+struct material_desc
+{
+    uint32_t type;
+    uint32_t unused;
+    double color[3];
+    double fuzz;
+};
+
+material_desc make_material_desc(material_type type, const color &c, double fuzz = 0)
+{
+    material_desc desc;
+    std::memset(&desc, 0, sizeof(desc));
+    desc.type = type;
+    desc.color[0] = c.r();
+    desc.color[1] = c.g();
+    desc.color[2] = c.b();
+    desc.fuzz = fuzz;
+    return desc;
+}
+
+color desc_color(const material_desc &desc)
+{
+    return color(desc.color[0], desc.color[1], desc.color[2]);
+}
+
 // Material abstract class to contain the abstract method hit for each different material to implement
+// scatter draws its random numbers from gen, the sampler of the pixel being rendered, starting at the bounce's BOUNCE_SCATTER dimension
+// type tells which class a material is, so calls can be dispatched with a switch instead of through the virtual functions (see material_dispatch)
 class material
 {
 public:
+    explicit material(material_type type) : type(type) {}
+
     virtual color emitted() const
     {
         return color(0, 0, 0);
     }
     virtual bool scatter(
-        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const = 0;
+        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &gen) const = 0;
+
+    // Materials that scatter light over a spread of directions (rather than in one mirror direction) can also have light sampled directly.
+    // For those, eval gives the color reflected towards direction (BRDF * cosine) and pdf the chance density that scatter picks that direction.
+    virtual bool is_diffuse() const
+    {
+        return false;
+    }
+    virtual color eval(const hit_record &, const vec3 &) const
+    {
+        return color(0, 0, 0);
+    }
+    virtual double pdf(const hit_record &, const vec3 &) const
+    {
+        return 0;
+    }
+
+    const material_type type;
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
-    lambertian(const color &a) : albedo(a) {}
-    virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const
+    lambertian(const color &a) : material(lambertian_type), albedo(a) {}
+    explicit lambertian(const material_desc &desc) : lambertian(desc_color(desc)) {}
+
+    material_desc describe() const
     {
-        // Transfer the lambertian function we already had.
-        // Albedo is a color for the diffuse material.
-        vec3 scatter_direction = rec.normal + vec3::random_in_hemisphere(rec.normal);
+        return make_material_desc(lambertian_type, albedo);
+    }
 
-        scattered = ray(rec.p, scatter_direction);
+    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &gen) const override
+    {
+        // Albedo is a color for the diffuse material.
+        // Directions picked with a chance proportional to cos(angle to normal) are exactly the Lambertian reflection,
+        // so the attenuation is just the albedo.
+        double u, v;
+        gen.get_2d(u, v);
+        scattered = ray(rec.p, cosine_warp(rec.normal, u, v));
         attenuation = albedo;
         return true;
     }
+
+    bool is_diffuse() const override
+    {
+        return true;
+    }
+
+    // Lambertian BRDF is albedo / pi
+    color eval(const hit_record &rec, const vec3 &direction) const override
+    {
+        double cosine = dot(rec.normal, normalize(direction));
+        return cosine > 0 ? (cosine / M_PI) * albedo : color(0, 0, 0);
+    }
+
+    double pdf(const hit_record &rec, const vec3 &direction) const override
+    {
+        double cosine = dot(rec.normal, normalize(direction));
+        return cosine > 0 ? cosine / M_PI : 0;
+    }
     color albedo;
 };
 
-class metal : public material
+class metal final : public material
 {
 public:
-    metal(const color &a) : albedo(a) { fuzz = 0; }
-    metal(const color &a, double f) : albedo(a)
+    metal(const color &a) : material(metal_type), albedo(a) { fuzz = 0; }
+    metal(const color &a, double f) : material(metal_type), albedo(a)
     {
         if (f < 1)
         {
@@ -72,15 +201,24 @@ public:
             fuzz = 1;
         }
     }
+    explicit metal(const material_desc &desc) : metal(desc_color(desc), desc.fuzz) {}
 
-    virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const
+    material_desc describe() const
+    {
+        return make_material_desc(metal_type, albedo, fuzz);
+    }
+
+    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &gen) const override
     {
         vec3 scatter_direction = reflect(normalize(r_in.direction()), rec.normal);
 
-        // Fuzz will add some randomness to alter abit of the reflection.
-        scattered = ray(rec.p, scatter_direction + fuzz * vec3::random_in_unit_sphere());
+        // Fuzz will add some randomness to alter abit of the reflection, a random point of a ball of radius fuzz.
+        double u, v;
+        gen.get_2d(u, v);
+        double w = gen.get_1d();
+        scattered = ray(rec.p, scatter_direction + fuzz * ball_warp(u, v, w));
         attenuation = albedo;
-        
+
         // Only return if ray is not scattered into the surface. if ray scatters into surface, threat it as it got absorbed.
         // It is only possible for ray to scatter into surface if the fuzz made it so.
         return (dot(scattered.direction(), rec.normal) >= 0);
@@ -90,19 +228,25 @@ public:
     double fuzz;
 };
 
-class diffuse_light : public material
+class diffuse_light final : public material
 {
 public:
-    diffuse_light(color c) : emit(c) {}
+    diffuse_light(color c) : material(light_type), emit(c) {}
+    explicit diffuse_light(const material_desc &desc) : diffuse_light(desc_color(desc)) {}
+
+    material_desc describe() const
+    {
+        return make_material_desc(light_type, emit);
+    }
 
     bool scatter(
-        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const
+        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &gen) const override
     {
         // Light does not scatter but immediately returns the light
         return false;
     }
 
-    color emitted() const
+    color emitted() const override
     {
         return emit;
     }
@@ -110,4 +254,112 @@ public:
     color emit;
 };
 
+// Calls a material's function through its virtual functions
+struct virtual_dispatch
+{
+    static bool scatter(const material *mat, const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &gen)
+    {
+        return mat->scatter(r_in, rec, attenuation, scattered, gen);
+    }
+    static color emitted(const material *mat)
+    {
+        return mat->emitted();
+    }
+    static bool is_diffuse(const material *mat)
+    {
+        return mat->is_diffuse();
+    }
+    static color eval(const material *mat, const hit_record &rec, const vec3 &direction)
+    {
+        return mat->eval(rec, direction);
+    }
+    static double pdf(const material *mat, const hit_record &rec, const vec3 &direction)
+    {
+        return mat->pdf(rec, direction);
+    }
+};
+
+// Calls a material's function by switching on its type and calling the class's own function, which the compiler can inline.
+// A material with a type that is not registered still works through its virtual function.
+#define MATERIAL_DISPATCH_CASE(type, value, class_name, keyword, parameters) \
+    case type:                                                             \
+        return static_cast<const class_name *>(mat)->class_name::MATERIAL_DISPATCH_CALL;
+
+struct tagged_dispatch
+{
+    static bool scatter(const material *mat, const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &gen)
+    {
+#define MATERIAL_DISPATCH_CALL scatter(r_in, rec, attenuation, scattered, gen)
+        switch (mat->type)
+        {
+            MATERIAL_TYPES(MATERIAL_DISPATCH_CASE)
+        }
+        return mat->MATERIAL_DISPATCH_CALL;
+#undef MATERIAL_DISPATCH_CALL
+    }
+    static color emitted(const material *mat)
+    {
+#define MATERIAL_DISPATCH_CALL emitted()
+        switch (mat->type)
+        {
+            MATERIAL_TYPES(MATERIAL_DISPATCH_CASE)
+        }
+        return mat->MATERIAL_DISPATCH_CALL;
+#undef MATERIAL_DISPATCH_CALL
+    }
+    static bool is_diffuse(const material *mat)
+    {
+#define MATERIAL_DISPATCH_CALL is_diffuse()
+        switch (mat->type)
+        {
+            MATERIAL_TYPES(MATERIAL_DISPATCH_CASE)
+        }
+        return mat->MATERIAL_DISPATCH_CALL;
+#undef MATERIAL_DISPATCH_CALL
+    }
+    static color eval(const material *mat, const hit_record &rec, const vec3 &direction)
+    {
+#define MATERIAL_DISPATCH_CALL eval(rec, direction)
+        switch (mat->type)
+        {
+            MATERIAL_TYPES(MATERIAL_DISPATCH_CASE)
+        }
+        return mat->MATERIAL_DISPATCH_CALL;
+#undef MATERIAL_DISPATCH_CALL
+    }
+    static double pdf(const material *mat, const hit_record &rec, const vec3 &direction)
+    {
+#define MATERIAL_DISPATCH_CALL pdf(rec, direction)
+        switch (mat->type)
+        {
+            MATERIAL_TYPES(MATERIAL_DISPATCH_CASE)
+        }
+        return mat->MATERIAL_DISPATCH_CALL;
+#undef MATERIAL_DISPATCH_CALL
+    }
+};
+
+#undef MATERIAL_DISPATCH_CASE
+
+// The renderer calls materials through material_dispatch, chosen when building (RAYTRACE_TAGGED_MATERIALS in CMakeLists.txt)
+#ifdef RAYTRACE_TAGGED_MATERIALS
+typedef tagged_dispatch material_dispatch;
+#else
+typedef virtual_dispatch material_dispatch;
+#endif
+
+// Describe one of the registered materials, throws std::runtime_error for any other material
+material_desc describe_material(const material *mat)
+{
+#define MATERIAL_DESCRIBE_CASE(type, value, class_name, keyword, parameters) \
+    case type:                                                             \
+        return static_cast<const class_name *>(mat)->describe();
+    switch (mat->type)
+    {
+        MATERIAL_TYPES(MATERIAL_DESCRIBE_CASE)
+    }
+#undef MATERIAL_DESCRIBE_CASE
+    throw std::runtime_error("Material can not be written to a scene file");
+}
+
 #endif
\ No newline at end of file
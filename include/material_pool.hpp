@@ -0,0 +1,76 @@
+#ifndef material_pool_hpp
+#define material_pool_hpp
+
+#include "material.hpp"
+#include "scene_arena.hpp"
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+// The materials of a scene, made in its arena. Identical materials (such as many spheres of the same color) are only made once.
+// Each distinct material also gets an index, in the order they were first asked for.
+class material_pool
+{
+public:
+    explicit material_pool(scene_arena &arena) : arena(arena) {}
+
+    // The material described by desc, throws std::runtime_error if its type is unknown
+    material *get(const material_desc &desc)
+    {
+        requested++;
+        key k(desc.type, desc.color[0], desc.color[1], desc.color[2], desc.fuzz);
+        auto found = index.find(k);
+        if (found != index.end())
+        {
+            return materials[found->second];
+        }
+
+        material *mat = make(desc);
+        index[k] = materials.size() - 1;
+        return mat;
+    }
+
+    // A new material described by desc, not shared with any other (such as the one sphere of an incremental render's SPHERE line),
+    // throws std::runtime_error if its type is unknown
+    material *make_unshared(const material_desc &desc)
+    {
+        requested++;
+        return make(desc);
+    }
+
+    // Distinct materials, in the order they were made
+    const std::vector<material *> &all() const { return materials; }
+
+    // Number of materials asked for, counting repeats
+    size_t requests() const { return requested; }
+
+private:
+    typedef std::tuple<uint32_t, double, double, double, double> key;
+
+    material *make(const material_desc &desc)
+    {
+        material *mat;
+        switch (desc.type)
+        {
+#define MATERIAL_CREATE_CASE(type, value, class_name, keyword, parameters) \
+    case type:                                                           \
+        mat = arena.create<class_name>(desc);                             \
+        break;
+            MATERIAL_TYPES(MATERIAL_CREATE_CASE)
+#undef MATERIAL_CREATE_CASE
+        default:
+            throw std::runtime_error("Invalid material type " + std::to_string(desc.type));
+        }
+        materials.push_back(mat);
+        return mat;
+    }
+
+    scene_arena &arena;
+    std::map<key, size_t> index;
+    std::vector<material *> materials;
+    size_t requested = 0;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef memory_usage_hpp
+#define memory_usage_hpp
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+
+// A memory figure in kB from /proc/self/status (Linux), in bytes. 0 if it is not known.
+size_t process_status_bytes(const std::string &name)
+{
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    while (status >> key)
+    {
+        if (key == name)
+        {
+            size_t kilobytes = 0;
+            status >> kilobytes;
+            return kilobytes * 1024;
+        }
+        status.ignore(1 << 16, '\n');
+    }
+    return 0;
+}
+
+// Memory of the process that is in RAM now (resident set)
+size_t resident_memory()
+{
+    return process_status_bytes("VmRSS:");
+}
+
+// Most memory the process has had in RAM at once
+size_t peak_resident_memory()
+{
+    return process_status_bytes("VmHWM:");
+}
+
+#endif
\ No newline at end of file
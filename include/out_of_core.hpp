@@ -0,0 +1,303 @@
+#ifndef out_of_core_hpp
+#define out_of_core_hpp
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "image_io.hpp"
+#include "renderer.hpp"
+#include "scene.hpp"
+#include "tile_scheduler.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Version of the out-of-core framebuffer file layout, files of another version are not resumed
+#define OUT_OF_CORE_VERSION 1
+// Width and height of the tiles of an out-of-core framebuffer. The pixels of a tile are stored together,
+// so a finished tile is a few whole pages of the file (3 pages of floats, 6 of doubles)
+#define OUT_OF_CORE_TILE_SIZE 32
+// Least number of tiles in a band, the rows of tiles rendered together before they are written back to the file and streamed out
+#define OUT_OF_CORE_BAND_TILES 256
+// The pixels start at a multiple of this many bytes into the file, a page on every machine
+#define OUT_OF_CORE_ALIGNMENT 65536
+
+// Start of an out-of-core framebuffer file. It is followed by one byte for every tile (1 once the tile is finished and on disk),
+// then from pixel_offset by the tiles' pixels, tile after tile in scanline order and each tile's pixels in scanline order.
+// Values are stored in the byte order of the machine, files are meant to be resumed where they were made.
+struct out_of_core_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t color_size;
+    uint32_t tile_size;
+    int32_t width;
+    int32_t height;
+    uint64_t scene_hash;
+    uint64_t pixel_offset;
+};
+
+// The pixels of an image kept in a file mapped into memory rather than in memory of its own, for images bigger than the memory.
+// Only the pages of the tiles being rendered or written out are in memory, the rest stay in the file until they are needed.
+// Which tiles are finished is kept in the file too, so a render that was killed carries on from the tiles it finished.
+class tiled_framebuffer
+{
+public:
+    // Open the framebuffer file at path for a width x height image of the scene with hash scene_hash, making it if there is no such file.
+    // Throws std::runtime_error if the file holds another render or can not be made.
+    tiled_framebuffer(const std::string &path, int width, int height, uint64_t scene_hash)
+        : img_width(width), img_height(height), tiles_across((width + OUT_OF_CORE_TILE_SIZE - 1) / OUT_OF_CORE_TILE_SIZE),
+          tiles_down((height + OUT_OF_CORE_TILE_SIZE - 1) / OUT_OF_CORE_TILE_SIZE)
+    {
+        size_t tile_count = (size_t)tiles_across * tiles_down;
+        size_t pixel_offset = (sizeof(out_of_core_header) + tile_count + OUT_OF_CORE_ALIGNMENT - 1) / OUT_OF_CORE_ALIGNMENT * OUT_OF_CORE_ALIGNMENT;
+        length = pixel_offset + tile_count * tile_pixels() * sizeof(color);
+
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not open " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            close(fd);
+            throw std::runtime_error("Could not open " + path);
+        }
+        bool made = info.st_size == 0;
+        if (made)
+        {
+            // Take the disk space now, rather than failing on a page part way through the render
+            int result = posix_fallocate(fd, 0, (off_t)length);
+            if (result != 0)
+            {
+                close(fd);
+                std::remove(path.c_str());
+                throw std::runtime_error("Could not make " + path + " of " + std::to_string(length >> 20) + " MiB: " + std::strerror(result));
+            }
+        }
+        else if ((size_t)info.st_size != length)
+        {
+            close(fd);
+            throw std::runtime_error(path + " holds another render");
+        }
+
+        void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Could not map " + path);
+        }
+        bytes = static_cast<unsigned char *>(p);
+        header = reinterpret_cast<out_of_core_header *>(bytes);
+        done = bytes + sizeof(out_of_core_header);
+        pixels = reinterpret_cast<color *>(bytes + pixel_offset);
+
+        if (made)
+        {
+            // The tiles' bytes are 0 (not finished) in the new file, the magic is written last so a half made file is never resumed
+            header->version = OUT_OF_CORE_VERSION;
+            header->color_size = sizeof(color);
+            header->tile_size = OUT_OF_CORE_TILE_SIZE;
+            header->width = width;
+            header->height = height;
+            header->scene_hash = scene_hash;
+            header->pixel_offset = pixel_offset;
+            msync(bytes, pixel_offset, MS_SYNC);
+            std::memcpy(header->magic, "RTOC", 4);
+            msync(bytes, pixel_offset, MS_SYNC);
+        }
+        else if (std::memcmp(header->magic, "RTOC", 4) != 0 || header->version != OUT_OF_CORE_VERSION || header->color_size != sizeof(color) ||
+                 header->tile_size != OUT_OF_CORE_TILE_SIZE || header->width != width || header->height != height ||
+                 header->scene_hash != scene_hash || header->pixel_offset != pixel_offset)
+        {
+            munmap(bytes, length);
+            close(fd);
+            throw std::runtime_error(path + " holds another render");
+        }
+    }
+
+    ~tiled_framebuffer()
+    {
+        munmap(bytes, length);
+        close(fd);
+    }
+
+    tiled_framebuffer(const tiled_framebuffer &) = delete;
+    tiled_framebuffer &operator=(const tiled_framebuffer &) = delete;
+
+    int width() const { return img_width; }
+    int height() const { return img_height; }
+    int tiles_x() const { return tiles_across; }
+    int tiles_y() const { return tiles_down; }
+    size_t num_tiles() const { return (size_t)tiles_across * tiles_down; }
+
+    // Index of the tile holding pixel (i, j)
+    size_t tile_index(int i, int j) const
+    {
+        return (size_t)(j / OUT_OF_CORE_TILE_SIZE) * tiles_across + i / OUT_OF_CORE_TILE_SIZE;
+    }
+
+    // i is the column (left to right), j is the row (top to bottom)
+    color &at(int i, int j)
+    {
+        return pixels[tile_index(i, j) * tile_pixels() + (j % OUT_OF_CORE_TILE_SIZE) * OUT_OF_CORE_TILE_SIZE + i % OUT_OF_CORE_TILE_SIZE];
+    }
+    const color &at(int i, int j) const
+    {
+        return pixels[tile_index(i, j) * tile_pixels() + (j % OUT_OF_CORE_TILE_SIZE) * OUT_OF_CORE_TILE_SIZE + i % OUT_OF_CORE_TILE_SIZE];
+    }
+
+    // Whether tile t was finished by this render or an earlier one of the same file
+    bool tile_done(size_t t) const { return done[t] != 0; }
+
+    // Number of tiles from first to end - 1 that are finished
+    size_t tiles_done(size_t first, size_t end) const
+    {
+        return (size_t)std::count(done + first, done + end, 1);
+    }
+
+    // Write the pixels of tiles first to end - 1 to the file, then mark them finished.
+    // The pixels are on the disk before any of the tiles is marked, so a tile marked finished is never lost, even in a power cut.
+    void finish_tiles(size_t first, size_t end)
+    {
+        sync(pixels + first * tile_pixels(), pixels + end * tile_pixels());
+        std::fill(done + first, done + end, 1);
+        sync(done + first, done + end);
+    }
+
+    // Let go of the memory of tiles first to end - 1, which stay in the file and are read back if they are used again
+    void release_tiles(size_t first, size_t end)
+    {
+        unsigned char *begin, *finish;
+        page_range(pixels + first * tile_pixels(), pixels + end * tile_pixels(), begin, finish);
+        madvise(begin, finish - begin, MADV_DONTNEED);
+    }
+
+private:
+    static size_t tile_pixels() { return (size_t)OUT_OF_CORE_TILE_SIZE * OUT_OF_CORE_TILE_SIZE; }
+
+    // The whole pages holding the bytes from begin up to end, as msync and madvise only take whole pages
+    static void page_range(const void *begin, const void *end, unsigned char *&first, unsigned char *&last)
+    {
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        first = reinterpret_cast<unsigned char *>((uintptr_t)begin / page * page);
+        last = reinterpret_cast<unsigned char *>(((uintptr_t)end + page - 1) / page * page);
+    }
+
+    static void sync(const void *begin, const void *end)
+    {
+        unsigned char *first, *last;
+        page_range(begin, end, first, last);
+        if (msync(first, last - first, MS_SYNC) != 0)
+        {
+            throw std::runtime_error(std::string("Could not write the framebuffer file: ") + std::strerror(errno));
+        }
+    }
+
+    int img_width;
+    int img_height;
+    int tiles_across;
+    int tiles_down;
+    int fd = -1;
+    size_t length = 0;
+    unsigned char *bytes = nullptr;
+    out_of_core_header *header = nullptr;
+    unsigned char *done = nullptr;
+    color *pixels = nullptr;
+};
+
+// Renders the image into a tiled_framebuffer a band of tiles at a time, writing each band out to the image file as soon as it is finished.
+// Once a band is written out its memory is let go of, so the memory used depends on the width of the image but not on its height.
+// Pass it to scene_world::with_world.
+struct out_of_core_pass
+{
+    const camera &cam;
+    const render_settings &settings;
+    tiled_framebuffer &image;
+    std::ostream &os;
+
+    template <typename World>
+    void operator()(const World &world)
+    {
+        image_stream stream(os, image.width(), image.height(), settings.format);
+        int band_rows = std::max(1, (OUT_OF_CORE_BAND_TILES + image.tiles_x() - 1) / image.tiles_x());
+        int bands = (image.tiles_y() + band_rows - 1) / band_rows;
+        for (int b = 0; b < bands; b++)
+        {
+            // PFM rows go from the bottom of the image to the top, so its bands are rendered from the bottom up
+            int band = stream.bottom_up() ? bands - 1 - b : b;
+            int first_row = band * band_rows, end_row = std::min(image.tiles_y(), first_row + band_rows);
+            size_t first = (size_t)first_row * image.tiles_x(), end = (size_t)end_row * image.tiles_x();
+            int j0 = first_row * OUT_OF_CORE_TILE_SIZE, j1 = std::min(image.height(), end_row * OUT_OF_CORE_TILE_SIZE);
+
+            if (image.tiles_done(first, end) < end - first)
+            {
+                tile_scheduler scheduler(tile{0, 0, j0, image.width(), j1}, OUT_OF_CORE_TILE_SIZE);
+                scheduler.run(settings.num_threads, [&](const tile &t) {
+                    if (!image.tile_done(image.tile_index(t.x0, t.y0)))
+                        render_tile(world, cam, settings, t, image);
+                });
+                image.finish_tiles(first, end);
+            }
+
+            // Hand the encoder a row at a time, so only the band's tiles and one row are ever in memory
+            for (int k = 0; k < j1 - j0; k++)
+            {
+                int j = stream.bottom_up() ? j1 - 1 - k : j0 + k;
+                framebuffer row(image.width(), 1, 0, j);
+                for (int i = 0; i < image.width(); i++)
+                    row.at(i, j) = image.at(i, j);
+                stream.write_rows(row, j, j + 1);
+            }
+            image.release_tiles(first, end);
+
+            if (settings.show_progress)
+                std::cerr << "\rOut-of-core band " << b + 1 << " out of " << bands << " written" << std::flush;
+        }
+        stream.finish();
+        if (!os)
+        {
+            throw std::runtime_error("Could not write the image");
+        }
+    }
+};
+
+// Render the scene s into the out-of-core framebuffer file at path, streaming the image to os as it is finished.
+// If the file already holds part of this render, the tiles it finished are not rendered again.
+void render_out_of_core(const scene &s, const std::string &path, std::ostream &os)
+{
+    render_settings settings = s.settings;
+    if (settings.adaptive.enabled || settings.progressive.enabled || settings.denoise)
+    {
+        throw std::runtime_error("Out-of-core renders can not use ADAPTIVE, PROGRESSIVE or DENOISE");
+    }
+
+    STATS_PHASE_BEGIN(build);
+    scene_world world(s, settings.num_threads, settings.show_progress);
+    STATS_PHASE_END(build);
+    settings.integrator.lights = world.light_spheres();
+
+    tiled_framebuffer image(path, settings.image_width, settings.image_height, s.hash);
+    size_t finished = image.tiles_done(0, image.num_tiles());
+    if (finished > 0 && settings.show_progress)
+    {
+        std::cerr << "Resuming from " << path << " with " << finished << " out of " << image.num_tiles() << " tiles finished" << std::endl;
+    }
+
+    STATS_PHASE_BEGIN(render);
+    out_of_core_pass pass{s.cam, settings, image, os};
+    world.with_world(pass);
+    STATS_PHASE_END(render);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,200 @@
+#ifndef progressive_hpp
+#define progressive_hpp
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "rng.hpp"
+#include "tile_scheduler.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Version of the checkpoint file layout, files of another version are not loaded.
+// Version 1 files of float builds held the sums as floats, version 2 always holds doubles.
+#define CHECKPOINT_VERSION 2
+
+// Settings for progressive rendering, where the image is rendered in passes of a few samples per pixel
+struct progressive_settings
+{
+    bool enabled = false;
+
+    // Samples added to every pixel by each pass
+    int pass_samples = 16;
+
+    // File the accumulated samples are saved to after every pass, and resumed from if it exists, none if empty
+    std::string checkpoint_file;
+
+    // File the image so far is written to after every pass, none if empty
+    std::string preview_file;
+
+    // Identifies the scene in checkpoints, so a checkpoint is never resumed with another scene (set from scene::hash)
+    uint64_t scene_hash = 0;
+};
+
+// Sum of the samples of every pixel, with how many samples each pixel has and where each pixel's random sequence is up to.
+// That is everything needed to carry on a render later, so it can be saved to a checkpoint file and loaded again.
+// Each pixel keeps its generator between passes, so a render done in passes (even resumed from a checkpoint)
+// takes exactly the same samples as one done in one go, and gives the same image.
+class accumulation_buffer
+{
+public:
+    accumulation_buffer(int image_width, int image_height, uint64_t seed)
+        : width(image_width), height(image_height), seed(seed), sums((size_t)image_width * image_height), counts(sums.size(), 0)
+    {
+        for (size_t k = 0; k < sums.size(); k++)
+        {
+            generators.push_back(rng(seed, k));
+        }
+    }
+
+    // Add samples samples to every pixel, sample(i, j, index, gen) returns the color of sample index of pixel (i, j)
+    template <typename F>
+    void render_pass(int num_threads, int samples, const F &sample)
+    {
+        tile_scheduler scheduler(width, height);
+        scheduler.run(num_threads, [&](const tile &t) {
+            for (int j = t.y0; j < t.y1; j++)
+            {
+                for (int i = t.x0; i < t.x1; i++)
+                {
+                    size_t k = (size_t)j * width + i;
+                    for (int s = 0; s < samples; s++)
+                    {
+                        sums[k] += sample(i, j, (int)counts[k] + s, generators[k]);
+                    }
+                    counts[k] += samples;
+                }
+            }
+        });
+        samples_done += samples;
+    }
+
+    // Samples per pixel taken so far
+    int samples() const { return samples_done; }
+
+    // Average of each pixel's samples so far
+    void resolve(framebuffer &image) const
+    {
+        for (int j = 0; j < height; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                size_t k = (size_t)j * width + i;
+                image.at(i, j) = counts[k] > 0 ? sums[k].average(counts[k]) : color(0, 0, 0);
+            }
+        }
+    }
+
+    // Write the buffer to path, scene_hash identifies the scene it belongs to.
+    // The file is written under a temporary name first, so a render killed while saving still leaves the previous checkpoint.
+    void save(const std::string &path, uint64_t scene_hash) const
+    {
+        std::string temp_path = path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            out.write("RTCK", 4);
+            write_value(out, (uint32_t)CHECKPOINT_VERSION);
+            write_value(out, scene_hash);
+            write_value(out, (int32_t)width);
+            write_value(out, (int32_t)height);
+            write_value(out, seed);
+            write_value(out, (int32_t)samples_done);
+            for (size_t k = 0; k < sums.size(); k++)
+            {
+                uint64_t state[4];
+                generators[k].get_state(state);
+                write_value(out, sums[k].r());
+                write_value(out, sums[k].g());
+                write_value(out, sums[k].b());
+                write_value(out, counts[k]);
+                out.write(reinterpret_cast<const char *>(state), sizeof(state));
+            }
+            out.flush();
+            if (!out)
+            {
+                throw std::runtime_error("Could not write checkpoint " + temp_path);
+            }
+        }
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            throw std::runtime_error("Could not replace checkpoint " + path);
+        }
+    }
+
+    // Load the buffer from path, returns false if there is no such file.
+    // Throws std::runtime_error if the file is not a checkpoint of this scene and image size.
+    bool load(const std::string &path, uint64_t scene_hash)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+
+        char magic[4];
+        uint32_t version;
+        uint64_t file_hash, file_seed;
+        int32_t file_width, file_height, file_samples;
+        in.read(magic, 4);
+        read_value(in, version);
+        if (!in || std::string(magic, 4) != "RTCK" || version != CHECKPOINT_VERSION)
+        {
+            throw std::runtime_error("Invalid checkpoint file " + path);
+        }
+        read_value(in, file_hash);
+        read_value(in, file_width);
+        read_value(in, file_height);
+        read_value(in, file_seed);
+        read_value(in, file_samples);
+        if (file_hash != scene_hash || file_width != width || file_height != height || file_seed != seed)
+        {
+            throw std::runtime_error("Checkpoint " + path + " is of a different scene");
+        }
+
+        for (size_t k = 0; k < sums.size(); k++)
+        {
+            double r, g, b;
+            uint64_t state[4];
+            read_value(in, r);
+            read_value(in, g);
+            read_value(in, b);
+            read_value(in, counts[k]);
+            in.read(reinterpret_cast<char *>(state), sizeof(state));
+            sums[k] = color_sum(r, g, b);
+            generators[k].set_state(state);
+        }
+        if (!in)
+        {
+            throw std::runtime_error("Checkpoint " + path + " is truncated");
+        }
+        samples_done = file_samples;
+        return true;
+    }
+
+private:
+    // Values are stored in the byte order of the machine, checkpoints are meant to be resumed where they were made
+    template <typename T>
+    static void write_value(std::ostream &out, const T &value)
+    {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static void read_value(std::istream &in, T &value)
+    {
+        in.read(reinterpret_cast<char *>(&value), sizeof(value));
+    }
+
+    int width;
+    int height;
+    uint64_t seed;
+    int samples_done = 0;
+    std::vector<color_sum> sums;
+    std::vector<uint32_t> counts;
+    std::vector<rng> generators;
+};
+
+#endif
\ No newline at end of file
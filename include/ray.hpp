@@ -16,7 +16,7 @@ public:
     vec3 direction() const { return dir; }
 
     // Following P(t) = A + tb
-    point3 at(double t) const { return orig + t * dir; }
+    point3 at(real t) const { return orig + t * dir; }
 
 private:
     // Ray has a point and a direction
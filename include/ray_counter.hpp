@@ -0,0 +1,89 @@
+#ifndef ray_counter_hpp
+#define ray_counter_hpp
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "renderer.hpp"
+#include <atomic>
+#include <cstdint>
+
+// Rays traced through the counting_worlds of one render.
+// Each thread adds to its own slot (threads share one only if there are more than slots), so threads rarely write the same cache line.
+class ray_counter
+{
+public:
+    static constexpr int slots = 64;
+
+    void add(uint64_t rays) { counts[thread_slot()].rays.fetch_add(rays, std::memory_order_relaxed); }
+
+    // Rays traced so far, exact once the render has returned
+    uint64_t rays() const
+    {
+        uint64_t total = 0;
+        for (const auto &count : counts)
+        {
+            total += count.rays.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(64) slot
+    {
+        std::atomic<uint64_t> rays{0};
+    };
+    slot counts[slots];
+
+    static int thread_slot()
+    {
+        static std::atomic<int> next_slot(0);
+        thread_local int index = next_slot++ % slots;
+        return index;
+    }
+};
+
+// A world that counts the rays traced through it (camera, bounce and shadow rays)
+template <typename World>
+struct counting_world
+{
+    const World &world;
+    ray_counter &counter;
+
+    bool hit_all(const ray &r, real t_min, real t_max, hit_record &rec) const
+    {
+        counter.add(1);
+        return world.hit_all(r, t_min, t_max, rec);
+    }
+
+    bool occluded(const ray &r, real t_min, real t_max) const
+    {
+        counter.add(1);
+        return world.occluded(r, t_min, t_max);
+    }
+};
+
+// A counted BVH still walks its tree once for a whole packet (see wavefront.hpp)
+void hit_packet(const counting_world<bvh_world> &counted, const ray *rays, int count, hit_record *recs, bool *hits)
+{
+    counted.counter.add(count);
+    hit_packet(counted.world, rays, count, recs, hits);
+}
+
+// Renders through a counting_world of whichever world scene_world built, counting its rays in counter. Pass it to scene_world::with_world.
+// settings.integrator.lights must already hold the world's lights.
+struct counted_render
+{
+    const camera &cam;
+    const render_settings &settings;
+    framebuffer &image;
+    ray_counter &counter;
+
+    template <typename World>
+    void operator()(const World &world)
+    {
+        render(counting_world<World>{world, counter}, cam, settings, image);
+    }
+};
+
+#endif
\ No newline at end of file
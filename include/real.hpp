@@ -0,0 +1,13 @@
+#ifndef real_hpp
+#define real_hpp
+
+// Scalar type of the renderer's geometry and colors (vec3, color, ray, spheres and hit distances).
+// Building with RAYTRACE_FLOAT (see CMakeLists.txt) makes it float, which fits twice as many values in a SIMD register and halves the memory they take.
+// Sums over many samples (the color_sum of each pixel's samples, also kept by the adaptive sampler and in checkpoints) and the scene files stay double either way.
+#ifdef RAYTRACE_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,478 @@
+// Re-issuing the work of stragglers is the backup tasks of "MapReduce: Simplified Data Processing on Large Clusters" (Dean and Ghemawat, 2004)
+
+#ifndef render_coordinator_hpp
+#define render_coordinator_hpp
+
+#include "scene.hpp"
+#include "framebuffer.hpp"
+#include "render_server.hpp"
+#include "tile_scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Width and height in pixels of the tiles a distributed render hands out.
+// A multiple of TILE_SIZE and WAVEFRONT_PACKET_SIZE, so the workers split them into the same tiles and packets as a render on one machine.
+#define DISTRIBUTED_TILE_SIZE 64
+// A tile is handed to an idle worker as well once it has taken this many times longer than the average tile
+#define STRAGGLER_FACTOR 2
+// Longest wait in milliseconds for a started worker process to listen on its socket
+#define WORKER_START_MS 10000
+
+// What one worker did during a distributed render
+struct worker_report
+{
+    std::string socket_path;
+    // Tiles it finished first, and tiles it was handed that another worker had already started (the work of a straggler)
+    int tiles = 0;
+    int reissued = 0;
+    // Tiles it finished after another worker already had
+    int wasted = 0;
+    // Rays it traced and the time spent waiting for its tiles, including wasted ones
+    uint64_t rays = 0;
+    double busy_seconds = 0;
+    // Whether its connection failed, its unfinished tile was then handed to another worker
+    bool lost = false;
+};
+
+// Renders a scene by handing its tiles to render servers (see render_server.hpp) and putting together the pixels they send back.
+// Every pixel is seeded from SEED and its position, so the image is exactly the same as a render of the whole image in one process.
+// Each worker has one connection and one tile at a time, so faster workers take more tiles.
+// Once every tile has been handed out, an idle worker also takes a tile that is running long (such as on a slow or stuck worker),
+// and whichever copy finishes first is used. A worker whose connection fails has its tile handed to another.
+class render_coordinator
+{
+public:
+    explicit render_coordinator(const std::vector<std::string> &socket_paths) : socket_paths(socket_paths)
+    {
+        if (socket_paths.empty())
+        {
+            throw std::runtime_error("A distributed render needs at least one worker");
+        }
+        // Throws if a path is too long
+        for (const std::string &path : socket_paths)
+            socket_io::address(path);
+    }
+
+    // Render the scene s, parsed from the input file text, into image. Throws std::runtime_error if every worker is lost or one gives an error.
+    void render(const std::string &text, const scene &s, framebuffer &image)
+    {
+        if (s.settings.adaptive.enabled || s.settings.progressive.enabled)
+        {
+            throw std::runtime_error("ADAPTIVE and PROGRESSIVE scenes can not be rendered in tiles");
+        }
+        // The denoiser needs the first-hit buffers of the whole image, which the workers do not send
+        if (s.settings.denoise || !s.settings.aov_prefix.empty())
+        {
+            throw std::runtime_error("DENOISE scenes can not be rendered in tiles");
+        }
+        scene_text = &text;
+        scene_hash = fnv1a(text);
+        output = &image;
+        show_progress = s.settings.show_progress;
+
+        jobs.clear();
+        for (int y = 0; y < s.settings.image_height; y += DISTRIBUTED_TILE_SIZE)
+        {
+            for (int x = 0; x < s.settings.image_width; x += DISTRIBUTED_TILE_SIZE)
+            {
+                job added;
+                added.region = {(int)jobs.size(), x, y, std::min(x + DISTRIBUTED_TILE_SIZE, s.settings.image_width),
+                                std::min(y + DISTRIBUTED_TILE_SIZE, s.settings.image_height)};
+                jobs.push_back(added);
+            }
+        }
+        retry.clear();
+        next_job = 0;
+        jobs_done = 0;
+        tile_seconds = 0;
+        workers_left = (int)socket_paths.size();
+        finished = false;
+        error.clear();
+        reports.assign(socket_paths.size(), worker_report());
+        fds.assign(socket_paths.size(), -1);
+
+        start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < socket_paths.size(); w++)
+        {
+            reports[w].socket_path = socket_paths[w];
+            threads.push_back(std::thread([this, w]() { work(w); }));
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(jobs_lock);
+            changed.wait(lock, [this]() { return finished; });
+            // Workers still rendering a tile that is already done (stragglers) stop waiting for it
+            for (int fd : fds)
+            {
+                if (fd >= 0)
+                    shutdown(fd, SHUT_RDWR);
+            }
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (!error.empty())
+        {
+            throw std::runtime_error(error);
+        }
+    }
+
+    const std::vector<worker_report> &worker_reports() const { return reports; }
+
+    // Lines of what each worker did, with its rays/sec
+    void write_report(std::ostream &out) const
+    {
+        uint64_t rays = 0;
+        for (const worker_report &report : reports)
+        {
+            rays += report.rays;
+            out << "Worker " << report.socket_path << ": " << report.tiles << " tiles, " << report.rays << " rays in "
+                << report.busy_seconds << " s, " << (report.busy_seconds > 0 ? report.rays / report.busy_seconds : 0) << " rays/sec";
+            if (report.reissued > 0)
+                out << ", " << report.reissued << " tiles of stragglers";
+            if (report.wasted > 0)
+                out << ", " << report.wasted << " tiles finished too late";
+            if (report.lost)
+                out << ", lost";
+            out << "\n";
+        }
+        out << "Distributed render of " << jobs.size() << " tiles on " << reports.size() << " workers took " << elapsed_seconds << " s, "
+            << rays / std::max(1e-9, elapsed_seconds) << " rays/sec" << std::endl;
+    }
+
+private:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    // A tile to hand out, and the copies of it being rendered
+    struct job
+    {
+        tile region;
+        bool done = false;
+        int running = 0;
+        // When the last copy was handed out
+        time_point started;
+    };
+
+    // Hand tiles to worker w over its own connection until every tile is done
+    void work(size_t w)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = socket_io::address(socket_paths[w]);
+        if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            lose_worker(w, -1);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(jobs_lock);
+            fds[w] = fd;
+        }
+
+        // The scene is only sent with the first tile, later tiles name it by its hash
+        bool scene_sent = false;
+        int j;
+        while (next_tile(w, j))
+        {
+            const tile &t = jobs[j].region;
+            std::string header = "TILE bytes=" + std::to_string(scene_sent ? 0 : scene_text->size()) + " scene=" + std::to_string(scene_hash) +
+                                 " x0=" + std::to_string(t.x0) + " y0=" + std::to_string(t.y0) +
+                                 " x1=" + std::to_string(t.x1) + " y1=" + std::to_string(t.y1) + "\n";
+            time_point tile_start = std::chrono::steady_clock::now();
+            std::string status;
+            std::vector<unsigned char> reply;
+            bool ok = socket_io::write_all(fd, header) && (scene_sent || socket_io::write_all(fd, *scene_text)) &&
+                      socket_io::read_line(fd, status);
+            if (ok && status.compare(0, 3, "OK ") == 0)
+            {
+                reply.resize(std::stoull(status.substr(3)));
+                ok = socket_io::read_exact(fd, reply.data(), reply.size());
+            }
+            // A server that is busy with other clients turns the connection away
+            if (!ok || status == "ERROR server busy")
+            {
+                lose_worker(w, j);
+                break;
+            }
+            if (status == "ERROR Scene not loaded" && scene_sent)
+            {
+                // The server dropped the scene from its cache, send it again
+                scene_sent = false;
+                give_back(j);
+                continue;
+            }
+            if (status.compare(0, 3, "OK ") != 0)
+            {
+                fail(status.compare(0, 6, "ERROR ") == 0 ? status.substr(6) : status);
+                break;
+            }
+            scene_sent = true;
+
+            size_t pixels = (size_t)(t.x1 - t.x0) * (t.y1 - t.y0);
+            if (reply.size() != sizeof(uint64_t) + pixels * sizeof(color))
+            {
+                fail("Worker " + socket_paths[w] + " sent a tile of the wrong size, it may be built with another precision");
+                break;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+            finish_tile(w, j, reply, seconds);
+        }
+
+        std::lock_guard<std::mutex> lock(jobs_lock);
+        fds[w] = -1;
+        close(fd);
+    }
+
+    // The next tile for worker w: a tile no one has started, or a lost worker's tile, or else the tile running longest if it is a straggler.
+    // Waits while no tile is ready to hand out, returns false once every tile is done.
+    bool next_tile(size_t w, int &j)
+    {
+        std::unique_lock<std::mutex> lock(jobs_lock);
+        while (!finished)
+        {
+            time_point now = std::chrono::steady_clock::now();
+            if (!retry.empty() || next_job < jobs.size())
+            {
+                if (!retry.empty())
+                {
+                    j = retry.front();
+                    retry.erase(retry.begin());
+                }
+                else
+                {
+                    j = (int)next_job++;
+                }
+                jobs[j].running++;
+                jobs[j].started = now;
+                return true;
+            }
+
+            int longest = -1;
+            for (size_t k = 0; k < jobs.size(); k++)
+            {
+                if (!jobs[k].done && (longest < 0 || jobs[k].started < jobs[longest].started))
+                    longest = (int)k;
+            }
+            if (longest >= 0 && jobs_done > 0)
+            {
+                double average = tile_seconds / jobs_done;
+                double running = std::chrono::duration<double>(now - jobs[longest].started).count();
+                if (running > STRAGGLER_FACTOR * average)
+                {
+                    j = longest;
+                    jobs[j].running++;
+                    jobs[j].started = now;
+                    reports[w].reissued++;
+                    return true;
+                }
+                // Check again when it would become a straggler, unless a tile finishes first
+                changed.wait_for(lock, std::chrono::duration<double>(STRAGGLER_FACTOR * average - running + 0.001));
+                continue;
+            }
+            changed.wait(lock);
+        }
+        return false;
+    }
+
+    void finish_tile(size_t w, int j, const std::vector<unsigned char> &reply, double seconds)
+    {
+        std::lock_guard<std::mutex> lock(jobs_lock);
+        worker_report &report = reports[w];
+        uint64_t rays;
+        std::memcpy(&rays, reply.data(), sizeof(rays));
+        report.rays += rays;
+        report.busy_seconds += seconds;
+        jobs[j].running--;
+        if (jobs[j].done)
+        {
+            report.wasted++;
+            return;
+        }
+
+        const tile &t = jobs[j].region;
+        const unsigned char *pixels = reply.data() + sizeof(rays);
+        size_t row_bytes = (size_t)(t.x1 - t.x0) * sizeof(color);
+        for (int y = t.y0; y < t.y1; y++)
+        {
+            std::memcpy(&output->at(t.x0, y), pixels + (y - t.y0) * row_bytes, row_bytes);
+        }
+        jobs[j].done = true;
+        jobs_done++;
+        tile_seconds += seconds;
+        report.tiles++;
+        if (show_progress)
+            std::cerr << "\rDistributed tile " << jobs_done << " out of " << jobs.size() << std::flush;
+        if (jobs_done == jobs.size())
+            finished = true;
+        changed.notify_all();
+    }
+
+    // Hand tile j out again, such as when the server had to be sent the scene again
+    void give_back(int j)
+    {
+        std::lock_guard<std::mutex> lock(jobs_lock);
+        jobs[j].running--;
+        if (!jobs[j].done && jobs[j].running == 0)
+            retry.insert(retry.begin(), j);
+        changed.notify_all();
+    }
+
+    // Worker w's connection failed while rendering tile j (-1 for none), someone else takes the tile
+    void lose_worker(size_t w, int j)
+    {
+        std::lock_guard<std::mutex> lock(jobs_lock);
+        // Connections are shut down once the render is finished, that is not a lost worker
+        if (finished)
+            return;
+        reports[w].lost = true;
+        if (j >= 0)
+        {
+            jobs[j].running--;
+            if (!jobs[j].done && jobs[j].running == 0)
+                retry.push_back(j);
+        }
+        if (--workers_left == 0)
+        {
+            error = "Every worker was lost";
+            finished = true;
+        }
+        changed.notify_all();
+    }
+
+    void fail(const std::string &message)
+    {
+        std::lock_guard<std::mutex> lock(jobs_lock);
+        if (error.empty())
+            error = message;
+        finished = true;
+        changed.notify_all();
+    }
+
+    std::vector<std::string> socket_paths;
+    const std::string *scene_text = nullptr;
+    uint64_t scene_hash = 0;
+    framebuffer *output = nullptr;
+    bool show_progress = false;
+    time_point start;
+    double elapsed_seconds = 0;
+
+    std::mutex jobs_lock;
+    std::condition_variable changed;
+    std::vector<job> jobs;
+    // Tiles whose worker was lost, handed out before the tiles not yet started
+    std::vector<int> retry;
+    size_t next_job = 0;
+    size_t jobs_done = 0;
+    // Time taken by the finished tiles, for the average
+    double tile_seconds = 0;
+    int workers_left = 0;
+    bool finished = false;
+    std::string error;
+    std::vector<worker_report> reports;
+    // Each worker's connection, -1 when it has none
+    std::vector<int> fds;
+};
+
+// Render server processes started on this machine for a distributed render, running this same program.
+// Each renders one job at a time with an equal share of the cores. They are shut down when this goes.
+class local_workers
+{
+public:
+    // Start count servers with threads_each threads (0 shares the cores between them),
+    // throws std::runtime_error if one does not start listening within WORKER_START_MS
+    local_workers(int count, int threads_each)
+    {
+        if (threads_each < 1)
+            threads_each = std::max(1, (int)std::thread::hardware_concurrency() / count);
+        std::string threads = std::to_string(threads_each);
+        for (int k = 0; k < count; k++)
+        {
+            std::string path = "/tmp/raytrace-" + std::to_string(getpid()) + "-" + std::to_string(k) + ".sock";
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                // The worker has nothing to read from the input file or write to the image
+                int null_fd = open("/dev/null", O_RDWR);
+                dup2(null_fd, 0);
+                dup2(null_fd, 1);
+                execl("/proc/self/exe", "raytrace", "--server", path.c_str(), "--workers", "1", "--threads", threads.c_str(), (char *)nullptr);
+                _exit(127);
+            }
+            if (pid < 0)
+            {
+                stop();
+                throw std::runtime_error("Could not start a worker process");
+            }
+            paths.push_back(path);
+            pids.push_back(pid);
+        }
+
+        // Wait for every server to answer
+        for (const std::string &path : paths)
+        {
+            auto waited = std::chrono::steady_clock::now();
+            while (true)
+            {
+                try
+                {
+                    send_request(path, "STATS\n");
+                    break;
+                }
+                catch (const std::exception &)
+                {
+                }
+                if (std::chrono::steady_clock::now() - waited > std::chrono::milliseconds(WORKER_START_MS))
+                {
+                    stop();
+                    throw std::runtime_error("Worker " + path + " did not start");
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+    }
+
+    ~local_workers() { stop(); }
+
+    const std::vector<std::string> &socket_paths() const { return paths; }
+
+private:
+    void stop()
+    {
+        for (size_t k = 0; k < pids.size(); k++)
+        {
+            try
+            {
+                send_request(paths[k], "SHUTDOWN\n");
+            }
+            catch (const std::exception &)
+            {
+                kill(pids[k], SIGTERM);
+            }
+            waitpid(pids[k], nullptr, 0);
+        }
+        pids.clear();
+    }
+
+    std::vector<std::string> paths;
+    std::vector<pid_t> pids;
+};
+
+#endif
\ No newline at end of file
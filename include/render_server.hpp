@@ -0,0 +1,687 @@
+// Unix domain sockets are from https://man7.org/linux/man-pages/man7/unix.7.html
+
+#ifndef render_server_hpp
+#define render_server_hpp
+
+#include "scene.hpp"
+#include "binary_scene.hpp"
+#include "renderer.hpp"
+#include "framebuffer.hpp"
+#include "image_io.hpp"
+#include "ray_counter.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Default number of jobs rendered at the same time
+#define SERVER_WORKERS 2
+// Default number of connections that may wait for a worker, more than this are turned away as busy
+#define SERVER_QUEUE 16
+// Default number of parsed scenes kept loaded
+#define SERVER_CACHE 8
+// Default largest scene a request may send, in MiB
+#define SERVER_MAX_SCENE_MB 256
+
+// Settings of the render server
+struct server_settings
+{
+    std::string socket_path;
+    int workers = SERVER_WORKERS;
+    int queue_capacity = SERVER_QUEUE;
+    int cache_capacity = SERVER_CACHE;
+    // Requests claiming more scene bytes than this are turned away before anything is allocated for them
+    uint64_t max_scene_bytes = (uint64_t)SERVER_MAX_SCENE_MB << 20;
+
+    // Threads each job renders with, defaults to the cores shared between the workers
+    int threads_per_job = 0;
+};
+
+// Reading and writing whole messages on a socket
+namespace socket_io
+{
+    bool write_all(int fd, const void *data, size_t length)
+    {
+        const char *p = static_cast<const char *>(data);
+        while (length > 0)
+        {
+            // MSG_NOSIGNAL so that a client hanging up gives an error instead of killing the process with SIGPIPE
+            ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            p += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    bool write_all(int fd, const std::string &text)
+    {
+        return write_all(fd, text.data(), text.size());
+    }
+
+    bool read_exact(int fd, void *data, size_t length)
+    {
+        char *p = static_cast<char *>(data);
+        while (length > 0)
+        {
+            ssize_t n = recv(fd, p, length, 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // Read up to a newline (not included in line), returns false if the connection closed first or the line is too long
+    bool read_line(int fd, std::string &line, size_t max_length = 4096)
+    {
+        line.clear();
+        char c;
+        while (recv(fd, &c, 1, 0) == 1)
+        {
+            if (c == '\n')
+                return true;
+            if (line.size() >= max_length)
+                return false;
+            line += c;
+        }
+        return false;
+    }
+
+    // Socket address for path, throws std::runtime_error if the path does not fit
+    sockaddr_un address(const std::string &path)
+    {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            throw std::runtime_error("Socket path is too long " + path);
+        }
+        std::strcpy(addr.sun_path, path.c_str());
+        return addr;
+    }
+}
+
+// A render request, read from the header line "RENDER bytes=N [width=W] [samples=S] [seed=X] [format=F]"
+// followed by N bytes of scene file. The optional values override the scene's SETTINGS, SEED and FORMAT,
+// so renders of one scene at different sizes, sample counts or seeds all use the same loaded world.
+// A TILE request has the same words, and also x0=, y0=, x1= and y1= giving the pixels to render (see render_server::render_tile).
+// Either request can give scene=H with bytes=0 instead of the scene, H being the hash of a scene the server already has loaded.
+struct render_request
+{
+    size_t scene_bytes = 0;
+    int width = 0;
+    int samples = 0;
+    bool has_seed = false;
+    uint64_t seed = 0;
+    bool has_format = false;
+    image_format format = image_format::ppm;
+    tile region = {0, 0, 0, 0, 0};
+    bool has_scene_hash = false;
+    uint64_t scene_hash = 0;
+};
+
+// Parse the words after RENDER, throws std::runtime_error if one is invalid
+render_request parse_render_request(std::istringstream &words)
+{
+    render_request request;
+    bool has_bytes = false;
+    std::string word;
+    while (words >> word)
+    {
+        size_t equals = word.find('=');
+        if (equals == std::string::npos)
+        {
+            throw std::runtime_error("Invalid request argument " + word);
+        }
+        std::string key = word.substr(0, equals);
+        std::string value = word.substr(equals + 1);
+        if (key == "bytes")
+        {
+            request.scene_bytes = std::stoull(value);
+            has_bytes = true;
+        }
+        else if (key == "width")
+            request.width = std::stoi(value);
+        else if (key == "samples")
+            request.samples = std::stoi(value);
+        else if (key == "seed")
+        {
+            request.seed = std::stoull(value);
+            request.has_seed = true;
+        }
+        else if (key == "format")
+        {
+            if (!parse_image_format(value, request.format))
+            {
+                throw std::runtime_error("Invalid image format " + value);
+            }
+            request.has_format = true;
+        }
+        else if (key == "x0")
+            request.region.x0 = std::stoi(value);
+        else if (key == "y0")
+            request.region.y0 = std::stoi(value);
+        else if (key == "x1")
+            request.region.x1 = std::stoi(value);
+        else if (key == "y1")
+            request.region.y1 = std::stoi(value);
+        else if (key == "scene")
+        {
+            request.scene_hash = std::stoull(value);
+            request.has_scene_hash = true;
+        }
+        else
+        {
+            throw std::runtime_error("Invalid request argument " + word);
+        }
+    }
+    if (!has_bytes)
+    {
+        throw std::runtime_error("Render request has no scene bytes");
+    }
+    return request;
+}
+
+// Counters of the jobs the server has handled
+struct server_stats
+{
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> cache_hits{0};
+    std::atomic<uint64_t> cache_misses{0};
+    std::atomic<uint64_t> bytes_sent{0};
+
+    // Microseconds from a connection being accepted to its reply being sent, totalled over completed jobs
+    std::atomic<uint64_t> total_latency_us{0};
+    std::atomic<uint64_t> total_queue_us{0};
+    std::atomic<uint64_t> max_latency_us{0};
+
+    void add_latency(uint64_t latency_us, uint64_t queue_us)
+    {
+        total_latency_us += latency_us;
+        total_queue_us += queue_us;
+        uint64_t previous = max_latency_us.load();
+        while (latency_us > previous && !max_latency_us.compare_exchange_weak(previous, latency_us))
+        {
+        }
+    }
+};
+
+// Keeps scenes loaded and renders them for clients connecting to a Unix domain socket.
+// The acceptor thread puts connections on a bounded queue, a pool of workers takes them off and answers them.
+// Parsed scenes and their built worlds are kept in a cache keyed by the hash of the scene text, the least recently used going first.
+//
+// Each connection can send any number of requests, one after another:
+//     RENDER bytes=N [width=W] [samples=S] [seed=X] [format=F]\n followed by N bytes of scene file
+//     TILE bytes=N x0=X0 y0=Y0 x1=X1 y1=Y1 [width=W] [samples=S] [seed=X]\n followed by N bytes of scene file
+//     STATS\n
+//     SHUTDOWN\n
+// and each gets the reply "OK N\n" followed by N bytes (the image, or the statistics as text), or "ERROR message\n".
+class render_server
+{
+public:
+    explicit render_server(const server_settings &settings) : settings(settings)
+    {
+        if (this->settings.threads_per_job < 1)
+        {
+            int cores = std::max(1u, std::thread::hardware_concurrency());
+            this->settings.threads_per_job = std::max(1, cores / std::max(1, settings.workers));
+        }
+    }
+
+    // Listen on the socket and handle connections until a SHUTDOWN request, throws std::runtime_error if the socket can not be opened
+    void run()
+    {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0)
+        {
+            throw std::runtime_error("Could not create socket");
+        }
+        sockaddr_un addr = socket_io::address(settings.socket_path);
+        unlink(settings.socket_path.c_str());
+        if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, settings.queue_capacity) != 0)
+        {
+            close(listen_fd);
+            throw std::runtime_error("Could not listen on " + settings.socket_path);
+        }
+        started = std::chrono::steady_clock::now();
+        std::cerr << "Listening on " << settings.socket_path << " with " << settings.workers << " workers, "
+                  << settings.threads_per_job << " threads per job" << std::endl;
+
+        std::vector<std::thread> workers;
+        for (int w = 0; w < settings.workers; w++)
+        {
+            workers.push_back(std::thread([this]() { work(); }));
+        }
+
+        while (!stopping)
+        {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            if (stopping)
+            {
+                close(fd);
+                break;
+            }
+
+            std::unique_lock<std::mutex> lock(queue_lock);
+            if ((int)queue.size() >= settings.queue_capacity)
+            {
+                lock.unlock();
+                stats.rejected++;
+                socket_io::write_all(fd, "ERROR server busy\n");
+                close(fd);
+                continue;
+            }
+            queue.push_back({fd, std::chrono::steady_clock::now()});
+            lock.unlock();
+            queue_ready.notify_one();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queue_lock);
+            for (auto &waiting : queue)
+            {
+                close(waiting.fd);
+            }
+            queue.clear();
+            // Workers waiting for the next request of an open connection stop waiting, replies can still be sent
+            for (int fd : active)
+            {
+                shutdown(fd, SHUT_RD);
+            }
+        }
+        queue_ready.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        close(listen_fd);
+        unlink(settings.socket_path.c_str());
+    }
+
+    // The counters as "name value" lines
+    std::string stats_text() const
+    {
+        std::chrono::duration<double> uptime = std::chrono::steady_clock::now() - started;
+        uint64_t completed = stats.completed;
+        std::ostringstream out;
+        out << "accepted " << stats.accepted << "\n"
+            << "rejected " << stats.rejected << "\n"
+            << "completed " << completed << "\n"
+            << "failed " << stats.failed << "\n"
+            << "cache_hits " << stats.cache_hits << "\n"
+            << "cache_misses " << stats.cache_misses << "\n"
+            << "bytes_sent " << stats.bytes_sent << "\n"
+            << "mean_latency_ms " << (completed ? stats.total_latency_us / 1000.0 / completed : 0) << "\n"
+            << "mean_queue_ms " << (completed ? stats.total_queue_us / 1000.0 / completed : 0) << "\n"
+            << "max_latency_ms " << stats.max_latency_us / 1000.0 << "\n"
+            << "uptime_s " << uptime.count() << "\n"
+            << "jobs_per_s " << completed / std::max(1e-9, uptime.count()) << "\n";
+        return out.str();
+    }
+
+private:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    struct connection
+    {
+        int fd;
+        time_point accepted;
+    };
+
+    // A parsed scene and its built world, shared by every job rendering it
+    struct loaded_scene
+    {
+        scene parsed;
+        std::unique_ptr<scene_world> world;
+    };
+
+    static uint64_t microseconds(time_point from, time_point to)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    }
+
+    void work()
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(queue_lock);
+            queue_ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            connection c = queue.front();
+            queue.pop_front();
+            active.insert(c.fd);
+            lock.unlock();
+
+            serve(c);
+
+            lock.lock();
+            active.erase(c.fd);
+            lock.unlock();
+            close(c.fd);
+        }
+    }
+
+    // Answer the requests of one connection until it closes
+    void serve(const connection &c)
+    {
+        time_point request_start = c.accepted;
+        std::string line;
+        while (!stopping && socket_io::read_line(c.fd, line))
+        {
+            stats.accepted++;
+            time_point picked_up = std::chrono::steady_clock::now();
+            std::istringstream words(line);
+            std::string command;
+            words >> command;
+
+            std::vector<unsigned char> reply;
+            std::string error;
+            // Set until a request's scene bytes have been read. If they never are, what follows on the connection is not a request line,
+            // so it is closed after the error is sent.
+            bool unread_scene = false;
+            try
+            {
+                if (command == "RENDER" || command == "TILE")
+                {
+                    unread_scene = true;
+                    render_request request = parse_render_request(words);
+                    if (request.scene_bytes > settings.max_scene_bytes)
+                    {
+                        throw std::runtime_error("Scene of " + std::to_string(request.scene_bytes) + " bytes is larger than the server's limit of " +
+                                                 std::to_string(settings.max_scene_bytes));
+                    }
+                    std::string text(request.scene_bytes, '\0');
+                    if (request.scene_bytes > 0 && !socket_io::read_exact(c.fd, &text[0], text.size()))
+                    {
+                        stats.failed++;
+                        return;
+                    }
+                    unread_scene = false;
+                    reply = command == "RENDER" ? render(request, text) : render_tile(request, text);
+                }
+                else if (command == "STATS")
+                {
+                    std::string text = stats_text();
+                    reply.assign(text.begin(), text.end());
+                }
+                else if (command == "SHUTDOWN")
+                {
+                    stop();
+                }
+                else
+                {
+                    throw std::runtime_error("Invalid request " + command);
+                }
+            }
+            catch (const std::exception &e)
+            {
+                error = e.what();
+            }
+
+            bool sent;
+            if (error.empty())
+            {
+                std::string header = "OK " + std::to_string(reply.size()) + "\n";
+                sent = socket_io::write_all(c.fd, header) && (reply.empty() || socket_io::write_all(c.fd, reply.data(), reply.size()));
+                stats.bytes_sent += reply.size();
+            }
+            else
+            {
+                // The scene text may contain newlines, the reply must not
+                std::replace(error.begin(), error.end(), '\n', ' ');
+                sent = socket_io::write_all(c.fd, "ERROR " + error + "\n");
+            }
+
+            time_point done = std::chrono::steady_clock::now();
+            if (!error.empty() || !sent)
+            {
+                stats.failed++;
+            }
+            else
+            {
+                stats.completed++;
+                stats.add_latency(microseconds(request_start, done), microseconds(request_start, picked_up));
+            }
+            if (!sent || unread_scene)
+                return;
+            // Later requests on the same connection have no wait in the queue
+            request_start = done;
+        }
+    }
+
+    std::vector<unsigned char> render(const render_request &request, const std::string &text)
+    {
+        std::shared_ptr<loaded_scene> loaded = load(request, text);
+        render_settings settings = request_settings(request, *loaded);
+        framebuffer image(settings.image_width, settings.image_height);
+        loaded->world->render(loaded->parsed.cam, settings, image);
+        return encode_image(image, settings.format);
+    }
+
+    // Render the pixels of request.region. The reply is the number of rays traced (8 bytes),
+    // then the color of every pixel of the region in scanline order as 3 reals each, the same as the pixels of a render of the whole image.
+    std::vector<unsigned char> render_tile(const render_request &request, const std::string &text)
+    {
+        std::shared_ptr<loaded_scene> loaded = load(request, text);
+        render_settings settings = request_settings(request, *loaded);
+        const tile &region = request.region;
+        if (region.x0 < 0 || region.y0 < 0 || region.x1 > settings.image_width || region.y1 > settings.image_height ||
+            region.x0 >= region.x1 || region.y0 >= region.y1)
+        {
+            throw std::runtime_error("Invalid tile");
+        }
+        // Adaptive sampling spreads one budget over the whole image, and progressive renders are checkpointed as a whole
+        if (settings.adaptive.enabled || loaded->parsed.settings.progressive.enabled)
+        {
+            throw std::runtime_error("ADAPTIVE and PROGRESSIVE scenes can not be rendered in tiles");
+        }
+        settings.region = region;
+        settings.integrator.lights = loaded->world->light_spheres();
+
+        framebuffer image(region.x1 - region.x0, region.y1 - region.y0, region.x0, region.y0);
+        // Counted for this job alone, as other jobs may be rendering at the same time
+        ray_counter counter;
+        counted_render renderer{loaded->parsed.cam, settings, image, counter};
+        loaded->world->with_world(renderer);
+        uint64_t rays = counter.rays();
+
+        size_t pixel_bytes = (size_t)image.width() * image.height() * sizeof(color);
+        std::vector<unsigned char> reply(sizeof(rays) + pixel_bytes);
+        std::memcpy(reply.data(), &rays, sizeof(rays));
+        std::memcpy(reply.data() + sizeof(rays), image.data(), pixel_bytes);
+        return reply;
+    }
+
+    // The scene's settings with those given by request
+    render_settings request_settings(const render_request &request, const loaded_scene &loaded)
+    {
+        render_settings settings = loaded.parsed.settings;
+        if (request.width > 0)
+        {
+            settings.image_width = request.width;
+            settings.image_height = (int)(request.width / loaded.parsed.aspect_ratio);
+        }
+        if (request.samples > 0)
+            settings.samples_p_pixel = request.samples;
+        if (request.has_seed)
+            settings.seed = request.seed;
+        if (request.has_format)
+            settings.format = request.format;
+        settings.num_threads = this->settings.threads_per_job;
+        settings.show_progress = false;
+        settings.heatmap_file.clear();
+        settings.progressive = progressive_settings();
+        if (settings.image_width < 1 || settings.image_height < 1 || settings.samples_p_pixel < 1)
+        {
+            throw std::runtime_error("Invalid image size or samples");
+        }
+        return settings;
+    }
+
+    // The scene of the request from the cache, parsing text and building its world if it is not there
+    std::shared_ptr<loaded_scene> load(const render_request &request, const std::string &text)
+    {
+        if (request.has_scene_hash && text.empty())
+        {
+            std::lock_guard<std::mutex> lock(cache_lock);
+            auto found = cache.find(request.scene_hash);
+            if (found == cache.end())
+            {
+                throw std::runtime_error("Scene not loaded");
+            }
+            stats.cache_hits++;
+            cache_order.remove(request.scene_hash);
+            cache_order.push_front(request.scene_hash);
+            return found->second;
+        }
+        return load(text);
+    }
+
+    // The scene of text from the cache, parsing it and building its world if it is not there
+    std::shared_ptr<loaded_scene> load(const std::string &text)
+    {
+        uint64_t key = fnv1a(text);
+        {
+            std::lock_guard<std::mutex> lock(cache_lock);
+            auto found = cache.find(key);
+            if (found != cache.end())
+            {
+                stats.cache_hits++;
+                // Move it to the front of the use order
+                cache_order.remove(key);
+                cache_order.push_front(key);
+                return found->second;
+            }
+        }
+        stats.cache_misses++;
+
+        // Parsed outside the lock so other jobs are not held up, two jobs missing on the same scene may both parse it
+        std::shared_ptr<loaded_scene> loaded(new loaded_scene());
+        // Binary scenes point into the text, so the scene keeps its own copy
+        std::shared_ptr<std::string> storage = std::make_shared<std::string>(text);
+        load_scene(storage->data(), storage->size(), storage, loaded->parsed);
+        loaded->world.reset(new scene_world(loaded->parsed, settings.threads_per_job, false));
+
+        std::lock_guard<std::mutex> lock(cache_lock);
+        if (cache.find(key) == cache.end())
+        {
+            cache[key] = loaded;
+            cache_order.push_front(key);
+            // Jobs still rendering an evicted scene keep it alive through their shared_ptr
+            while ((int)cache_order.size() > std::max(1, settings.cache_capacity))
+            {
+                cache.erase(cache_order.back());
+                cache_order.pop_back();
+            }
+        }
+        return loaded;
+    }
+
+    // Stop accepting connections, the acceptor is woken by connecting to it
+    void stop()
+    {
+        stopping = true;
+        queue_ready.notify_all();
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = socket_io::address(settings.socket_path);
+        connect(fd, (sockaddr *)&addr, sizeof(addr));
+        close(fd);
+    }
+
+    server_settings settings;
+    server_stats stats;
+    time_point started;
+    int listen_fd = -1;
+    std::atomic<bool> stopping{false};
+
+    std::mutex queue_lock;
+    std::condition_variable queue_ready;
+    std::deque<connection> queue;
+    std::set<int> active;
+
+    std::mutex cache_lock;
+    std::map<uint64_t, std::shared_ptr<loaded_scene>> cache;
+    std::list<uint64_t> cache_order;
+};
+
+// Send request (a header line and any scene bytes) to the server at socket_path and return the bytes of its reply.
+// Throws std::runtime_error if the server can not be reached or replies with an error.
+std::vector<unsigned char> send_request(const std::string &socket_path, const std::string &request)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = socket_io::address(socket_path);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error("Could not connect to " + socket_path);
+    }
+
+    std::string status;
+    std::vector<unsigned char> reply;
+    // A busy server replies and hangs up without reading the request, so read the reply even if sending failed
+    socket_io::write_all(fd, request);
+    bool ok = socket_io::read_line(fd, status);
+    if (ok && status.compare(0, 3, "OK ") == 0)
+    {
+        reply.resize(std::stoull(status.substr(3)));
+        ok = reply.empty() || socket_io::read_exact(fd, &reply[0], reply.size());
+    }
+    close(fd);
+
+    if (!ok)
+    {
+        throw std::runtime_error("Connection to " + socket_path + " was lost");
+    }
+    if (status.compare(0, 3, "OK ") != 0)
+    {
+        throw std::runtime_error(status.compare(0, 6, "ERROR ") == 0 ? status.substr(6) : status);
+    }
+    return reply;
+}
+
+// Have the server at socket_path render the scene text and return the image file, the scene_bytes of request are taken from text
+std::vector<unsigned char> request_render(const std::string &socket_path, const std::string &text, const render_request &request)
+{
+    std::string header = "RENDER bytes=" + std::to_string(text.size());
+    if (request.width > 0)
+        header += " width=" + std::to_string(request.width);
+    if (request.samples > 0)
+        header += " samples=" + std::to_string(request.samples);
+    if (request.has_seed)
+        header += " seed=" + std::to_string(request.seed);
+    if (request.has_format)
+    {
+        const char *names[] = {"ppm_ascii", "ppm", "pfm", "png"};
+        header += std::string(" format=") + names[(int)request.format];
+    }
+    return send_request(socket_path, header + "\n" + text);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,281 @@
+// The trace file format is from https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+
+#ifndef render_stats_hpp
+#define render_stats_hpp
+
+#include "material.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Hits are counted by material type for types below this, any other type counts as type 0
+#define STATS_MATERIAL_SLOTS 16
+// Paths are counted by their number of bounces up to this, longer paths count in the last slot
+#define STATS_PATH_LENGTHS 64
+
+// Why a path stopped being followed
+enum class path_end
+{
+    escaped,   // Flew off into the background
+    emitted,   // Hit a light
+    absorbed,  // Hit a material that did not scatter it, or its throughput became 0
+    roulette,  // Ended by Russian roulette
+    max_depth, // Scattered MAX_DEPTH times
+    count
+};
+
+// Time one tile took to render, in microseconds since the statistics were reset
+struct tile_timing
+{
+    int index;
+    int x0, y0, x1, y1;
+    double start_us;
+    double end_us;
+};
+
+// Time one phase of the program (such as parsing) took
+struct phase_timing
+{
+    std::string name;
+    double start_us;
+    double end_us;
+};
+
+// Counters of one thread. Only the thread itself writes them, so counting needs no locks or atomics.
+struct thread_stats
+{
+    // Rays traced to find what they hit (camera and bounce rays), and shadow rays traced towards lights
+    uint64_t rays = 0;
+    uint64_t shadow_rays = 0;
+    // Ray-sphere tests, and BVH nodes whose box was tested
+    uint64_t sphere_tests = 0;
+    uint64_t node_visits = 0;
+    uint64_t material_hits[STATS_MATERIAL_SLOTS] = {};
+    uint64_t path_lengths[STATS_PATH_LENGTHS] = {};
+    uint64_t path_ends[(int)path_end::count] = {};
+    std::vector<tile_timing> tiles;
+
+    // Types past the slots are counted in slot 0
+    void material_hit(uint32_t type)
+    {
+        material_hits[type < STATS_MATERIAL_SLOTS ? type : 0]++;
+    }
+
+    void end_path(path_end reason, int bounces)
+    {
+        path_ends[(int)reason]++;
+        path_lengths[bounces < STATS_PATH_LENGTHS ? bounces : STATS_PATH_LENGTHS - 1]++;
+    }
+
+    void add(const thread_stats &other)
+    {
+        rays += other.rays;
+        shadow_rays += other.shadow_rays;
+        sphere_tests += other.sphere_tests;
+        node_visits += other.node_visits;
+        for (int k = 0; k < STATS_MATERIAL_SLOTS; k++)
+            material_hits[k] += other.material_hits[k];
+        for (int k = 0; k < STATS_PATH_LENGTHS; k++)
+            path_lengths[k] += other.path_lengths[k];
+        for (int k = 0; k < (int)path_end::count; k++)
+            path_ends[k] += other.path_ends[k];
+    }
+};
+
+// Statistics of the renders since the last reset, gathered from the counters of every thread that took part.
+// Counting is compiled in with RAYTRACE_STATS (see the STATS_ macros below), otherwise nothing is counted and it costs nothing.
+// Renders running at the same time (such as in the render server) are counted together.
+class render_stats
+{
+public:
+    static render_stats &global()
+    {
+        static render_stats stats;
+        return stats;
+    }
+
+    // The counters of the calling thread
+    thread_stats &local()
+    {
+        thread_local thread_stats *block = nullptr;
+        thread_local uint64_t block_generation = 0;
+        if (block == nullptr || block_generation != generation.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            threads.push_back(std::unique_ptr<thread_stats>(new thread_stats()));
+            block = threads.back().get();
+            block_generation = generation;
+        }
+        return *block;
+    }
+
+    // Forget everything counted so far. Must not be called while rendering.
+    void reset()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        threads.clear();
+        phases.clear();
+        generation++;
+        start = std::chrono::steady_clock::now();
+    }
+
+    double microseconds(std::chrono::steady_clock::time_point time) const
+    {
+        return std::chrono::duration<double, std::micro>(time - start).count();
+    }
+
+    void add_phase(const std::string &name, std::chrono::steady_clock::time_point phase_start, std::chrono::steady_clock::time_point phase_end)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        phases.push_back({name, microseconds(phase_start), microseconds(phase_end)});
+    }
+
+    // Counters of all threads added up
+    thread_stats total()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        thread_stats sum;
+        for (const auto &block : threads)
+            sum.add(*block);
+        return sum;
+    }
+
+    // Human readable summary of the counters and phase times
+    void write_summary(std::ostream &out)
+    {
+        thread_stats sum = total();
+        std::lock_guard<std::mutex> guard(lock);
+        out << "Render statistics:\n  Phases:";
+        for (const phase_timing &phase : phases)
+            out << " " << phase.name << " " << (phase.end_us - phase.start_us) / 1000 << " ms";
+        out << "\n  Rays: " << sum.rays << ", shadow rays: " << sum.shadow_rays
+            << "\n  Intersection tests: " << sum.sphere_tests << " spheres, " << sum.node_visits << " BVH nodes"
+            << "\n  Hits:";
+        for (int type = 0; type < STATS_MATERIAL_SLOTS; type++)
+        {
+            if (sum.material_hits[type] == 0)
+                continue;
+            const material_info *info = find_material_info(type);
+            out << " " << (info ? info->keyword : "other") << " " << sum.material_hits[type];
+        }
+
+        uint64_t paths = 0;
+        for (uint64_t count : sum.path_ends)
+            paths += count;
+        const char *end_names[] = {"escaped to the background", "hit a light", "absorbed", "ended by roulette", "reached MAX_DEPTH"};
+        out << "\n  Paths: " << paths;
+        for (int k = 0; k < (int)path_end::count; k++)
+            out << ", " << sum.path_ends[k] << " " << end_names[k];
+
+        out << "\n  Path lengths (bounces: paths):";
+        int longest = 0;
+        for (int k = 0; k < STATS_PATH_LENGTHS; k++)
+        {
+            if (sum.path_lengths[k] > 0)
+                longest = k;
+        }
+        for (int k = 0; k <= longest; k++)
+            out << " " << k << (k == STATS_PATH_LENGTHS - 1 ? "+" : "") << ": " << sum.path_lengths[k];
+        out << std::endl;
+    }
+
+    // Chrome trace (chrome://tracing or https://ui.perfetto.dev) of the phases and of every tile, on a row per thread
+    void write_trace(std::ostream &out)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"phases\"}}";
+        char line[256];
+        for (const phase_timing &phase : phases)
+        {
+            std::snprintf(line, sizeof(line), ",\n{\"name\": \"%s\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": 1, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f}",
+                          phase.name.c_str(), phase.start_us, phase.end_us - phase.start_us);
+            out << line;
+        }
+        for (size_t thread = 0; thread < threads.size(); thread++)
+        {
+            if (threads[thread]->tiles.empty())
+                continue;
+            out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread + 1
+                << ", \"args\": {\"name\": \"render thread " << thread + 1 << "\"}}";
+            for (const tile_timing &t : threads[thread]->tiles)
+            {
+                std::snprintf(line, sizeof(line),
+                              ",\n{\"name\": \"tile %d\", \"cat\": \"tile\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                              "\"args\": {\"x0\": %d, \"y0\": %d, \"x1\": %d, \"y1\": %d}}",
+                              t.index, (int)thread + 1, t.start_us, t.end_us - t.start_us, t.x0, t.y0, t.x1, t.y1);
+                out << line;
+            }
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    render_stats() : generation(1), start(std::chrono::steady_clock::now()) {}
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<thread_stats>> threads;
+    std::vector<phase_timing> phases;
+    // Bumped by reset, so threads know their counters were dropped and start new ones
+    std::atomic<uint64_t> generation;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Records the time from its construction to stop() as a phase
+class phase_timer
+{
+public:
+    explicit phase_timer(const char *name) : name(name), start(std::chrono::steady_clock::now()) {}
+
+    void stop()
+    {
+        render_stats::global().add_phase(name, start, std::chrono::steady_clock::now());
+    }
+
+private:
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Records the time a tile takes, from its construction to going out of scope
+template <typename Tile>
+class tile_timer
+{
+public:
+    explicit tile_timer(const Tile &t) : t(t), start(std::chrono::steady_clock::now()) {}
+
+    ~tile_timer()
+    {
+        render_stats &stats = render_stats::global();
+        stats.local().tiles.push_back({t.index, t.x0, t.y0, t.x1, t.y1, stats.microseconds(start), stats.microseconds(std::chrono::steady_clock::now())});
+    }
+
+private:
+    const Tile &t;
+    std::chrono::steady_clock::time_point start;
+};
+
+// The renderer counts through these, which compile to nothing without RAYTRACE_STATS
+#ifdef RAYTRACE_STATS
+#define STATS_COUNT(counter, n) (render_stats::global().local().counter += (n))
+#define STATS_MATERIAL_HIT(type) render_stats::global().local().material_hit((uint32_t)(type))
+#define STATS_PATH_END(reason, bounces) render_stats::global().local().end_path(reason, bounces)
+#define STATS_TILE(t) tile_timer<tile> stats_tile_timer(t)
+#define STATS_PHASE_BEGIN(name) phase_timer stats_phase_##name(#name)
+#define STATS_PHASE_END(name) stats_phase_##name.stop()
+#else
+#define STATS_COUNT(counter, n) ((void)0)
+#define STATS_MATERIAL_HIT(type) ((void)0)
+#define STATS_PATH_END(reason, bounces) ((void)0)
+#define STATS_TILE(t) ((void)0)
+#define STATS_PHASE_BEGIN(name) ((void)0)
+#define STATS_PHASE_END(name) ((void)0)
+#endif
+
+#endif
\ No newline at end of file
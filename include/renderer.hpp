@@ -0,0 +1,427 @@
+#ifndef renderer_hpp
+#define renderer_hpp
+
+#include "scene.hpp"
+#include "bvh.hpp"
+#include "sphere_soa.hpp"
+#include "framebuffer.hpp"
+#include "tile_scheduler.hpp"
+#include "adaptive_sampler.hpp"
+#include "progressive.hpp"
+#include "image_io.hpp"
+#include "wavefront.hpp"
+#include "render_stats.hpp"
+#include "aov.hpp"
+#include "denoiser.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Scenes with more objects than this use a BVH when ACCELERATION is AUTO
+#define SIMD_MAX_OBJECTS 64
+
+// Render with adaptive sampling, each pixel gets between adaptive.min_samples and adaptive.max_samples samples
+// The total is capped at the samples a uniform render with samples_p_pixel would take.
+template <typename World>
+void render_adaptive(const World &world, const camera &cam, const render_settings &settings, framebuffer &image)
+{
+    long long budget = (long long)settings.samples_p_pixel * settings.image_width * settings.image_height;
+    adaptive_sampler adaptive(settings.image_width, settings.image_height, settings.adaptive, budget, settings.seed);
+
+    adaptive.render(
+        settings.num_threads,
+        [&](int i, int j, int index, rng &gen) {
+            sampler pixel = settings.pixel_sampler(i, j, gen);
+            pixel.start_sample(index);
+            ray r = cam.get_sample_ray(i, j, settings.image_width, settings.image_height, pixel);
+            color sample = settings.integrator.trace(r, world, pixel);
+            gen = pixel.generator();
+            return sample;
+        },
+        [&](int round, size_t active_pixels) {
+            if (settings.show_progress)
+                std::cerr << "\rAdaptive sampling round " << round + 1 << ", " << active_pixels << " pixels to sample        " << std::flush;
+        });
+    adaptive.resolve(image);
+
+    if (settings.show_progress)
+    {
+        std::cerr << "\nAdaptive sampling took " << adaptive.total_samples() << " samples, "
+                  << adaptive.samples_per_pixel() << " samples/pixel on average" << std::endl;
+    }
+
+    if (!settings.heatmap_file.empty())
+    {
+        std::ofstream heatmap(settings.heatmap_file);
+        adaptive.write_heatmap(heatmap);
+    }
+}
+
+// Render in passes of progressive.pass_samples samples per pixel until every pixel has samples_p_pixel samples.
+// After each pass the samples so far are saved to the checkpoint file and the image so far to the preview file.
+// If the checkpoint file already exists, the render carries on from it.
+template <typename World>
+void render_progressive(const World &world, const camera &cam, const render_settings &settings, framebuffer &image)
+{
+    const progressive_settings &progressive = settings.progressive;
+    accumulation_buffer buffer(settings.image_width, settings.image_height, settings.seed);
+
+    if (!progressive.checkpoint_file.empty() && buffer.load(progressive.checkpoint_file, progressive.scene_hash))
+    {
+        if (settings.show_progress)
+            std::cerr << "Resuming from " << progressive.checkpoint_file << " at " << buffer.samples() << " samples/pixel" << std::endl;
+    }
+
+    while (buffer.samples() < settings.samples_p_pixel)
+    {
+        int samples = std::min(progressive.pass_samples, settings.samples_p_pixel - buffer.samples());
+        buffer.render_pass(settings.num_threads, samples, [&](int i, int j, int index, rng &gen) {
+            sampler pixel = settings.pixel_sampler(i, j, gen);
+            pixel.start_sample(index);
+            ray r = cam.get_sample_ray(i, j, settings.image_width, settings.image_height, pixel);
+            color sample = settings.integrator.trace(r, world, pixel);
+            gen = pixel.generator();
+            return sample;
+        });
+
+        if (!progressive.checkpoint_file.empty())
+        {
+            buffer.save(progressive.checkpoint_file, progressive.scene_hash);
+        }
+        if (!progressive.preview_file.empty())
+        {
+            buffer.resolve(image);
+            std::ofstream preview(progressive.preview_file, std::ios::binary | std::ios::trunc);
+            write_image(preview, image, settings.format);
+        }
+        if (settings.show_progress)
+        {
+            std::cerr << "\rProgressive pass done, " << buffer.samples() << " out of " << settings.samples_p_pixel << " samples/pixel" << std::flush;
+        }
+    }
+
+    buffer.resolve(image);
+}
+
+// Render the pixels of tile t into image (a framebuffer, or anything else with at(i, j)), following each sample on its own
+template <typename World, typename Image>
+void render_tile(const World &world, const camera &cam, const render_settings &settings, const tile &t, Image &image)
+{
+    for (int j = t.y0; j < t.y1; j++)
+    {
+        for (int i = t.x0; i < t.x1; ++i)
+        {
+            color_sum pixel_color;
+
+            // Every pixel has its own random sequence so that the image is the same whatever thread renders it
+            sampler gen = settings.pixel_sampler(i, j, rng(settings.seed, (uint64_t)j * settings.image_width + i));
+
+            // Shoot multiple samples for anti-aliasing
+            for (int sample = 0; sample < settings.samples_p_pixel; sample++)
+            {
+                // Summation of the samples
+                gen.start_sample(sample);
+                ray r = cam.get_sample_ray(i, j, settings.image_width, settings.image_height, gen);
+                pixel_color += settings.integrator.trace(r, world, gen);
+            }
+            // Get average of the samples for each pixel
+            image.at(i, j) = pixel_color.average(settings.samples_p_pixel);
+        }
+    }
+}
+
+// Render every pixel of the image on settings.num_threads threads
+template <typename World>
+void render(const World &world, const camera &cam, const render_settings &settings, framebuffer &image)
+{
+    if (settings.progressive.enabled)
+    {
+        render_progressive(world, cam, settings, image);
+        return;
+    }
+
+    if (settings.adaptive.enabled)
+    {
+        render_adaptive(world, cam, settings, image);
+        return;
+    }
+
+    if (settings.wavefront)
+    {
+        render_wavefront(world, cam, settings, image);
+        return;
+    }
+
+    tile_scheduler scheduler(settings.render_area());
+
+    // The world is only read while rendering, so every thread can share it
+    int tiles_done = 0;
+    std::mutex progress_lock;
+    scheduler.run(settings.num_threads, [&](const tile &t) {
+        render_tile(world, cam, settings, t, image);
+
+        if (settings.show_progress)
+        {
+            std::lock_guard<std::mutex> guard(progress_lock);
+            std::cerr << "\rRaytracing tile " << ++tiles_done << " out of " << scheduler.num_tiles() << std::flush;
+        }
+    });
+}
+
+// Traces the first-hit buffers of an image rendered by render, writes them out if settings.aov_prefix is set and denoises the image
+// if settings.denoise is set. Pass it to scene_world::with_world.
+struct denoise_pass
+{
+    const camera &cam;
+    const render_settings &settings;
+    framebuffer &image;
+
+    template <typename World>
+    void operator()(const World &world)
+    {
+        auto start = std::chrono::steady_clock::now();
+        STATS_PHASE_BEGIN(aov);
+        aov_buffers aovs(settings.image_width, settings.image_height);
+        render_aovs(world, cam, settings.image_width, settings.image_height, settings.seed, settings.num_threads, aovs);
+        STATS_PHASE_END(aov);
+        auto traced = std::chrono::steady_clock::now();
+
+        if (!settings.aov_prefix.empty())
+            aovs.write(settings.aov_prefix);
+        if (!settings.denoise)
+            return;
+
+        auto filter_start = std::chrono::steady_clock::now();
+        STATS_PHASE_BEGIN(denoise);
+        denoise(image, aovs, settings.num_threads);
+        STATS_PHASE_END(denoise);
+        auto end = std::chrono::steady_clock::now();
+
+        if (settings.show_progress)
+        {
+            std::chrono::duration<double, std::milli> tracing = traced - start, filtering = end - filter_start;
+            std::cerr << "\nDenoised in " << tracing.count() + filtering.count() << " ms (first-hit buffers " << tracing.count() << " ms, "
+                      << denoiser::kernel_name(denoiser::best_kernel()) << " filter " << filtering.count() << " ms)" << std::endl;
+        }
+    }
+};
+
+// The world of a scene, with the acceleration structure picked by its ACCELERATION setting built.
+// Building it once and rendering it many times (such as by the render server) saves rebuilding the BVH for every image.
+class scene_world
+{
+public:
+    scene_world(const scene &s, int num_threads, bool show_progress) : list(&s.world)
+    {
+        s.build_groups(num_threads);
+        if (show_progress && !s.groups.empty())
+        {
+            std::cerr << "The " << s.groups.size() << " groups' BVHs take " << (s.group_bytes() + 1023) / 1024 << " KiB" << std::endl;
+        }
+
+        const sphere_arrays &spheres = s.spheres;
+        acceleration = s.settings.acceleration;
+        // Testing every sphere with SIMD beats walking a BVH until there are a few dozen spheres
+        // Instances of GROUPs are not spheres, which the SIMD kernels can not test
+        if (acceleration == "AUTO")
+        {
+            acceleration = s.object_count() <= SIMD_MAX_OBJECTS && s.groups.empty() ? "SIMD" : "BVH";
+        }
+        else if (acceleration == "SIMD" && !s.groups.empty())
+        {
+            throw std::runtime_error("ACCELERATION SIMD can not be used with GROUP lines");
+        }
+
+        if (spheres.count > 0 && acceleration == "SIMD")
+        {
+            // The arrays of a binary scene are already laid out for the SIMD kernels
+            soa.reset(new sphere_soa_world(spheres.center_x, spheres.center_y, spheres.center_z, spheres.radius2,
+                                           spheres.mat_index, spheres.count, spheres.materials));
+        }
+        else if (spheres.count > 0)
+        {
+            // The BVH and the plain list test sphere objects, so make them from the arrays
+            owned_list.reset(new hittable_list(false));
+            for (size_t k = 0; k < spheres.count; k++)
+            {
+                point3 center(spheres.center_x[k], spheres.center_y[k], spheres.center_z[k]);
+                owned_list->add(arena.create<sphere>(center, spheres.radius[k], spheres.materials[spheres.mat_index[k]]));
+            }
+            list = owned_list.get();
+        }
+
+        if (acceleration == "BVH")
+        {
+            bvh.reset(new bvh_world(*list, num_threads));
+            const bvh_stats &stats = bvh->stats();
+            if (show_progress)
+            {
+                std::cerr << "BVH built in " << stats.build_ms << " ms: " << stats.nodes << " nodes, "
+                          << stats.leaves << " leaves, depth " << stats.depth << std::endl;
+            }
+        }
+        else if (acceleration == "SIMD")
+        {
+            if (!soa)
+                soa.reset(new sphere_soa_world(*list));
+            if (show_progress)
+            {
+                std::cerr << "Using " << sphere_soa_world::kernel_name(soa->get_kernel()) << " sphere kernel" << std::endl;
+            }
+        }
+
+        if (spheres.count > 0 && !owned_list)
+        {
+            for (size_t k = 0; k < spheres.count; k++)
+            {
+                const material *mat = spheres.materials[spheres.mat_index[k]];
+                if (mat->type == light_type)
+                {
+                    point3 center(spheres.center_x[k], spheres.center_y[k], spheres.center_z[k]);
+                    lights.push_back({center, std::fabs(spheres.radius[k]), mat});
+                }
+            }
+        }
+        else
+        {
+            path_integrator finder;
+            finder.find_lights(*list);
+            lights = finder.lights;
+        }
+    }
+
+    // Render into image, settings.integrator's lights are replaced by the lights of this world.
+    // The image is then denoised if settings.denoise is set (see denoise_pass).
+    void render(const camera &cam, render_settings settings, framebuffer &image) const
+    {
+        settings.integrator.lights = lights;
+        if (bvh)
+            ::render(*bvh, cam, settings, image);
+        else if (soa)
+            ::render(*soa, cam, settings, image);
+        else
+            ::render(*list, cam, settings, image);
+
+        if (settings.denoise || !settings.aov_prefix.empty())
+        {
+            denoise_pass pass{cam, settings, image};
+            with_world(pass);
+        }
+    }
+
+    // Calls fn with the world that was built, a bvh_world, sphere_soa_world or hittable_list
+    template <typename F>
+    void with_world(F &fn) const
+    {
+        if (bvh)
+            fn(*bvh);
+        else if (soa)
+            fn(*soa);
+        else
+            fn(*list);
+    }
+
+    // Light spheres of the world, for settings.integrator.lights
+    const std::vector<light_sphere> &light_spheres() const { return lights; }
+
+private:
+    const hittable_list *list;
+    // Sphere objects made from the arrays of a binary scene, when they are needed
+    scene_arena arena;
+    std::unique_ptr<hittable_list> owned_list;
+    std::string acceleration;
+    std::unique_ptr<bvh_world> bvh;
+    std::unique_ptr<sphere_soa_world> soa;
+    std::vector<light_sphere> lights;
+};
+
+// Render a parsed scene into image, building the world type picked by the ACCELERATION setting
+void render_scene(const scene &s, framebuffer &image)
+{
+    render_settings settings = s.settings;
+    settings.progressive.scene_hash = s.hash;
+
+    STATS_PHASE_BEGIN(build);
+    scene_world world(s, settings.num_threads, settings.show_progress);
+    STATS_PHASE_END(build);
+    STATS_PHASE_BEGIN(render);
+    world.render(s.cam, settings, image);
+    STATS_PHASE_END(render);
+}
+
+// File name of one frame of an animation, pattern with its last run of # replaced by the frame number padded with zeros,
+// such as frame_###.png giving frame_007.png for frame 7
+std::string frame_file_name(const std::string &pattern, int frame)
+{
+    size_t end = pattern.find_last_of('#');
+    if (end == std::string::npos)
+    {
+        throw std::runtime_error("Frame file name " + pattern + " has no # for the frame number");
+    }
+    size_t begin = end;
+    while (begin > 0 && pattern[begin - 1] == '#')
+        begin--;
+    std::string number = std::to_string(frame);
+    size_t digits = end + 1 - begin;
+    if (number.size() < digits)
+        number.insert(0, digits - number.size(), '0');
+    return pattern.substr(0, begin) + number + pattern.substr(end + 1);
+}
+
+// Render every frame of a parsed scene's camera path (or its one frame without a path) into files named by pattern (see frame_file_name).
+// The world and its acceleration structure are built once for all the frames.
+// Each frame is encoded and written on another thread while the next frame is traced, so the render threads never wait for the disk.
+void render_animation(const scene &s, const std::string &pattern)
+{
+    render_settings settings = s.settings;
+    settings.progressive.scene_hash = s.hash;
+
+    STATS_PHASE_BEGIN(build);
+    scene_world world(s, settings.num_threads, settings.show_progress);
+    STATS_PHASE_END(build);
+
+    // One image is traced into while the other one is being written
+    framebuffer images[2] = {framebuffer(settings.image_width, settings.image_height), framebuffer(settings.image_width, settings.image_height)};
+    std::future<void> writing;
+    for (int frame = s.first_frame(); frame <= s.last_frame(); frame++)
+    {
+        framebuffer &image = images[(frame - s.first_frame()) % 2];
+        std::string file = frame_file_name(pattern, frame);
+
+        // Each frame's first-hit buffers go to their own files when the prefix has a # for the frame number
+        render_settings frame_settings = settings;
+        if (settings.aov_prefix.find('#') != std::string::npos)
+            frame_settings.aov_prefix = frame_file_name(settings.aov_prefix, frame);
+
+        STATS_PHASE_BEGIN(render);
+        world.render(s.frame_camera(frame), frame_settings, image);
+        STATS_PHASE_END(render);
+
+        // The frame before must be written out before the next frame is traced into its image, get() throws the writer's error if it failed
+        if (writing.valid())
+            writing.get();
+        if (settings.show_progress)
+            std::cerr << "\nWriting frame " << frame << " to " << file << std::endl;
+        writing = std::async(std::launch::async, [&image, &settings, file]() {
+            STATS_PHASE_BEGIN(encode);
+            std::ofstream out(file, std::ios::binary | std::ios::trunc);
+            write_image(out, image, settings.format);
+            out.flush();
+            if (!out)
+            {
+                throw std::runtime_error("Could not write " + file);
+            }
+            STATS_PHASE_END(encode);
+        });
+    }
+    writing.get();
+}
+
+#endif
\ No newline at end of file
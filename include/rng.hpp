@@ -0,0 +1,87 @@
+// xoshiro256** and splitmix64 are from https://prng.di.unimi.it/
+
+#ifndef rng_hpp
+#define rng_hpp
+
+#include <cstdint>
+
+// Small, fast random number generator (xoshiro256**) used for all the randomness of a render.
+// Unlike rand(), it has no hidden global state. Every pixel gets its own generator seeded from the scene SEED and the pixel's position,
+// so threads never share a generator and the same seed always gives the same image.
+class rng
+{
+public:
+    rng() { seed(0); }
+    rng(uint64_t s) { seed(s); }
+
+    // Generator for one pixel of a render, so each pixel has an independent sequence whatever order pixels are rendered in
+    rng(uint64_t s, uint64_t pixel_index) { seed(s ^ splitmix64(pixel_index)); }
+
+    // Fill the state with splitmix64 so that similar seeds (such as 1, 2, 3) still give unrelated sequences
+    void seed(uint64_t s)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            s += 0x9e3779b97f4a7c15ULL;
+            state[i] = splitmix64(s);
+        }
+    }
+
+    uint64_t next()
+    {
+        const uint64_t result = rotl(state[1] * 5, 7) * 9;
+        const uint64_t t = state[1] << 17;
+
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+
+        return result;
+    }
+
+    // The generator's whole state, so that it can be saved (such as in a checkpoint) and continued later
+    void get_state(uint64_t out[4]) const
+    {
+        for (int i = 0; i < 4; i++)
+            out[i] = state[i];
+    }
+    void set_state(const uint64_t in[4])
+    {
+        for (int i = 0; i < 4; i++)
+            state[i] = in[i];
+    }
+
+    // Returns a random value between 0 <= r < 1
+    double next_double()
+    {
+        // The top 53 bits fill the mantissa of a double exactly
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Returns a random value between min <= r < max
+    double next_double(double min, double max)
+    {
+        return min + next_double() * (max - min);
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    static uint64_t splitmix64(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t state[4];
+};
+
+#endif
\ No newline at end of file
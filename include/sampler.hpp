@@ -0,0 +1,417 @@
+// Owen scrambling by hashing and the padded 2D Sobol sampler are from "Practical Hash-based Owen Scrambling" (Burley, 2020),
+// with the hash of https://psychopath.io/post/2021_01_30_building_a_better_lk_hash.
+// Stratification of any number of samples uses the permutation of "Correlated Multi-Jittered Sampling" (Kensler, 2013).
+// Blue-noise dithered sampling is from "Blue-noise Dithered Sampling" (Georgiev and Fajardo, 2016),
+// with the blue-noise mask made by the void-and-cluster method of "The void-and-cluster method for dither array generation" (Ulichney, 1993).
+
+#ifndef sampler_hpp
+#define sampler_hpp
+
+#include "rng.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Dimensions of each sample: the position within the pixel, then SAMPLER_BOUNCE_DIMENSIONS for every bounce of its path
+#define SAMPLER_PIXEL_DIMENSIONS 1
+// Dimensions of one bounce, at these offsets from its first: the material's scatter (which may use up to 2),
+// picking a light, the direction to the light and Russian roulette
+#define BOUNCE_SCATTER 0
+#define BOUNCE_LIGHT_PICK 2
+#define BOUNCE_LIGHT_DIRECTION 3
+#define BOUNCE_ROULETTE 4
+#define SAMPLER_BOUNCE_DIMENSIONS 5
+// Width and height of the tiled blue-noise mask
+#define BLUE_NOISE_SIZE 64
+// Spread of the gaussian the void-and-cluster method measures how crowded the mask is with, in pixels
+#define BLUE_NOISE_SIGMA 1.9
+
+// How a sampler picks the random numbers of a pixel's samples
+enum class sampler_type
+{
+    // Every number drawn from the pixel's generator
+    independent,
+    // The samples of every dimension spread over a grid of cells, one sample per cell, in a random order for each dimension
+    stratified,
+    // Owen-scrambled Sobol points, each pair of dimensions scrambled and shuffled differently (per pixel)
+    sobol,
+    // The same Owen-scrambled Sobol points for every pixel, shifted by a blue-noise mask, so neighbouring pixels' errors differ as much as they can
+    blue_noise,
+};
+
+// The sampler type written as name in an input file (INDEPENDENT, STRATIFIED, SOBOL or BLUE_NOISE), returns false if there is none
+bool parse_sampler_type(const std::string &name, sampler_type &type)
+{
+    if (name == "INDEPENDENT")
+        type = sampler_type::independent;
+    else if (name == "STRATIFIED")
+        type = sampler_type::stratified;
+    else if (name == "SOBOL")
+        type = sampler_type::sobol;
+    else if (name == "BLUE_NOISE")
+        type = sampler_type::blue_noise;
+    else
+        return false;
+    return true;
+}
+
+std::string sampler_name(sampler_type type)
+{
+    switch (type)
+    {
+    case sampler_type::independent:
+        return "INDEPENDENT";
+    case sampler_type::stratified:
+        return "STRATIFIED";
+    case sampler_type::sobol:
+        return "SOBOL";
+    case sampler_type::blue_noise:
+        return "BLUE_NOISE";
+    }
+    return "UNKNOWN";
+}
+
+// 64 bit hash of a and b (splitmix64's finalizer of their mix)
+uint64_t sampler_hash(uint64_t a, uint64_t b)
+{
+    uint64_t x = a ^ (b + 0x9e3779b97f4a7c15ULL + (a << 6) + (a >> 2));
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// The hash of Owen scrambling, on reversed bits: every bit of x is flipped or not depending on the bits below it, picked by seed
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return x;
+}
+
+// Owen scrambling of x: every bit is flipped or not depending on the bits above it, picked by seed.
+// Scrambling a Sobol point set this way keeps it stratified, while making it as random as independent points otherwise.
+uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Second dimension of the Sobol sequence, as a 32 bit fraction (the first is reverse_bits(index))
+uint32_t sobol_second(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+// reverse_bits(sobol_second(index)), from tables of each byte of index as the result is the xor of the bits' columns.
+// Owen scrambling works on the reversed bits, so keeping them reversed saves reversing them twice.
+uint32_t sobol_second_reversed(uint32_t index)
+{
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> columns(4 * 256);
+        for (int byte = 0; byte < 4; byte++)
+        {
+            for (uint32_t k = 0; k < 256; k++)
+                columns[byte * 256 + k] = reverse_bits(sobol_second(k << (8 * byte)));
+        }
+        return columns;
+    }();
+    return table[index & 0xff] ^ table[256 + ((index >> 8) & 0xff)] ^ table[512 + ((index >> 16) & 0xff)] ^ table[768 + (index >> 24)];
+}
+
+// Position of index in a random order of 0 to count - 1 picked by seed, without storing the order
+uint32_t permute(uint32_t index, uint32_t count, uint32_t seed)
+{
+    uint32_t w = count - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    // Values past count are hashed again until they land within it
+    do
+    {
+        index ^= seed;
+        index *= 0xe170893du;
+        index ^= seed >> 16;
+        index ^= (index & w) >> 4;
+        index ^= seed >> 8;
+        index *= 0x0929eb3fu;
+        index ^= seed >> 23;
+        index ^= (index & w) >> 1;
+        index *= 1 | seed >> 27;
+        index *= 0x6935fa69u;
+        index ^= (index & w) >> 11;
+        index *= 0x74dcb303u;
+        index ^= (index & w) >> 2;
+        index *= 0x9e501cc3u;
+        index ^= (index & w) >> 2;
+        index *= 0xc860a3dfu;
+        index &= w;
+        index ^= index >> 5;
+    } while (index >= count);
+    return (index + seed) % count;
+}
+
+// A 32 bit fraction as a double in [0, 1)
+double fraction(uint32_t x)
+{
+    return x * (1.0 / 4294967296.0);
+}
+
+// BLUE_NOISE_SIZE x BLUE_NOISE_SIZE values, each of (k + 0.5) / BLUE_NOISE_SIZE^2 once, arranged so that similar values are far apart
+// (as are the pixels above any threshold). Tiled over the image it gives each pixel an offset unlike its neighbours'.
+// Made by the void-and-cluster method the first time it is asked for, which takes a few tens of milliseconds.
+const std::vector<float> &blue_noise_mask()
+{
+    static const std::vector<float> mask = [] {
+        const int size = BLUE_NOISE_SIZE, count = size * size;
+        // Gaussian of the distance between two pixels, wrapping around the edges so the mask tiles
+        std::vector<double> kernel(count);
+        for (int y = 0; y < size; y++)
+        {
+            for (int x = 0; x < size; x++)
+            {
+                int dx = std::min(x, size - x), dy = std::min(y, size - y);
+                kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+            }
+        }
+
+        // energy is how crowded the pixels set in on are around each pixel, on has 1 for the pixels set so far
+        std::vector<char> on(count, 0);
+        std::vector<double> energy(count, 0);
+        auto set = [&](int k, bool value) {
+            on[k] = value;
+            int kx = k % size, ky = k / size;
+            double sign = value ? 1 : -1;
+            for (int y = 0; y < size; y++)
+            {
+                const double *row = &kernel[((y - ky + size) % size) * size];
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] += sign * row[(x - kx + size) % size];
+            }
+        };
+        // The pixel set in on (or not) that is the most (or least) crowded
+        auto extreme = [&](bool value, bool most) {
+            int best = -1;
+            for (int k = 0; k < count; k++)
+            {
+                if (on[k] == value && (best < 0 || (most ? energy[k] > energy[best] : energy[k] < energy[best])))
+                    best = k;
+            }
+            return best;
+        };
+
+        // Start from a tenth of the pixels set at random, then move the most crowded set pixel into the emptiest space until it stays put
+        rng gen(BLUE_NOISE_SIZE);
+        int initial = count / 10;
+        for (int placed = 0; placed < initial;)
+        {
+            int k = (int)(gen.next_double() * count);
+            if (!on[k])
+            {
+                set(k, true);
+                placed++;
+            }
+        }
+        for (;;)
+        {
+            int cluster = extreme(true, true);
+            set(cluster, false);
+            int space = extreme(false, false);
+            set(space, true);
+            if (space == cluster)
+                break;
+        }
+
+        // Rank the starting pixels by taking the most crowded away first, then the rest by filling the emptiest space first
+        std::vector<char> start = on;
+        std::vector<double> start_energy = energy;
+        std::vector<float> values(count);
+        for (int rank = initial - 1; rank >= 0; rank--)
+        {
+            int cluster = extreme(true, true);
+            set(cluster, false);
+            values[cluster] = (float)((rank + 0.5) / count);
+        }
+        on = start;
+        energy = start_energy;
+        for (int rank = initial; rank < count; rank++)
+        {
+            int space = extreme(false, false);
+            set(space, true);
+            values[space] = (float)((rank + 0.5) / count);
+        }
+        return values;
+    }();
+    return mask;
+}
+
+// The random numbers of one pixel's samples, given out one dimension at a time.
+// Each dimension is a separate stream of one or two numbers per sample, and every use of random numbers in a path has its own dimension
+// (see SAMPLER_BOUNCE_DIMENSIONS), so the numbers of the samples of a dimension are spread out by themselves, whatever the other dimensions do.
+// The independent sampler ignores the dimensions and draws the numbers from the pixel's generator in order.
+// The others work the numbers out from the sample index and dimension, which only uses the generator for INDEPENDENT.
+class sampler
+{
+public:
+    // Sampler for pixel (x, y) of a render taking samples_p_pixel samples per pixel, drawing from gen (copied) where it needs to
+    sampler(sampler_type type, uint64_t seed, int x, int y, int samples_p_pixel, const rng &gen)
+        : type(type), x(x), y(y), samples(samples_p_pixel > 0 ? samples_p_pixel : 1), gen(gen)
+    {
+        // Blue noise uses the same points in every pixel, the others scramble each pixel differently
+        pixel_seed = type == sampler_type::blue_noise ? sampler_hash(seed, 0) : sampler_hash(seed, ((uint64_t)(uint32_t)y << 32) | (uint32_t)x);
+        if (type == sampler_type::blue_noise)
+            mask = blue_noise_mask().data();
+        if (type == sampler_type::stratified)
+        {
+            grid_x = (int)std::sqrt((double)samples);
+            grid_y = (samples + grid_x - 1) / grid_x;
+        }
+    }
+
+    // Start the numbers of sample index of the pixel, from its first dimension
+    void start_sample(int index)
+    {
+        sample_index = (uint32_t)index;
+        next_dimension = 0;
+    }
+
+    // Give out the numbers of dimension next, such as bounce_dimension(depth, BOUNCE_ROULETTE)
+    void start_dimension(int next)
+    {
+        next_dimension = next;
+    }
+
+    // One number in [0, 1) from the next dimension
+    double get_1d()
+    {
+        uint32_t dimension = next_dimension++;
+        switch (type)
+        {
+        case sampler_type::independent:
+            break;
+        case sampler_type::stratified:
+        {
+            uint64_t seed = sampler_hash(pixel_seed, dimension);
+            return stratum(sample_index, samples, seed, sampler_hash(seed, sample_index));
+        }
+        case sampler_type::sobol:
+        case sampler_type::blue_noise:
+        {
+            // The first Sobol dimension is the reversed index, which Owen scrambling reverses back
+            uint64_t seed = sampler_hash(pixel_seed, dimension);
+            double u = fraction(reverse_bits(laine_karras_permutation(shuffled(seed), (uint32_t)(seed >> 32))));
+            return type == sampler_type::blue_noise ? shift(u, dimension, 0) : u;
+        }
+        }
+        return gen.next_double();
+    }
+
+    // Two numbers in [0, 1) from the next dimension
+    void get_2d(double &u, double &v)
+    {
+        uint32_t dimension = next_dimension++;
+        switch (type)
+        {
+        case sampler_type::independent:
+            break;
+        case sampler_type::stratified:
+        {
+            // The cells of a grid_x x grid_y grid in a random order, with a random point in each cell
+            uint64_t seed = sampler_hash(pixel_seed, dimension);
+            uint32_t round = sample_index / (grid_x * grid_y);
+            uint32_t cell = permute(sample_index % (grid_x * grid_y), grid_x * grid_y, (uint32_t)sampler_hash(seed, round));
+            uint64_t jitter = sampler_hash(seed, ~(uint64_t)sample_index);
+            u = (cell % grid_x + fraction((uint32_t)jitter)) / grid_x;
+            v = (cell / grid_x + fraction((uint32_t)(jitter >> 32))) / grid_y;
+            return;
+        }
+        case sampler_type::sobol:
+        case sampler_type::blue_noise:
+        {
+            uint64_t seed = sampler_hash(pixel_seed, dimension);
+            uint32_t index = shuffled(seed);
+            uint32_t scramble = (uint32_t)(seed >> 32);
+            u = fraction(reverse_bits(laine_karras_permutation(index, scramble)));
+            // A different scramble for the second number, mixed from the first's
+            v = fraction(reverse_bits(laine_karras_permutation(sobol_second_reversed(index), scramble * 0x9e3779b9u + 0x7f4a7c15u)));
+            if (type == sampler_type::blue_noise)
+            {
+                u = shift(u, dimension, 0);
+                v = shift(v, dimension, 1);
+            }
+            return;
+        }
+        }
+        // Drawn one at a time because the evaluation order of function arguments is unspecified
+        u = gen.next_double();
+        v = gen.next_double();
+    }
+
+    // The pixel's generator, where it is up to
+    const rng &generator() const { return gen; }
+
+private:
+    // Sample index in a different order for each dimension, so the dimensions' points are not lined up with each other
+    uint32_t shuffled(uint64_t seed) const
+    {
+        return owen_scramble(sample_index, (uint32_t)seed);
+    }
+
+    // The stratum of index among count, in an order picked by seed (a new order for every count samples), with a random point in it
+    static double stratum(uint32_t index, uint32_t count, uint64_t seed, uint64_t jitter)
+    {
+        uint32_t round = index / count;
+        uint32_t position = permute(index % count, count, (uint32_t)sampler_hash(seed, round));
+        return (position + fraction((uint32_t)jitter)) / count;
+    }
+
+    // value moved around [0, 1) by the pixel's blue-noise value, looked up at a place in the mask that depends on the dimension and axis
+    double shift(double value, uint32_t dimension, int axis) const
+    {
+        uint64_t offset = sampler_hash(dimension, axis);
+        int mx = (x + (int)(offset % BLUE_NOISE_SIZE)) % BLUE_NOISE_SIZE;
+        int my = (y + (int)((offset >> 32) % BLUE_NOISE_SIZE)) % BLUE_NOISE_SIZE;
+        value += mask[my * BLUE_NOISE_SIZE + mx];
+        return value >= 1 ? value - 1 : value;
+    }
+
+    sampler_type type;
+    int x;
+    int y;
+    uint32_t samples;
+    uint64_t pixel_seed;
+    uint32_t grid_x = 1;
+    uint32_t grid_y = 1;
+    const float *mask = nullptr;
+    uint32_t sample_index = 0;
+    uint32_t next_dimension = 0;
+    rng gen;
+};
+
+// The dimension at offset (such as BOUNCE_ROULETTE) of the bounce at depth
+int bounce_dimension(int depth, int offset)
+{
+    return SAMPLER_PIXEL_DIMENSIONS + depth * SAMPLER_BOUNCE_DIMENSIONS + offset;
+}
+
+#endif
\ No newline at end of file
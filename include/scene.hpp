@@ -0,0 +1,758 @@
+#ifndef scene_hpp
+#define scene_hpp
+
+#include "vec3.hpp"
+#include "color.hpp"
+#include "sphere.hpp"
+#include "hittable_list.hpp"
+#include "instance.hpp"
+#include "material.hpp"
+#include "material_pool.hpp"
+#include "scene_arena.hpp"
+#include "camera.hpp"
+#include "camera_path.hpp"
+#include "integrator.hpp"
+#include "adaptive_sampler.hpp"
+#include "image_io.hpp"
+#include "progressive.hpp"
+#include "sampler.hpp"
+#include "tile_scheduler.hpp"
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Everything needed to render the image, other than the world and camera
+struct render_settings
+{
+    int samples_p_pixel = 0;
+    int image_width = 0;
+    int image_height = 0;
+
+    // Follows each ray through the world, holds the background colours and depth limits
+    path_integrator integrator;
+
+    // Number of render threads, defaults to one per core
+    int num_threads = std::thread::hardware_concurrency();
+
+    // Seed for the random numbers, the same seed always gives the same image
+    uint64_t seed = 1;
+
+    // How the random numbers of each pixel's samples are picked (see sampler.hpp)
+    sampler_type sampling = sampler_type::sobol;
+
+    // How rays find the objects they hit, AUTO picks SIMD or BVH from the number of objects
+    std::string acceleration = "AUTO";
+
+    // Follow all the samples of a packet of pixels together, one bounce at a time (see wavefront.hpp)
+    bool wavefront = false;
+
+    // Only keep sampling noisy pixels, samples_p_pixel is then the average budget
+    adaptive_settings adaptive;
+
+    // Render in passes that can be checkpointed and resumed
+    progressive_settings progressive;
+
+    // File to write the adaptive sample count heatmap to, none if empty
+    std::string heatmap_file;
+
+    // Remove the noise from the finished image with the first-hit buffers (see denoiser.hpp)
+    bool denoise = false;
+
+    // Write the first-hit buffers to files starting with this (see aov_buffers::write), none if empty
+    std::string aov_prefix;
+
+    // File format of the image written to stdout
+    image_format format = image_format::ppm;
+
+    // Print progress to stderr while rendering
+    bool show_progress = true;
+
+    // Part of the image to render, such as a tile handed to a worker by a distributed render (see render_coordinator.hpp).
+    // Empty renders the whole image. Only renders without ADAPTIVE or PROGRESSIVE can be split up.
+    tile region = {0, 0, 0, 0, 0};
+
+    // The sampler of pixel (i, j), drawing from the pixel's generator gen where it needs to
+    sampler pixel_sampler(int i, int j, const rng &gen) const
+    {
+        return sampler(sampling, seed, i, j, samples_p_pixel, gen);
+    }
+
+    // The pixels to render, region or the whole image
+    tile render_area() const
+    {
+        if (region.x1 > region.x0 && region.y1 > region.y0)
+            return region;
+        return {0, 0, 0, image_width, image_height};
+    }
+};
+
+// Spheres kept in packed arrays (the layout of sphere_soa_world) rather than as sphere objects, such as those of a binary scene file.
+// The arrays are not owned, they point into scene::storage.
+struct sphere_arrays
+{
+    size_t count = 0;
+    const double *center_x = nullptr;
+    const double *center_y = nullptr;
+    const double *center_z = nullptr;
+    const double *radius = nullptr;
+    const double *radius2 = nullptr;
+    const int32_t *mat_index = nullptr;
+
+    // mat_index holds indices into this
+    std::vector<material *> materials;
+};
+
+// One SPHERE line of an input file, as it was read
+struct sphere_line
+{
+    point3 center;
+    double radius;
+    material_desc desc;
+    // The sphere's own material, not shared with any other SPHERE line
+    const material *mat;
+};
+
+// A scene read from an input file: the settings, the camera and the world with all its objects
+struct scene
+{
+    scene() : world(false), materials(arena) {}
+
+    // Owns the spheres and materials, freeing them all at once when the scene goes
+    scene_arena arena;
+
+    render_settings settings;
+    // The camera of the image, or of the first frame when there is a camera path
+    camera cam;
+    hittable_list world;
+
+    // Set by a CAMERA line, otherwise the camera is at the origin (see camera.hpp)
+    bool has_view = false;
+    camera_view view;
+    // Width over height of the image
+    double aspect_ratio = 16.0 / 9.0;
+
+    // Keyframes of the CAMERA_PATH lines, empty for a still image
+    camera_path path;
+
+    // The materials of the spheres, each distinct material only once
+    material_pool materials;
+
+    // Groups of the GROUP lines, placed in world (or in later groups) by INSTANCE lines
+    std::vector<std::unique_ptr<object_group>> groups;
+
+    // Spheres of a binary scene file, used instead of world (which is then empty)
+    sphere_arrays spheres;
+    // The memory the arrays point into (such as the mapped file)
+    std::shared_ptr<const void> storage;
+
+    // Every line of the input file other than SPHERE lines, with single spaces between the words, to write the scene back out
+    std::string settings_text;
+
+    // Hash of the input file's words, the same scene file always gives the same hash
+    uint64_t hash = 0;
+
+    // Set before parsing to give every SPHERE line its own material and keep the lines in sphere_lines, in the order of the file.
+    // A hit's material then tells which SPHERE line's sphere was hit, for incremental renders (see incremental.hpp).
+    bool record_sphere_lines = false;
+    std::vector<sphere_line> sphere_lines;
+    // With record_sphere_lines, hash of every line other than the numbers and materials of the SPHERE lines
+    uint64_t layout_hash = 0;
+
+    // Spheres and instances of the world
+    size_t object_count() const
+    {
+        return spheres.count > 0 ? spheres.count : world.objects().size();
+    }
+
+    // Spheres the world stands for with every instance expanded into copies of its group
+    uint64_t expanded_count() const
+    {
+        return spheres.count > 0 ? spheres.count : ::expanded_count(world);
+    }
+
+    // Build the BVHs of the groups that are not built yet, on num_threads threads.
+    // Parsing leaves them unbuilt, as THREADS, --threads or the render server may still change how many threads the scene is rendered with.
+    // The BVHs only speed up finding hits, so building them does not change the scene and is allowed on a const one.
+    void build_groups(int num_threads) const
+    {
+        for (const auto &group : groups)
+            group->build(num_threads);
+    }
+
+    // Memory of the groups' BVHs and object lists
+    size_t group_bytes() const
+    {
+        size_t bytes = 0;
+        for (const auto &group : groups)
+            bytes += group->memory_bytes();
+        return bytes;
+    }
+
+    // The camera of one frame of the animation
+    camera frame_camera(int frame) const
+    {
+        if (!path.empty())
+            return camera(path.view_at(frame), aspect_ratio);
+        if (has_view)
+            return camera(view, aspect_ratio);
+        return camera(aspect_ratio);
+    }
+
+    // The frames to render, the frames of the camera path or the one frame 0 without one
+    int first_frame() const { return path.empty() ? 0 : path.first_frame(); }
+    int last_frame() const { return path.empty() ? 0 : path.last_frame(); }
+};
+
+// 64 bit FNV-1a hash from http://www.isthe.com/chongo/tech/comp/fnv/, continuing from hash
+uint64_t fnv1a(const char *data, size_t length, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    for (size_t k = 0; k < length; k++)
+    {
+        hash ^= (unsigned char)data[k];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t fnv1a(const std::string &text, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    return fnv1a(text.data(), text.size(), hash);
+}
+
+// One word of an input file, pointing into the text being parsed
+struct scene_token
+{
+    const char *text;
+    size_t length;
+    int column;
+
+    bool is(const char *word) const
+    {
+        return std::strlen(word) == length && std::memcmp(text, word, length) == 0;
+    }
+
+    std::string str() const { return std::string(text, length); }
+};
+
+// Input file parser
+// Goes through the text once, line by line, without copying it. Words are split by spaces, tabs or commas.
+// Errors are thrown as std::runtime_error naming the line and column, such as "Line 3, column 20: Invalid number 0.5x".
+class scene_parser
+{
+public:
+    scene_parser(scene &s) : s(s) {}
+
+    void parse(const char *begin, const char *end)
+    {
+        s.hash = fnv1a("");
+        s.layout_hash = fnv1a("");
+        line_number = 0;
+        const char *p = begin;
+        while (p < end)
+        {
+            const char *line_end = static_cast<const char *>(std::memchr(p, '\n', end - p));
+            if (line_end == nullptr)
+                line_end = end;
+            line_number++;
+            split(p, line_end);
+            if (!tokens.empty())
+            {
+                parse_line();
+            }
+            p = line_end + 1;
+        }
+        if (group != nullptr)
+        {
+            error_at_end("GROUP " + group->name + " is not closed by END_GROUP");
+        }
+        // SETTINGS checks its samples/pixel, so this is only 0 when there was no SETTINGS line
+        if (s.settings.samples_p_pixel < 1)
+        {
+            error_at_end(s.has_view ? "SETTINGS samples/pixel image_width is required, CAMERA only replaces its width"
+                                    : "SETTINGS samples/pixel image_width is required");
+        }
+
+        // Image Properties
+        // A CAMERA line gives the image size, otherwise the height is worked out from the width of SETTINGS at 16:9
+        if (s.has_view)
+        {
+            s.settings.image_width = view_width;
+            s.settings.image_height = view_height;
+            s.aspect_ratio = (double)view_width / view_height;
+        }
+        else
+        {
+            s.settings.image_height = (int)(s.settings.image_width / s.aspect_ratio);
+        }
+
+        // Camera Properties
+        s.cam = s.frame_camera(s.first_frame());
+    }
+
+private:
+    void split(const char *p, const char *line_end)
+    {
+        tokens.clear();
+        line_begin = p;
+        line_length = (int)(line_end - p);
+        while (p < line_end)
+        {
+            while (p < line_end && is_separator(*p))
+                p++;
+            const char *start = p;
+            while (p < line_end && !is_separator(*p))
+                p++;
+            if (p > start)
+            {
+                tokens.push_back({start, (size_t)(p - start), (int)(start - line_begin) + 1});
+                s.hash = fnv1a(start, p - start, s.hash);
+                s.hash = fnv1a(" ", 1, s.hash);
+            }
+        }
+        s.hash = fnv1a("\n", 1, s.hash);
+    }
+
+    static bool is_separator(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == ',';
+    }
+
+    void parse_line()
+    {
+        render_settings &settings = s.settings;
+        const scene_token &type = tokens[0];
+
+        if (s.record_sphere_lines)
+        {
+            // A SPHERE line only counts as a SPHERE line, so edits to its numbers or material leave the layout the same
+            size_t words = type.is("SPHERE") ? 1 : tokens.size();
+            for (size_t k = 0; k < words; k++)
+            {
+                s.layout_hash = fnv1a(tokens[k].text, tokens[k].length, s.layout_hash);
+                s.layout_hash = fnv1a(" ", 1, s.layout_hash);
+            }
+            s.layout_hash = fnv1a("\n", 1, s.layout_hash);
+        }
+
+        if (type.is("SPHERE"))
+        {
+            parse_sphere();
+            return;
+        }
+        if (type.is("GROUP") || type.is("END_GROUP") || type.is("INSTANCE"))
+        {
+            parse_group_line();
+            return;
+        }
+
+        if (type.is("SETTINGS"))
+        {
+            arguments(2);
+            settings.samples_p_pixel = integer(1);
+            settings.image_width = integer(2);
+            if (settings.samples_p_pixel < 1)
+            {
+                error(tokens[1], "Invalid samples per pixel " + tokens[1].str());
+            }
+            // Without a CAMERA line the height is worked out from the width, which must leave at least one row
+            if ((int)(settings.image_width / s.aspect_ratio) < 1)
+            {
+                error(tokens[2], "Invalid image width " + tokens[2].str());
+            }
+        }
+        else if (type.is("BACKGROUND"))
+        {
+            arguments(6);
+            settings.integrator.background_top = color(number(1), number(2), number(3));
+            settings.integrator.background_bottom = color(number(4), number(5), number(6));
+        }
+        else if (type.is("MAX_DEPTH"))
+        {
+            arguments(1);
+            settings.integrator.max_depth = integer(1);
+            if (settings.integrator.max_depth < 0)
+            {
+                error(tokens[1], "Invalid max depth " + tokens[1].str());
+            }
+        }
+        else if (type.is("ROULETTE"))
+        {
+            arguments(1);
+            settings.integrator.roulette_depth = integer(1);
+            if (settings.integrator.roulette_depth < 0)
+            {
+                error(tokens[1], "Invalid roulette depth " + tokens[1].str());
+            }
+        }
+        else if (type.is("LIGHT_SAMPLING"))
+        {
+            arguments(1);
+            if (tokens[1].is("ON") || tokens[1].is("OFF"))
+            {
+                settings.integrator.light_sampling = tokens[1].is("ON");
+            }
+            else
+            {
+                error(tokens[1], "Invalid light sampling " + tokens[1].str());
+            }
+        }
+        else if (type.is("WAVEFRONT"))
+        {
+            arguments(1);
+            if (tokens[1].is("ON") || tokens[1].is("OFF"))
+            {
+                settings.wavefront = tokens[1].is("ON");
+            }
+            else
+            {
+                error(tokens[1], "Invalid wavefront setting " + tokens[1].str());
+            }
+        }
+        else if (type.is("DENOISE"))
+        {
+            arguments(1);
+            if (tokens[1].is("ON") || tokens[1].is("OFF"))
+            {
+                settings.denoise = tokens[1].is("ON");
+            }
+            else
+            {
+                error(tokens[1], "Invalid denoise setting " + tokens[1].str());
+            }
+        }
+        else if (type.is("FORMAT"))
+        {
+            arguments(1);
+            if (!parse_image_format(tokens[1].str(), settings.format))
+            {
+                error(tokens[1], "Invalid image format " + tokens[1].str());
+            }
+        }
+        else if (type.is("ADAPTIVE"))
+        {
+            arguments(3);
+            settings.adaptive.enabled = true;
+            settings.adaptive.min_samples = integer(1);
+            settings.adaptive.max_samples = integer(2);
+            settings.adaptive.target_error = number(3);
+            if (settings.adaptive.min_samples < 1)
+            {
+                error(tokens[1], "Invalid adaptive min samples " + tokens[1].str());
+            }
+            if (settings.adaptive.max_samples < settings.adaptive.min_samples)
+            {
+                error(tokens[2], "Invalid adaptive max samples " + tokens[2].str() + ", must be at least the min samples");
+            }
+            if (!(settings.adaptive.target_error > 0))
+            {
+                error(tokens[3], "Invalid adaptive target error " + tokens[3].str());
+            }
+        }
+        else if (type.is("PROGRESSIVE"))
+        {
+            arguments(1);
+            settings.progressive.enabled = true;
+            settings.progressive.pass_samples = integer(1);
+            if (settings.progressive.pass_samples < 1)
+            {
+                error(tokens[1], "Invalid progressive pass samples " + tokens[1].str());
+            }
+        }
+        else if (type.is("THREADS"))
+        {
+            arguments(1);
+            settings.num_threads = integer(1);
+        }
+        else if (type.is("SEED"))
+        {
+            arguments(1);
+            settings.seed = unsigned_integer(1);
+        }
+        else if (type.is("SAMPLER"))
+        {
+            arguments(1);
+            if (!parse_sampler_type(tokens[1].str(), settings.sampling))
+            {
+                error(tokens[1], "Invalid sampler " + tokens[1].str());
+            }
+        }
+        else if (type.is("CAMERA"))
+        {
+            arguments(9);
+            s.has_view = true;
+            s.view = view(1);
+            view_width = integer(8);
+            view_height = integer(9);
+            if (view_width < 1)
+            {
+                error(tokens[8], "Invalid image width " + tokens[8].str());
+            }
+            if (view_height < 1)
+            {
+                error(tokens[9], "Invalid image height " + tokens[9].str());
+            }
+        }
+        else if (type.is("CAMERA_PATH"))
+        {
+            arguments(8);
+            camera_keyframe keyframe;
+            keyframe.frame = integer(1);
+            if (keyframe.frame < 0 || (!s.path.empty() && keyframe.frame <= s.path.last_frame()))
+            {
+                error(tokens[1], "Invalid keyframe " + tokens[1].str() + ", keyframes must be in order from frame 0");
+            }
+            keyframe.view = view(2);
+            s.path.add(keyframe);
+        }
+        else if (type.is("ACCELERATION"))
+        {
+            arguments(1);
+            const scene_token &name = tokens[1];
+            if (name.is("AUTO") || name.is("BVH") || name.is("SIMD") || name.is("NONE"))
+            {
+                settings.acceleration = name.str();
+            }
+            else
+            {
+                error(name, "Invalid acceleration type " + name.str());
+            }
+        }
+        else
+        {
+            error(type, "Invalid line type " + type.str());
+        }
+
+        // Kept to write the scene back out, such as to a binary scene file
+        for (size_t k = 0; k < tokens.size(); k++)
+        {
+            s.settings_text.append(tokens[k].text, tokens[k].length);
+            s.settings_text += k + 1 < tokens.size() ? ' ' : '\n';
+        }
+    }
+
+    void parse_sphere()
+    {
+        if (tokens.size() < 6)
+        {
+            error_at_end("SPHERE needs a position, radius and material type");
+        }
+        point3 center(number(1), number(2), number(3));
+        double radius = number(4);
+        const scene_token &type = tokens[5];
+
+        const material_info *info = nullptr;
+        for (const material_info &candidate : material_infos)
+        {
+            if (type.is(candidate.keyword))
+                info = &candidate;
+        }
+        if (info == nullptr)
+        {
+            error(type, "Invalid material type " + type.str());
+        }
+        // The first three numbers are the color, a fourth is the fuzz
+        arguments(5 + info->parameters);
+        color c(number(6), number(7), number(8));
+        material_desc desc = make_material_desc(info->type, c, info->parameters > 3 ? number(9) : 0);
+        // The sphere and its material go in the scene's arena, spheres with the same material share it unless the lines are recorded
+        if (s.record_sphere_lines)
+        {
+            material *mat = s.materials.make_unshared(desc);
+            s.sphere_lines.push_back({center, radius, desc, mat});
+            objects().add(s.arena.create<sphere>(center, radius, mat));
+        }
+        else
+        {
+            objects().add(s.arena.create<sphere>(center, radius, s.materials.get(desc)));
+        }
+    }
+
+    // GROUP name starts a group, the SPHERE and INSTANCE lines up to END_GROUP go in it rather than in the world.
+    // INSTANCE name x y z scale places a copy of a group defined before, in the world or in the group being defined.
+    void parse_group_line()
+    {
+        const scene_token &type = tokens[0];
+        if (type.is("GROUP"))
+        {
+            arguments(1);
+            if (group != nullptr)
+            {
+                error(type, "GROUP " + tokens[1].str() + " can not be inside GROUP " + group->name);
+            }
+            if (group_names.count(tokens[1].str()) > 0)
+            {
+                error(tokens[1], "GROUP " + tokens[1].str() + " is already defined");
+            }
+            s.groups.emplace_back(new object_group(tokens[1].str()));
+            group = s.groups.back().get();
+        }
+        else if (type.is("END_GROUP"))
+        {
+            arguments(0);
+            if (group == nullptr)
+            {
+                error(type, "END_GROUP without a GROUP");
+            }
+            if (group->objects.objects().empty())
+            {
+                error(type, "GROUP " + group->name + " is empty");
+            }
+            group->close();
+            group_names[group->name] = group;
+            group = nullptr;
+        }
+        else
+        {
+            arguments(5);
+            auto found = group_names.find(tokens[1].str());
+            if (found == group_names.end())
+            {
+                error(tokens[1], "Unknown GROUP " + tokens[1].str());
+            }
+            vec3 offset(number(2), number(3), number(4));
+            double scale = number(5);
+            if (!(scale > 0))
+            {
+                error(tokens[5], "Invalid instance scale " + tokens[5].str());
+            }
+            objects().add(s.arena.create<instance>(found->second, offset, scale));
+        }
+    }
+
+    // Where SPHERE and INSTANCE lines add their objects, the group being defined or the world
+    hittable_list &objects()
+    {
+        return group != nullptr ? group->objects : s.world;
+    }
+
+    // Camera position, look-at point and field of view, the 7 numbers from word first
+    camera_view view(size_t first)
+    {
+        camera_view v;
+        v.position = point3(number(first), number(first + 1), number(first + 2));
+        v.look_at = point3(number(first + 3), number(first + 4), number(first + 5));
+        v.fov = number(first + 6);
+        if (v.position.x() == v.look_at.x() && v.position.y() == v.look_at.y() && v.position.z() == v.look_at.z())
+        {
+            error(tokens[first + 3], "The camera can not look at its own position");
+        }
+        if (!(v.fov > 0 && v.fov < 180))
+        {
+            error(tokens[first + 6], "Invalid field of view " + tokens[first + 6].str());
+        }
+        return v;
+    }
+
+    // Check the line has count words after its type
+    void arguments(size_t count)
+    {
+        if (tokens.size() < count + 1)
+        {
+            error_at_end(tokens[0].str() + " needs " + std::to_string(count) + " arguments, found " + std::to_string(tokens.size() - 1));
+        }
+        if (tokens.size() > count + 1)
+        {
+            error(tokens[count + 1], "Unexpected argument " + tokens[count + 1].str());
+        }
+    }
+
+    double number(size_t index)
+    {
+        char buffer[64];
+        const scene_token &token = copy(index, buffer);
+        char *end;
+        double value = std::strtod(buffer, &end);
+        if (end != buffer + token.length || !std::isfinite(value))
+        {
+            error(token, "Invalid number " + token.str());
+        }
+        return value;
+    }
+
+    int integer(size_t index)
+    {
+        char buffer[64];
+        const scene_token &token = copy(index, buffer);
+        char *end;
+        errno = 0;
+        long value = std::strtol(buffer, &end, 10);
+        if (end != buffer + token.length || errno != 0 || value < INT_MIN || value > INT_MAX)
+        {
+            error(token, "Invalid integer " + token.str());
+        }
+        return (int)value;
+    }
+
+    uint64_t unsigned_integer(size_t index)
+    {
+        char buffer[64];
+        const scene_token &token = copy(index, buffer);
+        char *end;
+        errno = 0;
+        unsigned long long value = std::strtoull(buffer, &end, 10);
+        if (end != buffer + token.length || errno != 0 || token.text[0] == '-')
+        {
+            error(token, "Invalid integer " + token.str());
+        }
+        return value;
+    }
+
+    // strtod needs a terminated string, so copy the one word (not the whole text) into buffer
+    const scene_token &copy(size_t index, char (&buffer)[64])
+    {
+        const scene_token &token = tokens[index];
+        if (token.length >= sizeof(buffer))
+        {
+            error(token, "Invalid number " + token.str());
+        }
+        std::memcpy(buffer, token.text, token.length);
+        buffer[token.length] = '\0';
+        return token;
+    }
+
+    [[noreturn]] void error(const scene_token &token, const std::string &message) const
+    {
+        throw std::runtime_error("Line " + std::to_string(line_number) + ", column " + std::to_string(token.column) + ": " + message);
+    }
+
+    [[noreturn]] void error_at_end(const std::string &message) const
+    {
+        throw std::runtime_error("Line " + std::to_string(line_number) + ", column " + std::to_string(line_length + 1) + ": " + message);
+    }
+
+    scene &s;
+    // The group between a GROUP line and its END_GROUP, and the groups closed so far by name
+    object_group *group = nullptr;
+    std::map<std::string, const object_group *> group_names;
+    // Image size of the CAMERA line
+    int view_width = 0;
+    int view_height = 0;
+    std::vector<scene_token> tokens;
+    const char *line_begin = nullptr;
+    int line_length = 0;
+    int line_number = 0;
+};
+
+// Reads the lines of an input file (see README.txt) into s, throws std::runtime_error if a line is invalid
+void parse_scene(const char *begin, const char *end, scene &s)
+{
+    scene_parser(s).parse(begin, end);
+}
+
+void parse_scene(std::istream &in, scene &s)
+{
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    parse_scene(text.data(), text.data() + text.size(), s);
+}
+
+#endif
\ No newline at end of file
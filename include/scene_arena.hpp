@@ -0,0 +1,79 @@
+#ifndef scene_arena_hpp
+#define scene_arena_hpp
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Size of each block the arena takes from the heap, larger objects get a block of their own
+#define ARENA_BLOCK_SIZE (1 << 20)
+// Blocks start on a cache line
+#define ARENA_ALIGNMENT 64
+
+// Owns the objects of a scene (spheres and materials) in a few large blocks instead of one heap allocation per object.
+// Objects are placed one after another in the order they are made, so the spheres of a scene sit next to each other in memory.
+// Nothing is freed until the arena is destroyed, which then frees only the blocks without visiting the objects (O(1) per block).
+// That is why only objects with nothing to clean up (trivially destructible) can be made in it.
+class scene_arena
+{
+public:
+    scene_arena() {}
+
+    scene_arena(const scene_arena &) = delete;
+    scene_arena &operator=(const scene_arena &) = delete;
+
+    // Make a T in the arena, it lives as long as the arena
+    template <typename T, typename... Args>
+    T *create(Args &&... args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "Objects in a scene_arena are never destroyed");
+        void *p = allocate(sizeof(T), alignof(T));
+        return new (p) T(std::forward<Args>(args)...);
+    }
+
+    // Bytes taken from the heap
+    size_t bytes_reserved() const { return reserved; }
+
+    // Bytes handed out to objects, including padding for alignment
+    size_t bytes_used() const { return used; }
+
+private:
+    struct free_block
+    {
+        void operator()(char *p) const { std::free(p); }
+    };
+
+    void *allocate(size_t size, size_t alignment)
+    {
+        size_t offset = (block_used + alignment - 1) / alignment * alignment;
+        if (blocks.empty() || offset + size > block_size)
+        {
+            block_size = std::max((size_t)ARENA_BLOCK_SIZE, size);
+            void *p = nullptr;
+            if (posix_memalign(&p, ARENA_ALIGNMENT, block_size) != 0)
+            {
+                throw std::bad_alloc();
+            }
+            blocks.push_back(std::unique_ptr<char, free_block>(static_cast<char *>(p)));
+            reserved += block_size;
+            block_used = 0;
+            offset = 0;
+        }
+        used += offset + size - block_used;
+        block_used = offset + size;
+        return blocks.back().get() + offset;
+    }
+
+    std::vector<std::unique_ptr<char, free_block>> blocks;
+    size_t block_size = 0;
+    size_t block_used = 0;
+    size_t reserved = 0;
+    size_t used = 0;
+};
+
+#endif
\ No newline at end of file
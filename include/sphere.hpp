@@ -9,6 +9,7 @@
 #include "material.hpp"
 #include <iostream>
 #include <cmath>
+#include <utility>
 
 // Sphere equation is x^2 + y^2 + z^2 = r^2
 
@@ -28,68 +29,123 @@
 // (t^2)*b.b + 2tb.(A-C) + (A-C).(A-C) - r^2 = 0
 // The above quadratic equation is used to find the roots t in the function hit below
 
+// Roots t1 <= t2 of the quadratic above for the ray origin + t * direction and a sphere at center with squared radius radius2, false if the ray misses.
+// Solving it the textbook way loses most of its digits for big spheres (such as a ground sphere of radius 100) in single precision,
+// so it is solved as in "Precision Improvements for Ray/Sphere Intersection" (Haines et al., Ray Tracing Gems, 2019):
+// - the middle term 2b.(A - C) is halved (h = b.(A - C)), so with a = b.b and c = (A - C).(A - C) - r^2 the roots are (-h -+ sqrt(h^2 - ac)) / a
+// - only the root furthest from 0 is worked out that way, as the other one adds numbers of opposite signs that cancel out,
+//   and the other root comes from it (t1 * t2 = c / a)
+// - in single precision, h^2 - ac is worked out as a * (r^2 - |l|^2), where l is the part of A - C at right angles to the ray,
+//   rather than as the difference of two nearly equal big numbers. Doubles have the digits to spare, and skip the extra work.
+bool sphere_roots(const point3 &origin, const vec3 &direction, const point3 &center, real radius2, real &t1, real &t2)
+{
+    vec3 a_min_c = origin - center;           // A - C
+    real a = dot(direction, direction);       // b.b
+    real h = dot(direction, a_min_c);         // b.(A - C)
+    real c = dot(a_min_c, a_min_c) - radius2; // (A - C).(A - C) - r^2
+    real inv_a = 1 / a;
+#ifdef RAYTRACE_FLOAT
+    vec3 l = a_min_c - (h * inv_a) * direction;
+    real discriminant = a * (radius2 - dot(l, l));
+#else
+    real discriminant = h * h - a * c;
+#endif
+    if (discriminant < 0)
+        return false;
+
+    real q = -(h + std::copysign(std::sqrt(discriminant), h));
+    t1 = c / q;
+    t2 = q * inv_a;
+    if (t1 > t2)
+        std::swap(t1, t2);
+    return true;
+}
+
+// Whether the ray origin + t * direction hits the sphere at center with squared radius radius2 for some t between t_min and t_max.
+// A yes or no needs less than sphere_roots: as a > 0, t_min < (-h -+ sqrt(h^2 - ac)) / a < t_max is checked as
+// a * t_min < -h -+ sqrt(h^2 - ac) < a * t_max, with no division (in double precision) and no root swapping,
+// and the far root is only looked at when the near one is out of range.
+// Cancellation in -h - sqrt(h^2 - ac) only costs digits near t = 0, well below the t_min of a shadow ray.
+bool sphere_occludes(const point3 &origin, const vec3 &direction, const point3 &center, real radius2, real t_min, real t_max)
+{
+    vec3 a_min_c = origin - center;     // A - C
+    real a = dot(direction, direction); // b.b
+    real h = dot(direction, a_min_c);   // b.(A - C)
+#ifdef RAYTRACE_FLOAT
+    vec3 l = a_min_c - (h / a) * direction;
+    real discriminant = a * (radius2 - dot(l, l));
+#else
+    real discriminant = h * h - a * (dot(a_min_c, a_min_c) - radius2);
+#endif
+    if (discriminant < 0)
+        return false;
+
+    real root = std::sqrt(discriminant);
+    real low = a * t_min;
+    real high = a * t_max;
+    real near_root = -h - root;
+    if (low < near_root && near_root < high)
+        return true;
+    real far_root = -h + root;
+    return low < far_root && far_root < high;
+}
+
 class sphere : public hittable
 {
 public:
     // position of sphere
     point3 center;
     // radius of sphere
-    double radius;
+    real radius;
     // radius of sphere squared
-    double radius2;
+    real radius2;
     material *mat;
     sphere(
         const vec3 &c,
-        const double &r,
+        const real &r,
         material *mat) : center(c), radius(r), radius2(r * r), mat(mat)
     {
     }
 
     // Returns true where the ray P(t) hits the sphere, false if it doesn't hit
     // Only returns if the root value t is within t_min and t_max, and store t and normal into the hit_record.
-    bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override
+    bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const override
     {
-        // b is direction of ray
-        // A is the origin of the ray
-        // C is the center of the sphere
-        // r is radius of the sphere
-        vec3 a_min_c = r.origin() - center;                        // A - C
-        auto a_quad = dot(r.direction(), r.direction());           // b^2
-        auto b_quad = 2 * dot(r.direction(), a_min_c);             // 2*b.(A - C)
-        auto c_quad = dot(a_min_c, a_min_c) - radius2;             // (A - C).(A - C) - r^2
-        auto discriminant = b_quad * b_quad - 4 * a_quad * c_quad; // b^2 - 4*a*c
-        if (discriminant < 0)
+        real root1, root2;
+        if (!sphere_roots(r.origin(), r.direction(), center, radius2, root1, root2))
             return false;
-        else
+        // If roots is within t_min and t_max
+        if (t_min < root1 && root1 < t_max || t_min < root2 && root2 < t_max)
         {
-            auto root1 = (-b_quad - std::sqrt(discriminant)) / (2 * a_quad);
-            auto root2 = (-b_quad + std::sqrt(discriminant)) / (2 * a_quad);
-            // If roots is within t_min and t_max
-            if (t_min < root1 && root1 < t_max || t_min < root2 && root2 < t_max)
+            // Store closest root's t, p and normal to hit_record
+            // root1 is always the smaller root, but when the ray starts inside the sphere root1 is behind it (below t_min) and root2 is the hit
+            if (t_min < root1 && root1 < t_max)
             {
-                // Store closest root's t, p and normal to hit_record
-                if (root1 < root2)
-                {
-                    rec.t = root1;
-                }
-                else
-                {
-                    rec.t = root2;
-                }
-                rec.p = r.at(rec.t);
-                rec.normal = normal(rec.p); // This normal is always outwards
-                rec.mat = mat;              // Set the hit_record to this material
-                return true;
+                rec.t = root1;
             }
             else
             {
-                return false;
+                rec.t = root2;
             }
+            rec.p = r.at(rec.t);
+            rec.normal = normal(rec.p); // This normal is always outwards
+            rec.mat = mat;              // Set the hit_record to this material
+            return true;
         }
-        // Should not reach here
         return false;
     }
 
+    bool occluded(const ray &r, real t_min, real t_max) const override
+    {
+        return sphere_occludes(r.origin(), r.direction(), center, radius2, t_min, t_max);
+    }
+
+    aabb bounding_box() const override
+    {
+        auto r = std::fabs(radius);
+        return aabb(center - vec3(r, r, r), center + vec3(r, r, r));
+    }
+
     // To get the direction of the normal of a sphere (used for reflecting/scattering rays)
     // Basically, we take the hit point of the ray and subtract with the centre of the sphere. (P - C)
     vec3 normal(const vec3 &hit_point) const
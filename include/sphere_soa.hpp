@@ -0,0 +1,687 @@
+#ifndef sphere_soa_hpp
+#define sphere_soa_hpp
+
+#include "aligned_allocator.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The SIMD kernels are written with x86 intrinsics and compiled per function with GCC/Clang target attributes,
+// so the rest of the program does not need to be built for AVX and still runs on any x86-64 CPU.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SPHERE_SOA_X86 1
+#include <immintrin.h>
+#endif
+
+// Which closest-hit kernel a sphere_soa_world uses
+enum class soa_kernel
+{
+    scalar,
+    avx2,   // 4 spheres per instruction (8 in single precision)
+    avx512, // 8 spheres per instruction (16 in single precision)
+};
+
+// World made of packed arrays of spheres (structure of arrays) instead of a list of pointers to individual spheres.
+// The centers, squared radii and material indices each sit in their own contiguous, 64 byte aligned array,
+// so the closest-hit loop streams through memory and can test 4 (AVX2) or 8 (AVX-512) spheres with each instruction, twice as many in single precision.
+// The kernel is picked at runtime from what the CPU supports, falling back to a plain loop.
+// It answers the same hit_all and occluded queries as hittable_list. The materials are still owned by the spheres of the hittable_list.
+// It can also use arrays that are already laid out like this (such as those of a mapped binary scene file) without copying them.
+class sphere_soa_world
+{
+public:
+    // Uses the arrays as they are, they must be 64 byte aligned and outlive the world.
+    // mat_index holds indices into materials.
+    // In single precision (RAYTRACE_FLOAT) the arrays of doubles are copied into arrays of floats instead.
+    sphere_soa_world(const double *center_x, const double *center_y, const double *center_z, const double *radius2,
+                     const int32_t *mat_index, size_t count, const std::vector<material *> &materials)
+        : mat_index(mat_index), count(count), materials(materials)
+    {
+#ifdef RAYTRACE_FLOAT
+        own_center_x.assign(center_x, center_x + count);
+        own_center_y.assign(center_y, center_y + count);
+        own_center_z.assign(center_z, center_z + count);
+        own_radius2.assign(radius2, radius2 + count);
+        pad_arrays();
+#else
+        this->center_x = center_x;
+        this->center_y = center_y;
+        this->center_z = center_z;
+        this->radius2 = radius2;
+#endif
+        kernel = best_kernel();
+    }
+
+    // Copies the spheres of the list into the arrays
+    // Throws std::invalid_argument if an object of the list is not a sphere
+    sphere_soa_world(const hittable_list &list)
+    {
+        std::map<material *, int> material_index;
+        for (auto object : list.objects())
+        {
+            const sphere *s = dynamic_cast<const sphere *>(object);
+            if (s == nullptr)
+            {
+                throw std::invalid_argument("sphere_soa_world only holds spheres");
+            }
+            own_center_x.push_back(s->center.x());
+            own_center_y.push_back(s->center.y());
+            own_center_z.push_back(s->center.z());
+            own_radius2.push_back(s->radius2);
+
+            // Spheres sharing a material also share its index
+            auto found = material_index.find(s->mat);
+            if (found == material_index.end())
+            {
+                found = material_index.insert(std::make_pair(s->mat, (int)materials.size())).first;
+                materials.push_back(s->mat);
+            }
+            own_mat_index.push_back(found->second);
+        }
+
+        mat_index = own_mat_index.data();
+        count = own_radius2.size();
+#ifdef RAYTRACE_FLOAT
+        pad_arrays();
+#else
+        center_x = own_center_x.data();
+        center_y = own_center_y.data();
+        center_z = own_center_z.data();
+        radius2 = own_radius2.data();
+#endif
+        kernel = best_kernel();
+    }
+
+    // The array pointers may point into the world itself, so it is not copied
+    sphere_soa_world(const sphere_soa_world &) = delete;
+    sphere_soa_world &operator=(const sphere_soa_world &) = delete;
+
+    // Fastest kernel that this CPU can run
+    static soa_kernel best_kernel()
+    {
+#ifdef SPHERE_SOA_X86
+        if (__builtin_cpu_supports("avx512f"))
+            return soa_kernel::avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return soa_kernel::avx2;
+#endif
+        return soa_kernel::scalar;
+    }
+
+    static std::string kernel_name(soa_kernel k)
+    {
+        switch (k)
+        {
+        case soa_kernel::avx512:
+            return "AVX-512";
+        case soa_kernel::avx2:
+            return "AVX2";
+        default:
+            return "scalar";
+        }
+    }
+
+    soa_kernel get_kernel() const { return kernel; }
+
+    // Force a kernel, such as the scalar one to compare against. It must be supported by the CPU.
+    void set_kernel(soa_kernel k) { kernel = k; }
+
+    size_t size() const { return count; }
+
+    // function that takes in a ray to see if the ray hits what hittables in the world, same as hittable_list::hit_all
+    // Only the closest sphere gets its hit point, normal and material worked out, instead of every sphere that is hit along the way.
+    bool hit_all(const ray &ray_in, real t_min, real t_max, hit_record &rec) const
+    {
+        STATS_COUNT(sphere_tests, size());
+        const point3 o = ray_in.origin();
+        const vec3 d = ray_in.direction();
+        real t = t_max;
+        int closest;
+        switch (kernel)
+        {
+#ifdef SPHERE_SOA_X86
+        case soa_kernel::avx512:
+            closest = closest_avx512(o, d, t_min, t);
+            break;
+        case soa_kernel::avx2:
+            closest = closest_avx2(o, d, t_min, t);
+            break;
+#endif
+        default:
+            closest = closest_scalar(o, d, t_min, t, 0, -1);
+            break;
+        }
+
+        if (closest < 0)
+            return false;
+
+        rec.t = t;
+        rec.p = ray_in.at(t);
+        rec.normal = normalize(rec.p - point3(center_x[closest], center_y[closest], center_z[closest]));
+        rec.mat = materials[mat_index[closest]];
+        return true;
+    }
+
+    // Whether any sphere blocks the ray between t_min and t_max, same as hittable_list::occluded.
+    // The kernels stop at the first group of spheres with one in the way, and skip the divisions of the closest-hit kernels (see sphere_occludes).
+    bool occluded(const ray &ray_in, real t_min, real t_max) const
+    {
+        const point3 o = ray_in.origin();
+        const vec3 d = ray_in.direction();
+        int blocker;
+        switch (kernel)
+        {
+#ifdef SPHERE_SOA_X86
+        case soa_kernel::avx512:
+            blocker = any_avx512(o, d, t_min, t_max);
+            break;
+        case soa_kernel::avx2:
+            blocker = any_avx2(o, d, t_min, t_max);
+            break;
+#endif
+        default:
+            blocker = any_scalar(o, d, t_min, t_max, 0);
+            break;
+        }
+        STATS_COUNT(sphere_tests, blocker < 0 ? size() : blocker + 1);
+        return blocker >= 0;
+    }
+
+private:
+#ifdef RAYTRACE_FLOAT
+    // Pad the copied arrays of count spheres to a multiple of 16 with spheres no ray hits (a negative squared radius),
+    // so the kernels can test whole groups of 8 or 16, and point the kernels at them
+    void pad_arrays()
+    {
+        size_t padded = (count + 15) / 16 * 16;
+        own_center_x.resize(padded, 0);
+        own_center_y.resize(padded, 0);
+        own_center_z.resize(padded, 0);
+        own_radius2.resize(padded, -1);
+        center_x = own_center_x.data();
+        center_y = own_center_y.data();
+        center_z = own_center_z.data();
+        radius2 = own_radius2.data();
+    }
+#endif
+
+    // Same quadratic as sphere::hit (see sphere_roots), the kernels below work it out the same way for several spheres at once.
+    // Tests spheres first to size() - 1, updating t and returning the index of the closest sphere hit, or best if none is closer than t.
+    int closest_scalar(const point3 &o, const vec3 &d, real t_min, real &t, size_t first, int best) const
+    {
+        for (size_t k = first; k < size(); k++)
+        {
+            real root1, root2;
+            if (!sphere_roots(o, d, point3(center_x[k], center_y[k], center_z[k]), radius2[k], root1, root2))
+                continue;
+
+            real root = root1;
+            if (!(t_min < root && root < t))
+            {
+                // The ray may start inside the sphere, then the far root is the hit
+                root = root2;
+                if (!(t_min < root && root < t))
+                    continue;
+            }
+            t = root;
+            best = (int)k;
+        }
+        return best;
+    }
+
+    // Tests spheres first to size() - 1, returning the index of the first one between t_min and t_max, or -1 if none is
+    int any_scalar(const point3 &o, const vec3 &d, real t_min, real t_max, size_t first) const
+    {
+        for (size_t k = first; k < size(); k++)
+        {
+            if (sphere_occludes(o, d, point3(center_x[k], center_y[k], center_z[k]), radius2[k], t_min, t_max))
+                return (int)k;
+        }
+        return -1;
+    }
+
+#ifdef SPHERE_SOA_X86
+    // Each lane keeps its own closest t and index, and the lanes are merged at the end.
+    // On equal t the lower index wins, the same as the first sphere winning in hittable_list.
+    template <size_t Lanes, typename Index>
+    static int merge_lanes(const real *lane_t, const Index *lane_index, real &t, int best)
+    {
+        for (size_t l = 0; l < Lanes; l++)
+        {
+            int index = (int)lane_index[l];
+            if (index >= 0 && (lane_t[l] < t || (lane_t[l] == t && index < best)))
+            {
+                t = lane_t[l];
+                best = index;
+            }
+        }
+        return best;
+    }
+
+#ifndef RAYTRACE_FLOAT
+    __attribute__((target("avx2"))) int closest_avx2(const point3 &o, const vec3 &d, real t_min, real &t) const
+    {
+        const size_t n = size() / 4 * 4;
+        const __m256d ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+        const __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+        const __m256d a = _mm256_set1_pd(dot(d, d));
+        const __m256d inv_a = _mm256_set1_pd(1 / dot(d, d));
+        const __m256d tmin = _mm256_set1_pd(t_min);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d sign = _mm256_set1_pd(-0.0);
+        const __m256d four = _mm256_set1_pd(4);
+
+        __m256d best_t = _mm256_set1_pd(t);
+        __m256d best_index = _mm256_set1_pd(-1);
+        __m256d index = _mm256_set_pd(3, 2, 1, 0);
+
+        for (size_t k = 0; k < n; k += 4)
+        {
+            __m256d ocx = _mm256_sub_pd(ox, _mm256_load_pd(&center_x[k]));
+            __m256d ocy = _mm256_sub_pd(oy, _mm256_load_pd(&center_y[k]));
+            __m256d ocz = _mm256_sub_pd(oz, _mm256_load_pd(&center_z[k]));
+            __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)), _mm256_mul_pd(dz, ocz));
+            __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)), _mm256_load_pd(&radius2[k]));
+            __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+            __m256d hit = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+            if (_mm256_movemask_pd(hit) == 0)
+            {
+                // Most groups of spheres are missed entirely, skip the square roots and divisions
+                index = _mm256_add_pd(index, four);
+                continue;
+            }
+
+            // Only lanes where the sphere is hit matter, the max keeps the others from making NaNs
+            __m256d sq = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+            __m256d q = _mm256_sub_pd(zero, _mm256_add_pd(h, _mm256_or_pd(sq, _mm256_and_pd(h, sign))));
+            __m256d t1 = _mm256_div_pd(c, q);
+            __m256d t2 = _mm256_mul_pd(q, inv_a);
+            __m256d root1 = _mm256_min_pd(t1, t2);
+            __m256d root2 = _mm256_max_pd(t1, t2);
+            __m256d near_ok = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(root1, tmin, _CMP_GT_OQ), _mm256_cmp_pd(root1, best_t, _CMP_LT_OQ)));
+            __m256d far_ok = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(root2, tmin, _CMP_GT_OQ), _mm256_cmp_pd(root2, best_t, _CMP_LT_OQ)));
+
+            __m256d root = _mm256_blendv_pd(root2, root1, near_ok);
+            __m256d closer = _mm256_or_pd(near_ok, far_ok);
+            best_t = _mm256_blendv_pd(best_t, root, closer);
+            best_index = _mm256_blendv_pd(best_index, index, closer);
+            index = _mm256_add_pd(index, four);
+        }
+
+        alignas(32) double lane_t[4], lane_index[4];
+        _mm256_store_pd(lane_t, best_t);
+        _mm256_store_pd(lane_index, best_index);
+        int best = merge_lanes<4>(lane_t, lane_index, t, -1);
+
+        // Spheres left over after the last full group of 4
+        return closest_scalar(o, d, t_min, t, n, best);
+    }
+
+    // AVX-512F has no and/or of doubles (that is AVX-512DQ), so signs are handled as integers
+    __attribute__((target("avx512f"))) int closest_avx512(const point3 &o, const vec3 &d, real t_min, real &t) const
+    {
+        const size_t n = size() / 8 * 8;
+        const __m512d ox = _mm512_set1_pd(o.x()), oy = _mm512_set1_pd(o.y()), oz = _mm512_set1_pd(o.z());
+        const __m512d dx = _mm512_set1_pd(d.x()), dy = _mm512_set1_pd(d.y()), dz = _mm512_set1_pd(d.z());
+        const __m512d a = _mm512_set1_pd(dot(d, d));
+        const __m512d inv_a = _mm512_set1_pd(1 / dot(d, d));
+        const __m512d tmin = _mm512_set1_pd(t_min);
+        const __m512d zero = _mm512_setzero_pd();
+        const __m512i sign = _mm512_set1_epi64(INT64_MIN);
+        const __m512d eight = _mm512_set1_pd(8);
+
+        __m512d best_t = _mm512_set1_pd(t);
+        __m512d best_index = _mm512_set1_pd(-1);
+        __m512d index = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+
+        for (size_t k = 0; k < n; k += 8)
+        {
+            __m512d ocx = _mm512_sub_pd(ox, _mm512_load_pd(&center_x[k]));
+            __m512d ocy = _mm512_sub_pd(oy, _mm512_load_pd(&center_y[k]));
+            __m512d ocz = _mm512_sub_pd(oz, _mm512_load_pd(&center_z[k]));
+            __m512d h = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, ocx), _mm512_mul_pd(dy, ocy)), _mm512_mul_pd(dz, ocz));
+            __m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)), _mm512_load_pd(&radius2[k]));
+            __m512d discriminant = _mm512_sub_pd(_mm512_mul_pd(h, h), _mm512_mul_pd(a, c));
+            __mmask8 hit = _mm512_cmp_pd_mask(discriminant, zero, _CMP_GE_OQ);
+            if (hit == 0)
+            {
+                index = _mm512_add_pd(index, eight);
+                continue;
+            }
+
+            __m512d sq = _mm512_sqrt_pd(_mm512_max_pd(discriminant, zero));
+            __m512i h_sign = _mm512_and_si512(_mm512_castpd_si512(h), sign);
+            __m512d signed_sq = _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(sq), h_sign));
+            __m512d q = _mm512_sub_pd(zero, _mm512_add_pd(h, signed_sq));
+            __m512d t1 = _mm512_div_pd(c, q);
+            __m512d t2 = _mm512_mul_pd(q, inv_a);
+            __m512d root1 = _mm512_min_pd(t1, t2);
+            __m512d root2 = _mm512_max_pd(t1, t2);
+            __mmask8 near_ok = hit & _mm512_cmp_pd_mask(root1, tmin, _CMP_GT_OQ) & _mm512_cmp_pd_mask(root1, best_t, _CMP_LT_OQ);
+            __mmask8 far_ok = hit & _mm512_cmp_pd_mask(root2, tmin, _CMP_GT_OQ) & _mm512_cmp_pd_mask(root2, best_t, _CMP_LT_OQ);
+
+            __m512d root = _mm512_mask_blend_pd(near_ok, root2, root1);
+            __mmask8 closer = near_ok | far_ok;
+            best_t = _mm512_mask_blend_pd(closer, best_t, root);
+            best_index = _mm512_mask_blend_pd(closer, best_index, index);
+            index = _mm512_add_pd(index, eight);
+        }
+
+        alignas(64) double lane_t[8], lane_index[8];
+        _mm512_store_pd(lane_t, best_t);
+        _mm512_store_pd(lane_index, best_index);
+        int best = merge_lanes<8>(lane_t, lane_index, t, -1);
+
+        // Spheres left over after the last full group of 8
+        return closest_scalar(o, d, t_min, t, n, best);
+    }
+
+    // Any-hit kernels, the roots are compared against a * t_min and a * t_max as in sphere_occludes
+    __attribute__((target("avx2"))) int any_avx2(const point3 &o, const vec3 &d, real t_min, real t_max) const
+    {
+        const size_t n = size() / 4 * 4;
+        const __m256d ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+        const __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+        const __m256d a = _mm256_set1_pd(dot(d, d));
+        const __m256d low = _mm256_set1_pd(dot(d, d) * t_min);
+        const __m256d high = _mm256_set1_pd(dot(d, d) * t_max);
+        const __m256d zero = _mm256_setzero_pd();
+
+        for (size_t k = 0; k < n; k += 4)
+        {
+            __m256d ocx = _mm256_sub_pd(ox, _mm256_load_pd(&center_x[k]));
+            __m256d ocy = _mm256_sub_pd(oy, _mm256_load_pd(&center_y[k]));
+            __m256d ocz = _mm256_sub_pd(oz, _mm256_load_pd(&center_z[k]));
+            __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)), _mm256_mul_pd(dz, ocz));
+            __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)), _mm256_load_pd(&radius2[k]));
+            __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+            __m256d hit = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+            if (_mm256_movemask_pd(hit) == 0)
+                continue;
+
+            __m256d sq = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+            __m256d near_root = _mm256_sub_pd(_mm256_sub_pd(zero, h), sq);
+            __m256d far_root = _mm256_sub_pd(sq, h);
+            __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near_root, low, _CMP_GT_OQ), _mm256_cmp_pd(near_root, high, _CMP_LT_OQ));
+            __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far_root, low, _CMP_GT_OQ), _mm256_cmp_pd(far_root, high, _CMP_LT_OQ));
+            int blocked = _mm256_movemask_pd(_mm256_and_pd(hit, _mm256_or_pd(near_ok, far_ok)));
+            if (blocked != 0)
+                return (int)k + __builtin_ctz(blocked);
+        }
+
+        // Spheres left over after the last full group of 4
+        return any_scalar(o, d, t_min, t_max, n);
+    }
+
+    __attribute__((target("avx512f"))) int any_avx512(const point3 &o, const vec3 &d, real t_min, real t_max) const
+    {
+        const size_t n = size() / 8 * 8;
+        const __m512d ox = _mm512_set1_pd(o.x()), oy = _mm512_set1_pd(o.y()), oz = _mm512_set1_pd(o.z());
+        const __m512d dx = _mm512_set1_pd(d.x()), dy = _mm512_set1_pd(d.y()), dz = _mm512_set1_pd(d.z());
+        const __m512d a = _mm512_set1_pd(dot(d, d));
+        const __m512d low = _mm512_set1_pd(dot(d, d) * t_min);
+        const __m512d high = _mm512_set1_pd(dot(d, d) * t_max);
+        const __m512d zero = _mm512_setzero_pd();
+
+        for (size_t k = 0; k < n; k += 8)
+        {
+            __m512d ocx = _mm512_sub_pd(ox, _mm512_load_pd(&center_x[k]));
+            __m512d ocy = _mm512_sub_pd(oy, _mm512_load_pd(&center_y[k]));
+            __m512d ocz = _mm512_sub_pd(oz, _mm512_load_pd(&center_z[k]));
+            __m512d h = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, ocx), _mm512_mul_pd(dy, ocy)), _mm512_mul_pd(dz, ocz));
+            __m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)), _mm512_load_pd(&radius2[k]));
+            __m512d discriminant = _mm512_sub_pd(_mm512_mul_pd(h, h), _mm512_mul_pd(a, c));
+            __mmask8 hit = _mm512_cmp_pd_mask(discriminant, zero, _CMP_GE_OQ);
+            if (hit == 0)
+                continue;
+
+            __m512d sq = _mm512_sqrt_pd(_mm512_max_pd(discriminant, zero));
+            __m512d near_root = _mm512_sub_pd(_mm512_sub_pd(zero, h), sq);
+            __m512d far_root = _mm512_sub_pd(sq, h);
+            __mmask8 near_ok = _mm512_cmp_pd_mask(near_root, low, _CMP_GT_OQ) & _mm512_cmp_pd_mask(near_root, high, _CMP_LT_OQ);
+            __mmask8 far_ok = _mm512_cmp_pd_mask(far_root, low, _CMP_GT_OQ) & _mm512_cmp_pd_mask(far_root, high, _CMP_LT_OQ);
+            __mmask8 blocked = hit & (near_ok | far_ok);
+            if (blocked != 0)
+                return (int)k + __builtin_ctz(blocked);
+        }
+
+        // Spheres left over after the last full group of 8
+        return any_scalar(o, d, t_min, t_max, n);
+    }
+#else
+    // The single precision kernels test twice as many spheres per instruction, and keep the indices as integers
+    // (a float only holds whole numbers exactly up to 2^24).
+    // Their arrays are always copies padded to a multiple of 16 spheres (see pad_arrays), so they have no spheres left over.
+    __attribute__((target("avx2"))) int closest_avx2(const point3 &o, const vec3 &d, real t_min, real &t) const
+    {
+        const size_t n = own_radius2.size();
+        const __m256 ox = _mm256_set1_ps(o.x()), oy = _mm256_set1_ps(o.y()), oz = _mm256_set1_ps(o.z());
+        const __m256 dx = _mm256_set1_ps(d.x()), dy = _mm256_set1_ps(d.y()), dz = _mm256_set1_ps(d.z());
+        const __m256 a = _mm256_set1_ps(dot(d, d));
+        const __m256 inv_a = _mm256_set1_ps(1 / dot(d, d));
+        const __m256 tmin = _mm256_set1_ps(t_min);
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+        const __m256i eight = _mm256_set1_epi32(8);
+
+        __m256 best_t = _mm256_set1_ps(t);
+        __m256i best_index = _mm256_set1_epi32(-1);
+        __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+        for (size_t k = 0; k < n; k += 8)
+        {
+            __m256 ocx = _mm256_sub_ps(ox, _mm256_load_ps(&center_x[k]));
+            __m256 ocy = _mm256_sub_ps(oy, _mm256_load_ps(&center_y[k]));
+            __m256 ocz = _mm256_sub_ps(oz, _mm256_load_ps(&center_z[k]));
+            __m256 r2 = _mm256_load_ps(&radius2[k]);
+            __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+            __m256 s = _mm256_mul_ps(h, inv_a);
+            __m256 lx = _mm256_sub_ps(ocx, _mm256_mul_ps(s, dx));
+            __m256 ly = _mm256_sub_ps(ocy, _mm256_mul_ps(s, dy));
+            __m256 lz = _mm256_sub_ps(ocz, _mm256_mul_ps(s, dz));
+            __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+            __m256 discriminant = _mm256_mul_ps(a, _mm256_sub_ps(r2, l2));
+            __m256 hit = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+            if (_mm256_movemask_ps(hit) == 0)
+            {
+                index = _mm256_add_epi32(index, eight);
+                continue;
+            }
+
+            __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), r2);
+            __m256 sq = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+            __m256 q = _mm256_sub_ps(zero, _mm256_add_ps(h, _mm256_or_ps(sq, _mm256_and_ps(h, sign))));
+            __m256 t1 = _mm256_div_ps(c, q);
+            __m256 t2 = _mm256_mul_ps(q, inv_a);
+            __m256 root1 = _mm256_min_ps(t1, t2);
+            __m256 root2 = _mm256_max_ps(t1, t2);
+            __m256 near_ok = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(root1, tmin, _CMP_GT_OQ), _mm256_cmp_ps(root1, best_t, _CMP_LT_OQ)));
+            __m256 far_ok = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(root2, tmin, _CMP_GT_OQ), _mm256_cmp_ps(root2, best_t, _CMP_LT_OQ)));
+
+            __m256 root = _mm256_blendv_ps(root2, root1, near_ok);
+            __m256 closer = _mm256_or_ps(near_ok, far_ok);
+            best_t = _mm256_blendv_ps(best_t, root, closer);
+            best_index = _mm256_blendv_epi8(best_index, index, _mm256_castps_si256(closer));
+            index = _mm256_add_epi32(index, eight);
+        }
+
+        // Most rays hit nothing, then there are no lanes to merge
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(best_index)) == 0xff)
+            return -1;
+        alignas(32) float lane_t[8];
+        alignas(32) int32_t lane_index[8];
+        _mm256_store_ps(lane_t, best_t);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lane_index), best_index);
+        return merge_lanes<8>(lane_t, lane_index, t, -1);
+    }
+
+    // AVX-512F has no and/or of floats (that is AVX-512DQ), so signs are handled as integers
+    __attribute__((target("avx512f"))) int closest_avx512(const point3 &o, const vec3 &d, real t_min, real &t) const
+    {
+        const size_t n = own_radius2.size();
+        const __m512 ox = _mm512_set1_ps(o.x()), oy = _mm512_set1_ps(o.y()), oz = _mm512_set1_ps(o.z());
+        const __m512 dx = _mm512_set1_ps(d.x()), dy = _mm512_set1_ps(d.y()), dz = _mm512_set1_ps(d.z());
+        const __m512 a = _mm512_set1_ps(dot(d, d));
+        const __m512 inv_a = _mm512_set1_ps(1 / dot(d, d));
+        const __m512 tmin = _mm512_set1_ps(t_min);
+        const __m512 zero = _mm512_setzero_ps();
+        const __m512i sign = _mm512_set1_epi32(INT32_MIN);
+        const __m512i sixteen = _mm512_set1_epi32(16);
+
+        __m512 best_t = _mm512_set1_ps(t);
+        __m512i best_index = _mm512_set1_epi32(-1);
+        __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+        for (size_t k = 0; k < n; k += 16)
+        {
+            __m512 ocx = _mm512_sub_ps(ox, _mm512_load_ps(&center_x[k]));
+            __m512 ocy = _mm512_sub_ps(oy, _mm512_load_ps(&center_y[k]));
+            __m512 ocz = _mm512_sub_ps(oz, _mm512_load_ps(&center_z[k]));
+            __m512 r2 = _mm512_load_ps(&radius2[k]);
+            __m512 h = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz));
+            __m512 s = _mm512_mul_ps(h, inv_a);
+            __m512 lx = _mm512_sub_ps(ocx, _mm512_mul_ps(s, dx));
+            __m512 ly = _mm512_sub_ps(ocy, _mm512_mul_ps(s, dy));
+            __m512 lz = _mm512_sub_ps(ocz, _mm512_mul_ps(s, dz));
+            __m512 l2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, lx), _mm512_mul_ps(ly, ly)), _mm512_mul_ps(lz, lz));
+            __m512 discriminant = _mm512_mul_ps(a, _mm512_sub_ps(r2, l2));
+            __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ);
+            if (hit == 0)
+            {
+                index = _mm512_add_epi32(index, sixteen);
+                continue;
+            }
+
+            __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)), r2);
+            __m512 sq = _mm512_sqrt_ps(_mm512_max_ps(discriminant, zero));
+            __m512i h_sign = _mm512_and_si512(_mm512_castps_si512(h), sign);
+            __m512 signed_sq = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(sq), h_sign));
+            __m512 q = _mm512_sub_ps(zero, _mm512_add_ps(h, signed_sq));
+            __m512 t1 = _mm512_div_ps(c, q);
+            __m512 t2 = _mm512_mul_ps(q, inv_a);
+            __m512 root1 = _mm512_min_ps(t1, t2);
+            __m512 root2 = _mm512_max_ps(t1, t2);
+            __mmask16 near_ok = hit & _mm512_cmp_ps_mask(root1, tmin, _CMP_GT_OQ) & _mm512_cmp_ps_mask(root1, best_t, _CMP_LT_OQ);
+            __mmask16 far_ok = hit & _mm512_cmp_ps_mask(root2, tmin, _CMP_GT_OQ) & _mm512_cmp_ps_mask(root2, best_t, _CMP_LT_OQ);
+
+            __m512 root = _mm512_mask_blend_ps(near_ok, root2, root1);
+            __mmask16 closer = near_ok | far_ok;
+            best_t = _mm512_mask_blend_ps(closer, best_t, root);
+            best_index = _mm512_mask_blend_epi32(closer, best_index, index);
+            index = _mm512_add_epi32(index, sixteen);
+        }
+
+        // Most rays hit nothing, then there are no lanes to merge
+        __mmask16 found = _mm512_cmpgt_epi32_mask(best_index, _mm512_set1_epi32(-1));
+        if (found == 0)
+            return -1;
+        alignas(64) float lane_t[16];
+        alignas(64) int32_t lane_index[16];
+        _mm512_store_ps(lane_t, best_t);
+        _mm512_store_si512(lane_index, best_index);
+        return merge_lanes<16>(lane_t, lane_index, t, -1);
+    }
+
+    __attribute__((target("avx2"))) int any_avx2(const point3 &o, const vec3 &d, real t_min, real t_max) const
+    {
+        const size_t n = own_radius2.size();
+        const __m256 ox = _mm256_set1_ps(o.x()), oy = _mm256_set1_ps(o.y()), oz = _mm256_set1_ps(o.z());
+        const __m256 dx = _mm256_set1_ps(d.x()), dy = _mm256_set1_ps(d.y()), dz = _mm256_set1_ps(d.z());
+        const __m256 a = _mm256_set1_ps(dot(d, d));
+        const __m256 inv_a = _mm256_set1_ps(1 / dot(d, d));
+        const __m256 low = _mm256_set1_ps(dot(d, d) * t_min);
+        const __m256 high = _mm256_set1_ps(dot(d, d) * t_max);
+        const __m256 zero = _mm256_setzero_ps();
+
+        for (size_t k = 0; k < n; k += 8)
+        {
+            __m256 ocx = _mm256_sub_ps(ox, _mm256_load_ps(&center_x[k]));
+            __m256 ocy = _mm256_sub_ps(oy, _mm256_load_ps(&center_y[k]));
+            __m256 ocz = _mm256_sub_ps(oz, _mm256_load_ps(&center_z[k]));
+            __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+            __m256 s = _mm256_mul_ps(h, inv_a);
+            __m256 lx = _mm256_sub_ps(ocx, _mm256_mul_ps(s, dx));
+            __m256 ly = _mm256_sub_ps(ocy, _mm256_mul_ps(s, dy));
+            __m256 lz = _mm256_sub_ps(ocz, _mm256_mul_ps(s, dz));
+            __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+            __m256 discriminant = _mm256_mul_ps(a, _mm256_sub_ps(_mm256_load_ps(&radius2[k]), l2));
+            __m256 hit = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+            if (_mm256_movemask_ps(hit) == 0)
+                continue;
+
+            __m256 sq = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+            __m256 near_root = _mm256_sub_ps(_mm256_sub_ps(zero, h), sq);
+            __m256 far_root = _mm256_sub_ps(sq, h);
+            __m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(near_root, low, _CMP_GT_OQ), _mm256_cmp_ps(near_root, high, _CMP_LT_OQ));
+            __m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(far_root, low, _CMP_GT_OQ), _mm256_cmp_ps(far_root, high, _CMP_LT_OQ));
+            int blocked = _mm256_movemask_ps(_mm256_and_ps(hit, _mm256_or_ps(near_ok, far_ok)));
+            if (blocked != 0)
+                return (int)k + __builtin_ctz(blocked);
+        }
+        return -1;
+    }
+
+    __attribute__((target("avx512f"))) int any_avx512(const point3 &o, const vec3 &d, real t_min, real t_max) const
+    {
+        const size_t n = own_radius2.size();
+        const __m512 ox = _mm512_set1_ps(o.x()), oy = _mm512_set1_ps(o.y()), oz = _mm512_set1_ps(o.z());
+        const __m512 dx = _mm512_set1_ps(d.x()), dy = _mm512_set1_ps(d.y()), dz = _mm512_set1_ps(d.z());
+        const __m512 a = _mm512_set1_ps(dot(d, d));
+        const __m512 inv_a = _mm512_set1_ps(1 / dot(d, d));
+        const __m512 low = _mm512_set1_ps(dot(d, d) * t_min);
+        const __m512 high = _mm512_set1_ps(dot(d, d) * t_max);
+        const __m512 zero = _mm512_setzero_ps();
+
+        for (size_t k = 0; k < n; k += 16)
+        {
+            __m512 ocx = _mm512_sub_ps(ox, _mm512_load_ps(&center_x[k]));
+            __m512 ocy = _mm512_sub_ps(oy, _mm512_load_ps(&center_y[k]));
+            __m512 ocz = _mm512_sub_ps(oz, _mm512_load_ps(&center_z[k]));
+            __m512 h = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz));
+            __m512 s = _mm512_mul_ps(h, inv_a);
+            __m512 lx = _mm512_sub_ps(ocx, _mm512_mul_ps(s, dx));
+            __m512 ly = _mm512_sub_ps(ocy, _mm512_mul_ps(s, dy));
+            __m512 lz = _mm512_sub_ps(ocz, _mm512_mul_ps(s, dz));
+            __m512 l2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, lx), _mm512_mul_ps(ly, ly)), _mm512_mul_ps(lz, lz));
+            __m512 discriminant = _mm512_mul_ps(a, _mm512_sub_ps(_mm512_load_ps(&radius2[k]), l2));
+            __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ);
+            if (hit == 0)
+                continue;
+
+            __m512 sq = _mm512_sqrt_ps(_mm512_max_ps(discriminant, zero));
+            __m512 near_root = _mm512_sub_ps(_mm512_sub_ps(zero, h), sq);
+            __m512 far_root = _mm512_sub_ps(sq, h);
+            __mmask16 near_ok = _mm512_cmp_ps_mask(near_root, low, _CMP_GT_OQ) & _mm512_cmp_ps_mask(near_root, high, _CMP_LT_OQ);
+            __mmask16 far_ok = _mm512_cmp_ps_mask(far_root, low, _CMP_GT_OQ) & _mm512_cmp_ps_mask(far_root, high, _CMP_LT_OQ);
+            __mmask16 blocked = hit & (near_ok | far_ok);
+            if (blocked != 0)
+                return (int)k + __builtin_ctz(blocked);
+        }
+        return -1;
+    }
+#endif
+#endif
+
+    // The arrays the kernels read, either the ones below or ones given to the constructor
+    const real *center_x;
+    const real *center_y;
+    const real *center_z;
+    const real *radius2;
+    const int32_t *mat_index;
+    size_t count;
+
+    std::vector<real, aligned_allocator<real>> own_center_x;
+    std::vector<real, aligned_allocator<real>> own_center_y;
+    std::vector<real, aligned_allocator<real>> own_center_z;
+    std::vector<real, aligned_allocator<real>> own_radius2;
+    std::vector<int32_t, aligned_allocator<int32_t>> own_mat_index;
+    std::vector<material *> materials;
+    soa_kernel kernel;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#ifndef tile_scheduler_hpp
+#define tile_scheduler_hpp
+
+#include "render_stats.hpp"
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Width and height in pixels of a tile. Small enough that there are plenty of tiles to balance between threads,
+// large enough that the cost of taking a tile from a queue is nothing next to tracing it.
+#define TILE_SIZE 16
+
+// A rectangular block of pixels covering columns x0 to x1 - 1 and rows y0 to y1 - 1 of the image.
+struct tile
+{
+    int index;
+    int x0, y0;
+    int x1, y1;
+};
+
+// Splits the image into tiles and renders them on a pool of threads using work-stealing.
+// Each thread starts with its own contiguous run of tiles and takes work from the front of its queue.
+// Once a thread's queue is empty, it steals from the back of another thread's queue.
+// This way threads that were given cheap tiles (such as background only) help with the expensive ones instead of sitting idle.
+class tile_scheduler
+{
+public:
+    tile_scheduler(int image_width, int image_height, int tile_size = TILE_SIZE) : tile_scheduler(tile{0, 0, 0, image_width, image_height}, tile_size) {}
+
+    // Split only the pixels of region, with tiles starting from its top left corner
+    tile_scheduler(const tile &region, int tile_size = TILE_SIZE)
+    {
+        // Tiles are numbered in scanline order, so tile indices do not depend on the thread count
+        for (int y = region.y0; y < region.y1; y += tile_size)
+        {
+            for (int x = region.x0; x < region.x1; x += tile_size)
+            {
+                tile t;
+                t.index = (int)tiles.size();
+                t.x0 = x;
+                t.y0 = y;
+                t.x1 = std::min(x + tile_size, region.x1);
+                t.y1 = std::min(y + tile_size, region.y1);
+                tiles.push_back(t);
+            }
+        }
+    }
+
+    int num_tiles() const { return (int)tiles.size(); }
+
+    // Calls render_tile(tile) once for every tile, spread over num_threads threads (the calling thread is one of them).
+    // render_tile must be safe to call concurrently for different tiles.
+    template <typename F>
+    void run(int num_threads, const F &render_tile) const
+    {
+        num_threads = std::max(1, std::min(num_threads, num_tiles()));
+
+        // Give each thread an equal, contiguous share of the tiles to begin with
+        std::vector<work_queue> queues(num_threads);
+        for (int w = 0; w < num_threads; w++)
+        {
+            int first = (int)((long long)num_tiles() * w / num_threads);
+            int last = (int)((long long)num_tiles() * (w + 1) / num_threads);
+            for (int t = first; t < last; t++)
+            {
+                queues[w].tiles.push_back(t);
+            }
+        }
+
+        std::vector<std::thread> threads;
+        for (int w = 1; w < num_threads; w++)
+        {
+            threads.push_back(std::thread([this, w, &queues, &render_tile]() { work(w, queues, render_tile); }));
+        }
+        work(0, queues, render_tile);
+
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+private:
+    struct work_queue
+    {
+        std::mutex lock;
+        std::deque<int> tiles;
+    };
+
+    template <typename F>
+    void work(int id, std::vector<work_queue> &queues, const F &render_tile) const
+    {
+        int t;
+        while (pop_own(queues[id], t) || steal(id, queues, t))
+        {
+            STATS_TILE(tiles[t]);
+            render_tile(tiles[t]);
+        }
+    }
+
+    // Take the next tile from the front of a thread's own queue
+    static bool pop_own(work_queue &queue, int &t)
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tiles.empty())
+        {
+            return false;
+        }
+        t = queue.tiles.front();
+        queue.tiles.pop_front();
+        return true;
+    }
+
+    // Take a tile from the back of another thread's queue, visiting the other threads in turn.
+    // No new tiles are ever added, so once every queue is empty all the work has been handed out.
+    static bool steal(int id, std::vector<work_queue> &queues, int &t)
+    {
+        int n = (int)queues.size();
+        for (int k = 1; k < n; k++)
+        {
+            work_queue &victim = queues[(id + k) % n];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tiles.empty())
+            {
+                t = victim.tiles.back();
+                victim.tiles.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<tile> tiles;
+};
+
+#endif
\ No newline at end of file
@@ -3,6 +3,9 @@
 #ifndef vec3_hpp
 #define vec3_hpp
 
+#include "real.hpp"
+#include "rng.hpp"
+#include <algorithm>
 #include <iostream>
 #include <cmath>
 
@@ -12,18 +15,18 @@ class vec3
 {
 public:
     vec3() : e{0, 0, 0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    real x() const { return e[0]; }
+    real y() const { return e[1]; }
+    real z() const { return e[2]; }
 
     // Negation
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
 
     // Return by value
-    double operator[](int i) const { return e[i]; }
-    double &operator[](int i) { return e[i]; }
+    real operator[](int i) const { return e[i]; }
+    real &operator[](int i) { return e[i]; }
 
     // Arithmetical operators
     vec3 &operator+=(const vec3 &v)
@@ -42,7 +45,7 @@ public:
         return *this;
     }
 
-    vec3 &operator*=(const double t)
+    vec3 &operator*=(const real t)
     {
         e[0] *= t;
         e[1] *= t;
@@ -50,67 +53,37 @@ public:
         return *this;
     }
 
-    vec3 &operator/=(const double t)
+    vec3 &operator/=(const real t)
     {
         return *this *= 1 / t;
     }
 
-    double length() const
+    real length() const
     {
         return std::sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
     }
 
-    vec3 static random_in_unit_sphere()
-    {
-        while (true)
-        {
-            auto p = random(-1, 1);
-            if (p.length() * p.length() >= 1)
-                continue; // If p is not in unit sphere, try again
-            return p;
-        }
-    }
-
-    // This is used for lambertian distribution
-    vec3 static random_in_hemisphere(const vec3 &normal)
-    {
-        // Pick random in unit sphere
-        auto p = random_in_unit_sphere();
-        // If point is in scattering hemisphere, return it else return negative of it (dot product with normal to find out)
-        if (dot(p, normal) > 0) // If p same direction as normal
-        {
-            return p;
-        }
-        else
-        {
-            return -p;
-        }
-    }
+    // Random point within the unit sphere (see ball_warp)
+    vec3 static random_in_unit_sphere(rng &gen);
 
-private:
-    vec3 static random(double min, double max)
-    {
-        return vec3(min + random() * (max - min), min + random() * (max - min), min + random() * (max - min));
-    }
+    // Random direction of length 1, uniform over all directions (see sphere_warp)
+    vec3 static random_unit_vector(rng &gen);
 
-    // Random function that returns a vec3 that is randomized for diffuse/Lambertian materials
-    // Will be between 0 <= r < 1
-    double static random()
-    {
-        return rand() / double(RAND_MAX + 1.0);
-    }
+    // Random direction of length 1 on the side of normal (see hemisphere_warp)
+    vec3 static random_in_hemisphere(const vec3 &normal, rng &gen);
 
+private:
     friend std::ostream &operator<<(std::ostream &out, const vec3 &v);
     friend vec3 operator+(const vec3 &u, const vec3 &v);
     friend vec3 operator-(const vec3 &u, const vec3 &v);
     friend vec3 operator*(const vec3 &u, const vec3 &v);
-    friend vec3 operator*(double t, const vec3 &v);
-    // friend vec3 operator*(const vec3 &v, double t);
-    // friend vec3 operator/(vec3 v, double t);
-    friend double dot(const vec3 &u, const vec3 &v);
+    friend vec3 operator*(real t, const vec3 &v);
+    // friend vec3 operator*(const vec3 &v, real t);
+    // friend vec3 operator/(vec3 v, real t);
+    friend real dot(const vec3 &u, const vec3 &v);
     friend vec3 cross(const vec3 &u, const vec3 &v);
     // friend vec3 unit_vector(vec3 v);
-    double e[3];
+    real e[3];
 };
 
 // Point is alias of vec3
@@ -137,26 +110,33 @@ vec3 operator*(const vec3 &u, const vec3 &v)
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-vec3 operator*(double t, const vec3 &v)
+vec3 operator*(real t, const vec3 &v)
 {
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-vec3 operator*(const vec3 &v, double t)
+vec3 operator*(const vec3 &v, real t)
 {
     return t * v;
 }
 
-vec3 operator/(vec3 v, double t)
+vec3 operator/(vec3 v, real t)
 {
     return (1 / t) * v;
 }
 
-double dot(const vec3 &u, const vec3 &v)
+real dot(const vec3 &u, const vec3 &v)
 {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
+vec3 cross(const vec3 &u, const vec3 &v)
+{
+    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+}
+
 vec3 normalize(vec3 v)
 {
     return v / v.length();
@@ -169,4 +149,74 @@ vec3 reflect(const vec3 &v, const vec3 &n)
     return v - 2 * dot(v, n) * n;
 }
 
+// Closed-form warps from numbers in [0, 1) to points and directions.
+// Each takes a fixed count of numbers, unlike rejection sampling (which throws away about half of its tries at the unit ball),
+// so numbers spread out evenly by a sampler (see sampler.hpp) give points and directions spread out evenly.
+
+// Direction of length 1, uniform over all directions
+vec3 sphere_warp(double u, double v)
+{
+    double z = 1 - 2 * u;
+    double r = std::sqrt(std::max(0.0, 1 - z * z));
+    double phi = 2 * M_PI * v;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Point uniform within the unit sphere, w picks its distance from the center
+vec3 ball_warp(double u, double v, double w)
+{
+    return std::cbrt(w) * sphere_warp(u, v);
+}
+
+// Direction of length 1, uniform over the side of normal
+vec3 hemisphere_warp(const vec3 &normal, double u, double v)
+{
+    vec3 direction = sphere_warp(u, v);
+    return dot(direction, normal) < 0 ? -direction : direction;
+}
+
+// b1 and b2 at right angles to each other and to n (of length 1), from "Building an Orthonormal Basis, Revisited" (Duff et al., 2017)
+void orthonormal_basis(const vec3 &n, vec3 &b1, vec3 &b2)
+{
+    double sign = std::copysign(1.0, (double)n.z());
+    double a = -1 / (sign + n.z());
+    double b = n.x() * n.y() * a;
+    b1 = vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+    b2 = vec3(b, sign + n.y() * n.y() * a, -n.y());
+}
+
+// Direction of length 1 on the side of normal (of length 1), with a chance density of cos(angle to normal) / pi (Lambertian reflection).
+// A point uniform in the unit disk is lifted onto the hemisphere above it.
+vec3 cosine_warp(const vec3 &normal, double u, double v)
+{
+    double r = std::sqrt(u);
+    double phi = 2 * M_PI * v;
+    vec3 b1, b2;
+    orthonormal_basis(normal, b1, b2);
+    return (r * std::cos(phi)) * b1 + (r * std::sin(phi)) * b2 + std::sqrt(std::max(0.0, 1 - u)) * normal;
+}
+
+vec3 vec3::random_in_unit_sphere(rng &gen)
+{
+    // Drawn one at a time because the evaluation order of function arguments is unspecified
+    double u = gen.next_double();
+    double v = gen.next_double();
+    double w = gen.next_double();
+    return ball_warp(u, v, w);
+}
+
+vec3 vec3::random_unit_vector(rng &gen)
+{
+    double u = gen.next_double();
+    double v = gen.next_double();
+    return sphere_warp(u, v);
+}
+
+vec3 vec3::random_in_hemisphere(const vec3 &normal, rng &gen)
+{
+    double u = gen.next_double();
+    double v = gen.next_double();
+    return hemisphere_warp(normal, u, v);
+}
+
 #endif
\ No newline at end of file
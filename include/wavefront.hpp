@@ -0,0 +1,258 @@
+// Wavefront path tracing is from "Megakernels Considered Harmful: Wavefront Path Tracing on GPUs" (Laine, Karras and Aila, 2013)
+
+#ifndef wavefront_hpp
+#define wavefront_hpp
+
+#include "scene.hpp"
+#include "bvh.hpp"
+#include "framebuffer.hpp"
+#include "tile_scheduler.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+// Width and height in pixels of the packets of pixels that are traced together
+#define WAVEFRONT_PACKET_SIZE 8
+// Most paths a thread has in flight at once, a packet's samples are traced in as many rounds as it takes to stay under this
+#define WAVEFRONT_MAX_PATHS 4096
+
+// One path being followed by the wavefront renderer, the state path_integrator::trace keeps in its local variables
+struct wavefront_path
+{
+    ray r;
+    color throughput;
+    // Pdf of the last scatter direction if it left a diffuse surface (where the lights were also sampled), otherwise 0
+    double scatter_pdf;
+    point3 scatter_origin;
+    // Index of the path's pixel within its packet
+    int pixel;
+    // Every path has its own sampler and generator, so the order paths are shaded in does not change the image
+    sampler gen;
+};
+
+// A shadow ray waiting to be tested, with the light it brings to its pixel if nothing blocks it
+struct wavefront_shadow
+{
+    ray r;
+    double distance;
+    color contribution;
+    int pixel;
+};
+
+// The paths of one packet being traced and the queues of the ones still going
+struct wavefront_queues
+{
+    // Paths are left where they are and queued by index, so moving them between queues costs nothing
+    std::vector<wavefront_path> paths;
+    std::vector<hit_record> hits;
+    // Paths to extend by the next bounce
+    std::vector<uint32_t> active;
+    std::vector<uint32_t> next;
+    // Paths that hit something, by the type of material they hit
+    std::vector<std::vector<uint32_t>> by_material;
+    std::vector<wavefront_shadow> shadows;
+};
+
+// Closest hits of count (up to BVH_PACKET_SIZE) rays going roughly the same way, for worlds that trace one ray at a time
+template <typename World>
+void hit_packet(const World &world, const ray *rays, int count, hit_record *recs, bool *hits)
+{
+    for (int r = 0; r < count; r++)
+    {
+        hits[r] = world.hit_all(rays[r], (real)0.001, std::numeric_limits<real>::infinity(), recs[r]);
+    }
+}
+
+// A BVH walks the tree once for the whole packet
+void hit_packet(const bvh_world &world, const ray *rays, int count, hit_record *recs, bool *hits)
+{
+    world.hit_packet(rays, count, (real)0.001, std::numeric_limits<real>::infinity(), recs, hits);
+}
+
+// Extend every path of q.active by one bounce, adding the light they find to sums (one per pixel of the packet).
+// All paths are intersected first, then the hits are shaded grouped by material, then the shadow rays of the diffuse hits are tested.
+// Each path does the same as one iteration of path_integrator::trace, drawing the same random numbers in the same order.
+// Paths that carry on are left in q.active.
+template <typename World>
+void wavefront_bounce(const World &world, const path_integrator &integrator, bool sample_lights, int depth, wavefront_queues &q, std::vector<color_sum> &sums)
+{
+    // Camera rays of neighbouring samples go nearly the same way, so they are traced in packets.
+    // Bounced rays go every which way and are traced one at a time.
+    ray rays[BVH_PACKET_SIZE];
+    hit_record recs[BVH_PACKET_SIZE];
+    bool hits[BVH_PACKET_SIZE];
+    for (size_t start = 0; start < q.active.size(); start += BVH_PACKET_SIZE)
+    {
+        int count = (int)std::min(q.active.size() - start, (size_t)BVH_PACKET_SIZE);
+        if (depth == 0)
+        {
+            for (int r = 0; r < count; r++)
+                rays[r] = q.paths[q.active[start + r]].r;
+            hit_packet(world, rays, count, recs, hits);
+        }
+
+        for (int r = 0; r < count; r++)
+        {
+            uint32_t k = q.active[start + r];
+            const wavefront_path &path = q.paths[k];
+            hit_record &rec = q.hits[k];
+            bool hit;
+            if (depth == 0)
+            {
+                hit = hits[r];
+                rec = recs[r];
+            }
+            else
+            {
+                hit = world.hit_all(path.r, (real)0.001, std::numeric_limits<real>::infinity(), rec);
+            }
+
+            STATS_COUNT(rays, 1);
+            if (hit)
+            {
+                STATS_MATERIAL_HIT(rec.mat->type);
+                uint32_t type = rec.mat->type;
+                if (type >= q.by_material.size())
+                    q.by_material.resize(type + 1);
+                q.by_material[type].push_back(k);
+            }
+            else
+            {
+                STATS_PATH_END(path_end::escaped, depth);
+                sums[path.pixel] += path.throughput * integrator.background(path.r);
+            }
+        }
+    }
+
+    // Shade the hits on one type of material after another, so the same shading code runs over and over.
+    // The paths keep their order within a type, so the light is added up in the same order every time and the image does not change between runs.
+    q.next.clear();
+    q.shadows.clear();
+    for (std::vector<uint32_t> &group : q.by_material)
+    {
+        for (uint32_t k : group)
+        {
+            wavefront_path &path = q.paths[k];
+            const hit_record &rec = q.hits[k];
+
+            ray scattered_ray;
+            color attenuation;
+            path.gen.start_dimension(bounce_dimension(depth, BOUNCE_SCATTER));
+            if (!material_dispatch::scatter(rec.mat, path.r, rec, attenuation, scattered_ray, path.gen))
+            {
+                double weight = 1;
+                if (path.scatter_pdf > 0)
+                {
+                    // The shadow ray from the last surface could have found this light as well
+                    weight = power_heuristic(path.scatter_pdf, integrator.light_pdf(path.scatter_origin, rec));
+                }
+                color emitted = material_dispatch::emitted(rec.mat);
+                STATS_PATH_END(emitted.r() > 0 || emitted.g() > 0 || emitted.b() > 0 ? path_end::emitted : path_end::absorbed, depth);
+                sums[path.pixel] += path.throughput * emitted * weight;
+                continue;
+            }
+
+            path.scatter_pdf = 0;
+            if (sample_lights && material_dispatch::is_diffuse(rec.mat))
+            {
+                wavefront_shadow shadow;
+                if (integrator.prepare_light_sample(rec, depth, path.gen, shadow.r, shadow.distance, shadow.contribution))
+                {
+                    shadow.contribution = path.throughput * shadow.contribution;
+                    shadow.pixel = path.pixel;
+                    q.shadows.push_back(shadow);
+                }
+                path.scatter_pdf = material_dispatch::pdf(rec.mat, rec, scattered_ray.direction());
+                path.scatter_origin = rec.p;
+            }
+
+            path.throughput = path.throughput * attenuation;
+            path.r = scattered_ray;
+            if (integrator.survives(path.throughput, depth, path.gen))
+                q.next.push_back(k);
+        }
+        group.clear();
+    }
+
+    STATS_COUNT(shadow_rays, q.shadows.size());
+    for (const wavefront_shadow &shadow : q.shadows)
+    {
+        if (!world.occluded(shadow.r, (real)0.001, shadow.distance))
+            sums[shadow.pixel] += shadow.contribution;
+    }
+
+    q.active.swap(q.next);
+}
+
+// Render the image a packet of pixels at a time, following all the samples of a packet together one bounce at a time
+// (rather than following each sample to its end before starting the next like render).
+// Every sample has its own generator, so the image is not the same as render's but converges to the same result,
+// and is still the same whatever number of threads is used.
+template <typename World>
+void render_wavefront(const World &world, const camera &cam, const render_settings &settings, framebuffer &image)
+{
+    const path_integrator &integrator = settings.integrator;
+    const bool sample_lights = integrator.light_sampling && !integrator.lights.empty();
+    const int samples = settings.samples_p_pixel;
+    tile_scheduler scheduler(settings.render_area(), WAVEFRONT_PACKET_SIZE);
+
+    int packets_done = 0;
+    std::mutex progress_lock;
+    scheduler.run(settings.num_threads, [&](const tile &t) {
+        const int packet_width = t.x1 - t.x0;
+        const int packet_pixels = packet_width * (t.y1 - t.y0);
+        const int round_samples = std::max(1, WAVEFRONT_MAX_PATHS / packet_pixels);
+        std::vector<color_sum> sums(packet_pixels);
+        // Each thread keeps its queues from packet to packet, rather than allocating them again for every packet
+        static thread_local wavefront_queues q;
+
+        for (int first = 0; first < samples; first += round_samples)
+        {
+            // The camera rays of every pixel of the packet
+            int last = std::min(samples, first + round_samples);
+            q.paths.clear();
+            q.active.clear();
+            for (int p = 0; p < packet_pixels; p++)
+            {
+                int i = t.x0 + p % packet_width;
+                int j = t.y0 + p / packet_width;
+                uint64_t pixel_index = (uint64_t)j * settings.image_width + i;
+                for (int sample = first; sample < last; sample++)
+                {
+                    wavefront_path path = {ray(), color(1, 1, 1), 0, point3(), p,
+                                           settings.pixel_sampler(i, j, rng(settings.seed, pixel_index * samples + sample))};
+                    path.gen.start_sample(sample);
+                    path.r = cam.get_sample_ray(i, j, settings.image_width, settings.image_height, path.gen);
+                    q.active.push_back((uint32_t)q.paths.size());
+                    q.paths.push_back(path);
+                }
+            }
+            q.hits.resize(q.paths.size());
+
+            for (int depth = 0; depth <= integrator.max_depth && !q.active.empty(); depth++)
+            {
+                wavefront_bounce(world, integrator, sample_lights, depth, q, sums);
+            }
+#ifdef RAYTRACE_STATS
+            for (size_t k = 0; k < q.active.size(); k++)
+                STATS_PATH_END(path_end::max_depth, integrator.max_depth + 1);
+#endif
+        }
+
+        for (int p = 0; p < packet_pixels; p++)
+        {
+            image.at(t.x0 + p % packet_width, t.y0 + p / packet_width) = sums[p].average(samples);
+        }
+
+        if (settings.show_progress)
+        {
+            std::lock_guard<std::mutex> guard(progress_lock);
+            std::cerr << "\rRaytracing packet " << ++packets_done << " out of " << scheduler.num_tiles() << std::flush;
+        }
+    });
+}
+
+#endif
\ No newline at end of file